@@ -5,14 +5,44 @@
 #ifndef _B_IO_H
 #define _B_IO_H
 #include <fcntl.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 typedef int b_io_fd;
 
+#define B_DEFAULT_BUFFER_SIZE 4096      // Buffer size of files opened with b_open
+#define B_MAX_BUFFER_SIZE (1024 * 1024) // Largest buffer a file can be opened with
+#define B_MAX_IOVECS 1024               // Most buffers b_readv and b_writev take in one call
+
+#define B_ALLOC_IMMEDIATE 0 // New files get DEFAULT_FILE_BLOCKS when created, more as they grow
+#define B_ALLOC_DELAYED 1   // Writes reserve space, blocks are picked when data is written out
+
+#define B_FALLOC_KEEP_SIZE 1  // b_fallocate allocates the blocks but leaves the file size as it is
+#define B_FALLOC_PUNCH_HOLE 2 // b_fallocate frees the blocks of the range, which then read as zeros
+
+// Readahead state of an open file
+struct b_readahead_stats {
+	int window;                 // Number of blocks read ahead, 0 while access is random
+	uint64_t blocks_read_ahead; // Number of blocks requested from the cache ahead of b_read
+	uint64_t hits;              // Number of read-ahead blocks that b_read then used
+};
+
 b_io_fd b_open (char * filename, int flags);
+b_io_fd b_open_buffered (char * filename, int flags, int buffer_size);
 int b_read (b_io_fd fd, char * buffer, int count);
 int b_write (b_io_fd fd, char * buffer, int count);
+int b_pread (b_io_fd fd, char * buffer, int count, off_t offset);
+int b_pwrite (b_io_fd fd, char * buffer, int count, off_t offset);
+int b_readv (b_io_fd fd, const struct iovec * iov, int iovcnt);
+int b_writev (b_io_fd fd, const struct iovec * iov, int iovcnt);
 int b_seek (b_io_fd fd, off_t offset, int whence);
 int b_move(char* source_file_name, char* destination_file_name);
 int b_close (b_io_fd fd);
+int b_get_readahead_stats (b_io_fd fd, struct b_readahead_stats* stats);
+int b_fallocate (b_io_fd fd, off_t offset, off_t len, int flags);
+int b_ftruncate (b_io_fd fd, off_t length);
+int b_truncate (char * filename, off_t length);
+int b_set_allocation_mode (int mode);
 
 #endif
\ No newline at end of file
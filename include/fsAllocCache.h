@@ -0,0 +1,31 @@
+/**************************************************************
+* Contains the prototype of the functions for the allocation
+* caches each thread keeps in front of the free space map
+**************************************************************/
+#ifndef FSALLOCCACHE_H
+#define FSALLOCCACHE_H
+
+#include <stdint.h>
+
+#define ALLOC_CACHE_RUNS 8          // Runs of free blocks a thread's cache can hold
+#define ALLOC_CACHE_BATCH 64        // Blocks a thread takes from the free space map at once
+#define ALLOC_CACHE_MAX_BLOCKS 256  // Most blocks a thread's cache holds, freed blocks past it go back
+
+// Counters describing how much of the allocation work stays in the threads' caches
+struct alloc_cache_stats {
+    uint64_t allocations;   // Runs handed out by a cache without the free space lock
+    uint64_t frees;         // Freed runs kept by a cache without the free space lock
+    uint64_t refills;       // Batches taken from the free space map
+    uint64_t returned_blocks; // Blocks given back, when a cache was full, at thread exit or under pressure
+    uint64_t reclaims;      // Times the volume ran short and every cache was emptied
+    uint64_t cached_blocks; // Blocks currently held by the caches
+};
+
+int alloc_cache_allocate(int prev_block, int goal_block, int block_count);
+int alloc_cache_free(int start_block, int block_count);
+void alloc_cache_release();
+void alloc_cache_reclaim();
+void alloc_cache_shutdown();
+void alloc_cache_get_stats(struct alloc_cache_stats* stats);
+
+#endif // FSALLOCCACHE_H
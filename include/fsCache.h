@@ -0,0 +1,45 @@
+/**************************************************************
+* Contains the prototype of the functions for the block cache
+* that sits between the file system and LBAread/LBAwrite
+**************************************************************/
+#ifndef FSCACHE_H
+#define FSCACHE_H
+
+#include "fsLow.h"
+
+#define CACHE_DEFAULT_BUDGET (1024 * 1024) // Default memory budget of the cache in bytes
+#define CACHE_BYPASS_BLOCKS 16             // Transfers of this many blocks skip the cache
+#define CACHE_PROTECTED_PERCENT 80         // Share of the cache reserved for re-used blocks
+
+// Counters describing how well the cache is doing
+struct cache_stats {
+    uint64_t hits;           // Blocks served from the cache
+    uint64_t misses;         // Blocks that had to be read from the volume
+    uint64_t lba_reads;      // Number of LBAread calls issued
+    uint64_t lba_writes;     // Number of LBAwrite calls issued
+    uint64_t blocks_read;    // Number of blocks read from the volume
+    uint64_t blocks_written; // Number of blocks written to the volume
+    uint64_t evictions;      // Number of blocks evicted to make room
+    uint64_t write_backs;    // Number of dirty blocks written back to the volume
+    uint64_t capacity;       // Number of blocks the cache can hold
+    uint64_t in_use;         // Number of blocks currently cached
+    uint64_t dirty;          // Number of cached blocks not yet written to the volume
+    uint64_t prefetched;     // Blocks read ahead by cache_prefetch()
+    uint64_t prefetch_hits;  // Read-ahead blocks that were read while still cached
+    uint64_t prefetch_unused; // Read-ahead blocks evicted before they were read
+    uint64_t pinned;         // Blocks held for an uncommitted journal transaction
+};
+
+int cache_init(uint64_t budget_bytes, uint64_t block_size);
+uint64_t cache_read(void* buffer, uint64_t lba_count, uint64_t lba_position);
+uint64_t cache_write(void* buffer, uint64_t lba_count, uint64_t lba_position);
+uint64_t cache_prefetch(uint64_t lba_count, uint64_t lba_position);
+uint64_t cache_volume_read(void* buffer, uint64_t lba_count, uint64_t lba_position);
+uint64_t cache_volume_write(void* buffer, uint64_t lba_count, uint64_t lba_position);
+int cache_flush();
+int cache_pin(uint64_t lba);
+void cache_unpin(uint64_t lba);
+void cache_shutdown();
+void cache_get_stats(struct cache_stats* stats);
+
+#endif // FSCACHE_H
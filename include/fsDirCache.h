@@ -0,0 +1,49 @@
+/**************************************************************
+* Contains the prototype of the functions for the table of
+* directories held in memory
+**************************************************************/
+#ifndef FSDIRCACHE_H
+#define FSDIRCACHE_H
+
+#include "mfs.h"
+#include "fsDirIndex.h"
+
+#define DIR_CACHE_DEFAULT_BUDGET (4 * 1024 * 1024) // Default memory budget of the table in bytes
+#define DIR_CACHE_BUCKETS 64                        // Number of hash buckets (a power of 2)
+
+#define DIR_LOCK_SHARED 0    // Lock a directory to read it, with other readers
+#define DIR_LOCK_EXCLUSIVE 1 // Lock a directory to change it, alone
+
+// Counters describing how well the table is doing
+struct dir_cache_stats {
+    uint64_t hits;        // Requests served by a directory already in memory
+    uint64_t misses;      // Requests that had to load the directory from the volume
+    uint64_t write_backs; // Number of times a changed directory was written to the volume
+    uint64_t blocks_written; // Number of directory blocks written to the volume
+    uint64_t evictions;   // Number of unused directories dropped to stay in the budget
+    uint64_t objects;     // Number of directories currently in memory
+    uint64_t bytes;       // Memory used by the directories currently in memory
+};
+
+int dir_cache_init(size_t budget_bytes);
+DirectoryEntry* dir_cache_get(int start_block, size_t size);
+DirectoryEntry* dir_cache_hold(DirectoryEntry* dir);
+DirectoryEntry* dir_cache_open(int start_block);
+bool dir_cache_loaded(DirectoryEntry* dir);
+DirectoryEntry* dir_cache_adopt(DirectoryEntry* dir, size_t bytes);
+int dir_cache_reserve(DirectoryEntry* dir, int entry_count);
+int dir_cache_grow(DirectoryEntry* dir, int entry_count);
+void dir_cache_release(DirectoryEntry* dir);
+void dir_cache_lock(DirectoryEntry* dir, int mode);
+int dir_cache_trylock(DirectoryEntry* dir, int mode);
+void dir_cache_unlock(DirectoryEntry* dir);
+bool dir_cache_removed(DirectoryEntry* dir);
+void dir_cache_mark_dirty(DirectoryEntry* dir);
+void dir_cache_mark_entry_dirty(DirectoryEntry* dir, int index);
+void dir_cache_forget(int start_block);
+dir_name_index* dir_cache_name_index(DirectoryEntry* dir);
+int dir_cache_flush();
+void dir_cache_shutdown();
+void dir_cache_get_stats(struct dir_cache_stats* stats);
+
+#endif // FSDIRCACHE_H
@@ -0,0 +1,30 @@
+/**************************************************************
+* Contains the prototype of the functions for the name index
+* kept for each directory in memory
+**************************************************************/
+#ifndef FSDIRINDEX_H
+#define FSDIRINDEX_H
+
+#include <stdbool.h>
+#include "mfs.h"
+
+// The names of a directory hashed to their slots, and the slots that are free
+typedef struct {
+    int* buckets;              // Slot named in each bucket, or one of the markers below
+    unsigned int* bucket_hash; // Hash of the name in each bucket
+    int bucket_count;          // Number of buckets (a power of 2)
+    int deleted_buckets;       // Buckets freed since the table was built
+    int* slot_bucket;          // Bucket holding the name of each slot, -1 if it is unused
+    int slot_count;            // Number of slots in the directory
+    int* free_slots;           // Stack of unused slots, the lowest on top after a build
+    int free_count;            // Number of entries on the stack
+    bool* slot_on_stack;       // Whether each slot is on the stack
+} dir_name_index;
+
+int dir_index_build(dir_name_index* index, DirectoryEntry* dir, int slot_count);
+void dir_index_free(dir_name_index* index);
+int dir_index_find(dir_name_index* index, DirectoryEntry* dir, const char* name);
+void dir_index_update(dir_name_index* index, DirectoryEntry* dir, int slot);
+int dir_index_free_slot(dir_name_index* index, DirectoryEntry* dir);
+
+#endif // FSDIRINDEX_H
@@ -6,6 +6,7 @@
 
 #include <sys/types.h> // For mode_t and other standard POSIX types
 #include <time.h>      // For time management functions
+#include <stdbool.h>   // For the dirty block flags
 #include "mfs.h"       // File system specific definitions and declarations
 
 // Function prototypes for filesystem directory operations
@@ -14,13 +15,24 @@
 DirectoryEntry* create_directory(DirectoryEntry* parent, int number_dir_entries); 
 
 // Function to initialize space requirements
-void init_space_block_needed(int entries);
+void init_space_block_needed(int entries, int* block_needed, int* actual_DE_num);
 
 //load root directory to memory
 int load_root_directory(); 
 DirectoryEntry* load_dir(DirectoryEntry* dir);
+void lock_dir(DirectoryEntry* dir, int mode);
+void unlock_dir(DirectoryEntry* dir);
 void write_dir(DirectoryEntry* dir);
+void write_dir_entry(DirectoryEntry* dir, int index);
 int write_dir_helper(DirectoryEntry* dir);
-int load_dir_helper(DirectoryEntry* dir, int start_block);
+int write_dir_blocks(DirectoryEntry* dir, const bool* dirty_blocks);
+int dir_block_count(int entry_count);
+int dir_entries_in_blocks(int block_count);
+void dir_entry_blocks(int index, int* first_block, int* last_block);
+size_t dir_stored_size(DirectoryEntry* entry);
+int load_dir_helper(DirectoryEntry* dir, int start_block, int entry_count);
+int read_dir_block(int volume_block, DirectoryEntry* entries);
+bool compact_dirs();
+int grow_directory(DirectoryEntry* dir);
 
 #endif // FSDIRECTORY_H
\ No newline at end of file
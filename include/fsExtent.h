@@ -0,0 +1,42 @@
+/**************************************************************
+* Contains the prototype of the functions for the extent map
+* of a file's blocks
+**************************************************************/
+#ifndef FSEXTENT_H
+#define FSEXTENT_H
+
+#include "mfs.h"
+
+// A run of consecutive volume blocks holding consecutive blocks of a file
+// A run whose start_block is FILE_NO_BLOCKS is a hole, its blocks read as zeros
+typedef struct {
+    int logical_block; // Index of the first file block in the run
+    int start_block;   // Volume block holding that file block
+    int length;        // Number of blocks in the run
+} file_extent;
+
+// The blocks of a file as a sorted list of runs
+typedef struct {
+    file_extent* extents; // Runs in file order
+    int count;            // Number of runs in use
+    int capacity;         // Number of runs allocated
+    int total_blocks;     // Number of file blocks covered by the runs
+    int last_extent;      // Run of the last lookup, where the next sequential lookup starts
+    int* block_extent;    // Run holding each file block, built on the first random lookup
+    int block_capacity;   // Number of file blocks block_extent has room for
+} extent_map;
+
+int extent_map_init(extent_map* map, DirectoryEntry* entry);
+void extent_map_free(extent_map* map);
+int extent_map_lookup(extent_map* map, int logical_block, int* run_length);
+int extent_map_last_block(extent_map* map);
+int extent_map_prev_block(extent_map* map, int logical_block);
+int extent_map_next_block(extent_map* map, int logical_block);
+int extent_map_insert(extent_map* map, int logical_block, int start_block, int length);
+int extent_map_punch(extent_map* map, int logical_block, int length);
+int extent_map_unstored_hole(extent_map* map, int* length);
+int extent_map_complete(extent_map* map);
+void extent_map_store(extent_map* map, DirectoryEntry* entry);
+void clear_inline_extents(DirectoryEntry* entry);
+
+#endif // FSEXTENT_H
@@ -0,0 +1,27 @@
+/**************************************************************
+* Contains the prototype of the functions for the free space index
+* that is kept next to the FAT
+**************************************************************/
+#ifndef FSFREEINDEX_H
+#define FSFREEINDEX_H
+
+#define FREE_FIT_FIRST 0       // Lowest run of free blocks that is long enough
+#define FREE_FIT_BEST 1        // Shortest run of free blocks that is long enough
+#define FREE_INDEX_BUCKETS 32  // Number of extent size classes (powers of 2)
+#define FREE_GROUP_BLOCKS 2048 // Number of blocks in an allocation group
+
+int free_index_build(int number_of_blocks);
+void free_index_release();
+void free_index_mark_used(int block);
+void free_index_mark_free(int block);
+void free_index_add_extent(int block);
+int free_index_first_free(int from_block);
+int free_index_run_length(int start_block, int max_blocks);
+int free_index_find_run(int block_count, int policy);
+int free_index_free_count();
+int free_index_find_run_near(int goal_block, int block_count);
+int free_index_group_count();
+int free_index_group_free(int group);
+int free_index_emptiest_group();
+
+#endif // FSFREEINDEX_H
@@ -3,10 +3,31 @@
 **************************************************************/
 #include "mfs.h"
 
+#define FAT_FLUSH_IMMEDIATE 0 // Write changed FAT blocks at the end of every operation
+#define FAT_FLUSH_DEFERRED 1  // Hold changed FAT blocks until flush_freespace() is called
+#define MORE_BLOCKS_DEFAULT 5 // Number of blocks a chain is extended by when it runs out
+
 int initialize_freespace(uint64_t numberOfBlocks, uint64_t blockSize);
 int allocate_freespace(int requested_block_count);
+int allocate_freespace_near(int goal_block, int requested_block_count);
+int insert_freespace(int prev_block, int next_block, int goal_block, int requested_block_count);
+int insert_reserved_freespace(int prev_block, int next_block, int goal_block,
+                              int requested_block_count, int reserved_count);
+int directory_goal_block(int parent_block);
+int unlink_freespace(int prev_block, int first_block, int last_block, int next_block);
+int reserve_freespace(int block_count);
+void release_reserved_freespace(int block_count);
 int clear_freespace(int start_block);
+int take_freespace_run(int goal_block, int block_count);
+void return_freespace_run(int start_block, int block_count);
 int load_freespace();
 int allocation_validity_checks(int requested_block_count);
 int clear_validity_checks(int start_block);
-int allocate_more_blocks(int current_block, int current_size);
\ No newline at end of file
+int allocate_more_blocks(int last_block, int current_size, int block_count);
+void set_FAT_entry(int index, int value);
+int flush_freespace();
+int set_freespace_flush_mode(int mode);
+void free_freespace();
+void update_freespace_counters();
+void lock_freespace();
+void unlock_freespace();
\ No newline at end of file
@@ -3,7 +3,10 @@
 **************************************************************/
 #include "mfs.h"
 
-int calculate_number_of_FAT_blocks(uint64_t numberOfBlocks, uint64_t blockSize);
+int calculate_number_of_FAT_blocks(uint64_t numberOfBlocks, uint64_t blockSize, int entrySize);
+int get_FAT_entry_size();
 int allocation_validity_checks(int requested_block_count);
 int clear_validity_checks(int start_block);
-int get_next_block(int current_block, int current_size);
\ No newline at end of file
+int get_next_block(int current_block, int current_size);
+int get_contiguous_run(int start_block, int max_blocks);
+int get_chain_length(int start_block);
\ No newline at end of file
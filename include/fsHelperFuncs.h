@@ -9,8 +9,14 @@ void clear_bit(unsigned char* fs_freespace, int block_num);
 int get_bit(unsigned char* fs_freespace, int block_num);
 void free_memory();
 int parse_path(char* path_name, struct parse_path_return_data* parse_path_info);
+int lock_parent(struct parse_path_return_data* parse_path_info, int mode);
+void lock_tree();
+void unlock_tree();
+void lock_cwd();
+void unlock_cwd();
 int get_DE_index(DirectoryEntry* dir_array, char* token);
 int get_available_DE_index(DirectoryEntry* dir_array);
 int is_DE_a_directory(DirectoryEntry* dir);
 int is_DE_exist(DirectoryEntry *parent, char *name);
 void free_directory(DirectoryEntry* dir);
+void fill_stat_from_DE(DirectoryEntry* entry, struct fs_stat* buf);
@@ -0,0 +1,59 @@
+/**************************************************************
+* Contains the prototype of the functions for the metadata
+* journal and the layout of its blocks on the volume
+**************************************************************/
+#ifndef FSJOURNAL_H
+#define FSJOURNAL_H
+
+#include <stdbool.h>
+
+#include "mfs.h"
+
+#define JOURNAL_DEFAULT_BLOCKS 256    // Blocks reserved for the journal on a new volume
+#define JOURNAL_GROUP_OPS 8           // Operations sharing one commit
+#define JOURNAL_MAGIC 0x4C4E524A      // Marks every journal block ("JRNL")
+
+#define JOURNAL_SUPERBLOCK 1          // First block of the journal, where replay starts
+#define JOURNAL_DESCRIPTOR 2          // First block of a transaction, lists the blocks logged
+#define JOURNAL_COMMIT 3              // Last block of a transaction, it is valid once written
+
+// Number of block numbers a descriptor holds
+#define JOURNAL_DESCRIPTOR_SLOTS ((BLOCK_SIZE - 5 * sizeof(uint32_t)) / sizeof(uint32_t))
+
+// Layout shared by the first words of every journal block
+typedef struct {
+    uint32_t magic;     // JOURNAL_MAGIC
+    uint32_t type;      // JOURNAL_SUPERBLOCK, JOURNAL_DESCRIPTOR or JOURNAL_COMMIT
+    uint32_t volume_id; // Set when the volume is formatted, tells stale blocks apart
+    uint32_t sequence;  // Superblock: first transaction to replay. Others: their transaction
+    uint32_t value;     // Superblock: where that transaction starts in the journal
+                        // Descriptor: number of blocks logged. Commit: checksum
+} journal_header;
+
+typedef struct {
+    journal_header header;
+    uint32_t blocks[JOURNAL_DESCRIPTOR_SLOTS]; // Volume block of each logged block, in order
+} journal_descriptor;
+
+// Counters describing what the journal did
+struct journal_stats {
+    uint64_t operations;  // Operations that ended with journal_end()
+    uint64_t commits;     // Transactions written to the journal
+    uint64_t blocks_logged; // Metadata blocks written to the journal
+    uint64_t forced_commits; // Commits made because a transaction was full
+    uint64_t checkpoints; // Times the journal was emptied after writing its blocks in place
+    uint64_t replayed;    // Transactions replayed at mount
+};
+
+int journal_format(int start_block, int block_count);
+int journal_mount();
+uint64_t journal_write(void* buffer, uint64_t lba_count, uint64_t lba_position);
+bool journal_hold_block(uint64_t block);
+void journal_begin();
+void journal_end();
+int journal_commit();
+int journal_checkpoint();
+int journal_shutdown();
+void journal_get_stats(struct journal_stats* stats);
+
+#endif // FSJOURNAL_H
@@ -0,0 +1,38 @@
+/**************************************************************
+* Contains the prototype of the functions for the path lookup
+* cache used by parse_path
+**************************************************************/
+#ifndef FSPATHCACHE_H
+#define FSPATHCACHE_H
+
+#include "mfs.h"
+
+#define PATH_CACHE_SLOTS 512   // Number of lookups the cache remembers (a power of 2)
+
+#define PATH_CACHE_MISS 0      // The lookup isn't cached
+#define PATH_CACHE_FOUND 1     // The name exists in the directory
+#define PATH_CACHE_NOT_FOUND 2 // The name is known not to exist in the directory
+
+// What is known about a name in a directory
+struct path_cache_result {
+    int index;       // Index of the entry in its directory
+    int start_block; // Start block of the entry
+    size_t size;     // Size of the entry
+    FileType is_dir; // Whether the entry is a directory
+};
+
+// Counters describing how well the cache is doing
+struct path_cache_stats {
+    uint64_t hits;          // Lookups answered with an existing entry
+    uint64_t negative_hits; // Lookups answered with a name that doesn't exist
+    uint64_t misses;        // Lookups that had to search the directory
+    uint64_t invalidations; // Entries dropped because their directory changed
+};
+
+int path_cache_lookup(int dir_block, const char* name, struct path_cache_result* result);
+void path_cache_insert(int dir_block, const char* name, int index, DirectoryEntry* entry);
+void path_cache_invalidate(int dir_block);
+void path_cache_clear();
+void path_cache_get_stats(struct path_cache_stats* stats);
+
+#endif // FSPATHCACHE_H
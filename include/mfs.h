@@ -21,10 +21,12 @@ typedef u_int64_t uint64_t;
 typedef u_int32_t uint32_t;
 #endif
 
-#define MAX_DIR_ENTRIES 50
+#define MAX_DIR_ENTRIES 50       // Number of entries a new directory starts with
+#define DIR_ENTRIES_LIMIT 65536  // Number of entries a directory can grow to
 #define BLOCK_SIZE 512       // Size of a single block in bytes
 #define MAX_NAME_SIZE 20     // The maximum sizeof the file/directory name
 #define MAX_FILE_SIZE 100000 // File size limit (100,000 bytes)
+#define FILE_NO_BLOCKS 0     // Start block of a file that has no data blocks yet (block 0 is the VCB)
 
 // Used for b_seek behaviors
 #define B_SEEK_START 0 // Seek to the beginning of the file
@@ -37,9 +39,24 @@ typedef enum {
     FILE_TYPE_DIRECTORY = 1
 } FileType;
 
+#define DE_INLINE_EXTENTS 7        // Number of extents stored in a directory entry
+#define DE_EXTENT_MAGIC 0x31545845 // Marks a directory entry whose extents are valid ("EXT1")
+
+// A run of consecutive volume blocks belonging to a file
+typedef struct {
+	int start_block;          // First volume block of the run
+	int length;               // Number of blocks in the run
+} DiskExtent;
+
 // Structure for directory entry
+// The extent fields use space that was part of name[256] on older volumes, so the layout and
+// size of the structure are unchanged and old entries simply lack DE_EXTENT_MAGIC
 typedef struct {
-	char name[256];           // Directory name
+	char name[192];           // Directory name
+	unsigned int extent_magic;       // DE_EXTENT_MAGIC when the extents below are valid
+	unsigned short num_extents;      // Number of valid extents
+	unsigned short extent_reserved;  // Unused, keeps the extents aligned
+	DiskExtent extents[DE_INLINE_EXTENTS]; // First runs of the file's blocks, in file order
 	size_t size;              // File size in bytes
 	int start_block;          // Start block of the file/directory in the filesystem
 	FileType is_dir;          // Indicates if the entry is a directory                   
@@ -48,6 +65,35 @@ typedef struct {
 	time_t access_time;       // Time of last access
 } DirectoryEntry;
 
+#define DE_COMPACT_EXTENTS 2 // Number of extents stored in a compact directory entry
+
+// Structure for directory entry on volumes of format FS_FORMAT_COMPACT_DIRS
+// Directories are still DirectoryEntry arrays in memory, entries are converted as directory
+// blocks are loaded and written. Names are limited to MAX_NAME_SIZE, block numbers, sizes
+// and times take 4 bytes, and entries never straddle two blocks
+typedef struct {
+	char name[MAX_NAME_SIZE + 1]; // Directory name, empty when the entry is unused
+	unsigned char is_dir;         // FileType of the entry
+	unsigned char num_extents;    // Number of valid extents
+	unsigned char reserved;       // Unused, keeps the fields below aligned
+	uint32_t size;                // File size in bytes
+	uint32_t start_block;         // Start block of the file/directory in the filesystem
+	uint32_t creation_time;       // Time of creation
+	uint32_t modification_time;   // Time of last modification
+	uint32_t access_time;         // Time of last access
+	uint32_t extent_start[DE_COMPACT_EXTENTS];        // First runs of the file's blocks,
+	unsigned short extent_length[DE_COMPACT_EXTENTS]; // in file order
+} CompactDirectoryEntry;
+
+#define DE_COMPACT_PER_BLOCK (BLOCK_SIZE / sizeof(CompactDirectoryEntry)) // Entries in a block
+
+#define VCB_FORMAT_MAGIC 0x32544146 // Marks a VCB that carries a format version ("FAT2")
+#define FS_FORMAT_FAT16 1           // 2-byte FAT entries, up to 65,535 blocks
+#define FS_FORMAT_FAT32 2           // 4-byte FAT entries
+#define FS_FORMAT_COMPACT_DIRS 3    // 4-byte FAT entries and CompactDirectoryEntry directories
+#define FS_FORMAT_JOURNAL 4         // Same as FS_FORMAT_COMPACT_DIRS plus a metadata journal
+#define FS_FORMAT_CURRENT FS_FORMAT_JOURNAL // Format used for new volumes
+
 // This is the Volume Control Block struct for the file system
 typedef struct {
 	char volume_name[100]; 					// volume name
@@ -60,6 +106,10 @@ typedef struct {
 	int num_of_freespace_blocks; 			// number of freespace blocks
 	int location_of_rootdir; 				// location of root directory
 	int root_blocks; 						// number of blocks root dir occupies
+	unsigned int format_magic; 				// VCB_FORMAT_MAGIC, absent on volumes without a format version
+	unsigned int format_version; 			// on-disk format, selects the size of the FAT entries
+	int journal_start; 						// location of the journal (FS_FORMAT_JOURNAL and later)
+	int journal_blocks; 					// number of blocks the journal occupies
 } VCB;
 
 struct parse_path_return_data{
@@ -83,10 +133,14 @@ struct fs_diriteminfo {
 // calls the function readdir, you give the next entry in the directory
 typedef struct {
 	unsigned short  d_reclen;		  // length of this record
-	unsigned short	dirEntryPosition; // which directory entry position, like file pos
-	DirectoryEntry * directory;		  // pointer to the loaded directory you want to iterate
+	int             dirEntryPosition; // which directory entry position, like file pos
+	DirectoryEntry * directory;		  // pointer to the directory you want to iterate, from the directory table
 	struct fs_diriteminfo * di;		  // Pointer to the structure you return from read
-	int number_DE;                    // number of directory entries in the loaded directory
+	int number_DE;                    // number of directory entries in the directory
+	DirectoryEntry * block_entries;   // entries of the block read last, while the directory isn't loaded
+	int buffered_block;               // index of the directory block in block_entries, -1 if none
+	int chain_block;                  // index of a directory block on the way to the next one to read
+	int chain_volume_block;           // volume block of the directory block chain_block
 } fdDir;
 
 
@@ -101,11 +155,12 @@ struct fs_stat {
 };
 
 extern VCB *fs_vcb; // Volume Control Block
-extern unsigned short *fs_freespace; // Freespace map
+extern unsigned int *fs_freespace; // Freespace map
 extern DirectoryEntry* fs_dir_root; // Root directory
 extern DirectoryEntry* fs_dir_curr; // Current directory
 
 int fs_stat(const char *path, struct fs_stat *buf);
+int fs_stat_batch(const char *dirpath, char *names[], int count, struct fs_stat *bufs);
 
 // Key directory functions
 int fs_mkdir(const char *pathname, mode_t mode);
@@ -114,6 +169,7 @@ int fs_rmdir(const char *pathname);
 // Directory iteration functions
 fdDir * fs_opendir(const char *pathname);
 struct fs_diriteminfo *fs_readdir(fdDir *dirp);
+struct fs_diriteminfo *fs_readdirplus(fdDir *dirp, struct fs_stat *statbuf);
 int fs_closedir(fdDir *dirp);
 
 // Misc directory functions
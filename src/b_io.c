@@ -7,9 +7,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sched.h>
+#include <pthread.h>
 
 #include "../include/b_io.h"
 #include "../include/fsDirectory.h"
@@ -17,56 +20,712 @@
 #include "../include/mfs.h"
 #include "../include/fsHelperFuncs.h"
 #include "../include/fsLow.h"
+#include "../include/fsCache.h"
 #include "../include/fsFreespaceHelper.h"
+#include "../include/fsExtent.h"
+#include "../include/fsPathCache.h"
+#include "../include/fsDirCache.h"
+#include "../include/fsJournal.h"
 
 #define MAXFCBS 20
 #define B_CHUNK_SIZE 512
 #define DEFAULT_FILE_BLOCKS 20
+#define GROW_MAX_BLOCKS 64       // Most blocks a growing chain is extended by at once
+#define READAHEAD_MIN_BLOCKS 4   // Readahead window once reads become sequential
+#define READAHEAD_MAX_BLOCKS 64  // Largest the readahead window grows to
 
 typedef struct b_fcb {
 	DirectoryEntry* fi;        // Holds the low level file system info
-	char * buf;		           // Holds the open file buffer
-	int buffer_offset;		   // Holds the current position in the buffer
-	int buffer_len;		       // Holds how many valid bytes are in the buffer
-	int current_block;         // Holds the current block number
+	char * buf;		           // Holds the open file buffer, buffer_blocks consecutive blocks of the file
+	int buffer_blocks;         // Holds how many blocks the buffer can hold
+	int buffer_first_block;    // Holds the index of the file block at the start of the buffer
+	short* block_valid;        // Holds how many bytes from the start of each buffer block are valid
+	bool* block_dirty;         // Holds whether each buffer block has changes the volume doesn't have
+	int dirty_blocks;          // Holds how many buffer blocks are dirty
+	int buffer_offset;		   // Holds the current position in the current block
 	int num_blocks;            // Holds how many blocks the file occupies
 	int block_index;		   // Holds the current block index
 	int access_mode;           // Holds the file access mode
 	int file_index;            // Holds the index of file in dir_array
-    bool need_to_write_block;  // Flag to indicate whether the current block needs to be written before being changed
+	DirectoryEntry* parent;    // Holds the directory containing the file, shared with its other users
+	extent_map map;            // Holds the runs of volume blocks that make up the file
+	bool delayed_allocation;   // Holds whether blocks are picked only when data is written out
+	int reserved_blocks;       // Holds how many blocks without volume blocks are reserved
+	int entry_start_block;     // Holds the start block the file's entry had when it was opened
+	int tail_block;            // Holds the last volume block of the file's chain, -1 until known
+	int grow_blocks;           // Holds how many blocks the chain is extended by next
+	int grow_first_block;      // Holds the first file block linked ahead of the writes, -1 if none
+	int ra_window;             // Holds how many blocks to read ahead, 0 while access is random
+	int ra_expected_position;  // Holds the position a sequential read would start at
+	int ra_next_block;         // Holds the file block after the last one read ahead
+	int ra_hit_block;          // Holds the first read-ahead block not yet counted as used
+	uint64_t ra_blocks;        // Holds how many blocks were read ahead
+	uint64_t ra_hits;          // Holds how many read-ahead blocks b_read used
+	bool in_use;               // Holds whether the FCB is taken, from b_getFCB until b_close
+	pthread_mutex_t lock;      // Holds the FCB for one call at a time
 } b_fcb;
 	
 b_fcb fcbArray[MAXFCBS];
-struct parse_path_return_data parse_path_info;
-int parent_index;
-int startup = 0;  // Indicates that this has not been initialized
+pthread_once_t startup = PTHREAD_ONCE_INIT;  // Initializes the FCBs once
+pthread_mutex_t fcb_table_lock = PTHREAD_MUTEX_INITIALIZER; // Guards in_use and allocation_mode
+int allocation_mode = B_ALLOC_DELAYED; // How files opened from now on get their blocks
 
 // Method to initialize our file system
 void b_init () {
 	// init fcbArray to free all
 	for (int i = 0; i < MAXFCBS; i++) {
 		fcbArray[i].buf = NULL; // Indicates a free fcbArray
+		fcbArray[i].fi = NULL;
+		fcbArray[i].in_use = false;
+		pthread_mutex_init(&fcbArray[i].lock, NULL);
 	}
-		
-	startup = 1;
 }
 
 // Method to get a free FCB element
+// The FCB is taken until release_FCB, two threads opening files never get the same one
 b_io_fd b_getFCB () {
+	pthread_mutex_lock(&fcb_table_lock);
 	for (int i = 0; i < MAXFCBS; i++) {
-		if (fcbArray[i].buf == NULL) {
+		if (!fcbArray[i].in_use) {
+			fcbArray[i].in_use = true;
+			pthread_mutex_unlock(&fcb_table_lock);
 			return i;	
 		}
 	}
+	pthread_mutex_unlock(&fcb_table_lock);
 	return (-1);  // All in use
 }
+
+// Method to give back an FCB element
+static void release_FCB (b_io_fd fd) {
+	pthread_mutex_lock(&fcb_table_lock);
+	fcbArray[fd].in_use = false;
+	pthread_mutex_unlock(&fcb_table_lock);
+}
+
+/*
+ * The file position of an FCB is block_index * B_CHUNK_SIZE + buffer_offset.
+ *
+ * buf holds buffer_blocks consecutive blocks of the file, starting with buffer_first_block.
+ * Small writes are copied into it and only reach the volume when the buffer has to move to
+ * other blocks, on b_seek away from it and on b_close. The dirty blocks are then written with
+ * one call per run of blocks that are consecutive on the volume.
+ *
+ * block_valid tracks, for each block in the buffer, how many bytes from the start of the block
+ * hold the file's data. A write that starts at or before that point just extends it, so a block
+ * that is written from its start doesn't have to be read first. The rest of a block is read from
+ * the volume only when it's needed: to read from it, to write past a gap, or to write back a
+ * block whose end still holds data of the file.
+ *
+ * Delayed allocation (B_ALLOC_DELAYED): creating a file takes no blocks, its start_block is
+ * FILE_NO_BLOCKS. Writing a block that has no volume block only reserves a free block
+ * (reserve_freespace), so a full volume is still reported by b_write. The blocks are chosen
+ * when the buffer is written out, each run of dirty blocks at once with insert_freespace(),
+ * which continues the run before them. A file written in one go and closed gets a single run,
+ * whatever the sizes of the writes were. With B_ALLOC_IMMEDIATE a new file gets
+ * DEFAULT_FILE_BLOCKS right away and the chain grows ahead of the writes, by twice as many blocks
+ * each time the file outgrows it (up to GROW_MAX_BLOCKS). b_close frees the blocks it didn't use.
+ *
+ * tail_block keeps the end of the chain, so the chain is extended without walking it. It is
+ * known at open when the runs in the directory entry reach the end of the chain, otherwise the
+ * first append maps the rest of the chain once. O_APPEND moves every write to the end of the
+ * file, which is only its size.
+ *
+ * Files can be sparse: blocks that were never written, or were punched out, are holes in the
+ * extent map (fsExtent.c) and read as zeros without touching the volume. Writing past the end
+ * of the file leaves a hole over the blocks it skips, and b_ftruncate frees the blocks past
+ * the new end.
+ *
+ * Every call on a file descriptor holds the lock of its FCB, so an open file is used by one
+ * thread at a time while different files are used in parallel. The public functions check the
+ * descriptor, take the lock and call the function doing the work (seek_file, write_file, ...),
+ * which calls the others without locking again. What a call works with lives in the FCB or on
+ * its stack, the structures the files share (the free space map, the directories, the journal
+ * and the block cache) take their own locks. The entry of the file in its parent is only read
+ * or changed with the parent locked: at open, when it is looked up or created, and at close.
+ *
+ * b_pread and b_pwrite take the position of the call instead of using the file position, which
+ * they leave where it was, so threads sharing a descriptor don't need a b_seek before each
+ * call. The position is passed down to the transfer (read_range, write_range), and the
+ * readahead only follows the reads made at the file position. b_readv and b_writev move
+ * several buffers as one transfer, holding the lock once.
+ */
+
+// Give volume blocks to the file blocks from first_block up to end_block that have none,
+// whether they are in a hole or past the end of the chain. Each range without blocks is
+// allocated as a single run, linked into the chain between the blocks around it
+// With zero_blocks set the new blocks are written with zeros, for callers that don't write
+// them right away
+static int allocate_file_range(b_io_fd fd, int first_block, int end_block, bool zero_blocks) {
+	b_fcb* fcb = &fcbArray[fd];
+
+	if ((end_block - 1) * B_CHUNK_SIZE >= MAX_FILE_SIZE) {
+		fprintf(stderr, "Unable to allocate more blocks, at maximum size: %d\n", MAX_FILE_SIZE);
+		return -1;
+	}
+
+	// The chain may change in the middle, all of it must be mapped
+	extent_map_complete(&fcb->map);
+
+	int block = first_block;
+	while (block < end_block) {
+		int run_length;
+		if (extent_map_lookup(&fcb->map, block, &run_length) != -1) {
+			block += run_length;
+			continue;
+		}
+
+		int block_count = run_length < end_block - block ? run_length : end_block - block;
+
+		// The blocks reserved for the file's buffered data are the first to be allocated
+		int reserved = block_count < fcb->reserved_blocks ? block_count : fcb->reserved_blocks;
+
+		int prev_block = extent_map_prev_block(&fcb->map, block);
+		int next_block = extent_map_next_block(&fcb->map, block + block_count);
+		// Without blocks around them, the new blocks go near the file's directory
+		int goal_block = prev_block != -1 ? prev_block :
+						 next_block != -1 ? next_block : fcb->parent[0].start_block;
+		int start_block = insert_reserved_freespace(prev_block, next_block, goal_block,
+													block_count, reserved);
+		if (start_block == -1)
+			return -1;
+		fcb->reserved_blocks -= reserved;
+
+		// Blocks before all the others start the chain
+		if (prev_block == -1) {
+			fcb->fi->start_block = start_block;
+		}
+
+		// On a fragmented volume the new blocks can be several runs, map each of them
+		int run_block = start_block;
+		int linked = 0;
+		while (linked < block_count) {
+			int length = get_contiguous_run(run_block, block_count - linked);
+
+			if (extent_map_insert(&fcb->map, block + linked, run_block, length) != 0)
+				return -1;
+
+			if (zero_blocks) {
+				char* zeros = calloc(length, B_CHUNK_SIZE);
+				int written = zeros == NULL ? 0 : cache_write(zeros, length, run_block);
+
+				free(zeros);
+				if (written != length) {
+					fprintf(stderr, "LBAwrite failure while writing to the volume\n");
+					return -1;
+				}
+			}
+
+			// Blocks after all the others end the chain
+			if (linked + length == block_count && next_block == -1) {
+				fcb->tail_block = run_block + length - 1;
+			}
+
+			linked += length;
+			run_block = fs_freespace[run_block + length - 1];
+		}
+
+		block += block_count;
+	}
+
+	return 0;
+}
+
+// Free the volume blocks of the file blocks from first_block up to end_block, which become a
+// hole. A hole that reaches the end of the chain is simply past it
+static int release_file_range(b_io_fd fd, int first_block, int end_block) {
+	b_fcb* fcb = &fcbArray[fd];
+
+	// The chain changes in the middle, all of it must be mapped
+	if (end_block > extent_map_complete(&fcb->map))
+		end_block = fcb->map.total_blocks;
+	if (first_block >= end_block)
+		return 0;
+
+	int prev_block = extent_map_prev_block(&fcb->map, first_block);
+	int last_block = extent_map_prev_block(&fcb->map, end_block);
+	int next_block = extent_map_next_block(&fcb->map, end_block);
+
+	// Unless the range is a hole already, unlink its blocks from the chain and free them
+	if (last_block != -1 && last_block != prev_block) {
+		int first_block_freed = prev_block == -1 ? fcb->fi->start_block : (int)fs_freespace[prev_block];
+
+		if (unlink_freespace(prev_block, first_block_freed, last_block, next_block) != 0)
+			return -1;
+
+		// Blocks at the start of the chain were freed, or blocks at its end
+		if (prev_block == -1) {
+			fcb->fi->start_block = next_block == -1 ? FILE_NO_BLOCKS : next_block;
+		}
+		if (next_block == -1) {
+			fcb->tail_block = prev_block;
+		}
+	}
+
+	return extent_map_punch(&fcb->map, first_block, end_block - first_block);
+}
+
+// Link blocks after the end of the chain, which reaches up to block_index
+// Each time the file outgrows them twice as many are linked, up to GROW_MAX_BLOCKS
+static int grow_chain(b_io_fd fd, int block_index) {
+	b_fcb* fcb = &fcbArray[fd];
+
+	if (fcb->tail_block == -1)
+		fcb->tail_block = extent_map_last_block(&fcb->map);
+
+	// Files end in the block holding byte MAX_FILE_SIZE
+	int block_count = fcb->grow_blocks;
+	if (block_count > MAX_FILE_SIZE / B_CHUNK_SIZE + 1 - block_index)
+		block_count = MAX_FILE_SIZE / B_CHUNK_SIZE + 1 - block_index;
+
+	int tail_block = allocate_more_blocks(fcb->tail_block, block_index * B_CHUNK_SIZE, block_count);
+	if (tail_block == -1)
+		return -1;
+
+	fcb->tail_block = tail_block;
+	if (fcb->grow_first_block == -1)
+		fcb->grow_first_block = block_index;
+
+	fcb->grow_blocks *= 2;
+	if (fcb->grow_blocks > GROW_MAX_BLOCKS)
+		fcb->grow_blocks = GROW_MAX_BLOCKS;
+
+	return 0;
+}
+
+// Volume block holding block_index of the file, -1 if it is in a hole or past the chain
+// When extend is set, a block is allocated for block_index if it has none
+// If run_length isn't NULL, it is set to the number of file blocks that follow on the volume,
+// for -1 to the number of blocks left in the hole
+static int locate_block(b_io_fd fd, int block_index, bool extend, int* run_length) {
+	b_fcb* fcb = &fcbArray[fd];
+	int volume_block = extent_map_lookup(&fcb->map, block_index, run_length);
+
+	if (volume_block != -1 || !extend)
+		return volume_block;
+
+	// Immediate allocation links blocks ahead of the writes when the block is right after the
+	// end of the chain (the lookup mapped all of it). The extra blocks aren't zeroed, so only
+	// when the chain already reaches the end of the file
+	if (!fcb->delayed_allocation && fcb->map.count > 0 &&
+		block_index == fcb->map.total_blocks &&
+		(size_t)block_index * B_CHUNK_SIZE >= fcb->fi->size) {
+		if (grow_chain(fd, block_index) != 0)
+			return -1;
+
+		return extent_map_lookup(&fcb->map, block_index, run_length);
+	}
+
+	// Otherwise the block is allocated on its own, in a hole, after a gap or delayed
+	if (allocate_file_range(fd, block_index, block_index + 1, false) != 0)
+		return -1;
+
+	return extent_map_lookup(&fcb->map, block_index, run_length);
+}
+
+// Make sure block_index of the file can be written out before its data is buffered
+// With delayed allocation a block without a volume block is only reserved, otherwise it is
+// allocated right away
+static int reserve_file_block(b_io_fd fd, int block_index) {
+	b_fcb* fcb = &fcbArray[fd];
+
+	if (!fcb->delayed_allocation)
+		return locate_block(fd, block_index, true, NULL) == -1 ? -1 : 0;
+
+	if (extent_map_lookup(&fcb->map, block_index, NULL) != -1)
+		return 0;
+
+	if (block_index * B_CHUNK_SIZE >= MAX_FILE_SIZE) {
+		fprintf(stderr, "Unable to allocate more blocks, at maximum size: %d\n", MAX_FILE_SIZE);
+		return -1;
+	}
+
+	if (reserve_freespace(1) != 0)
+		return -1;
+
+	fcb->reserved_blocks++;
+	return 0;
+}
+
+// Fill in the rest of a buffer block after its valid bytes
+// Only bytes that are part of the file are read from the volume, past the end of the file
+// the block is filled with zeros
+static int load_buffer_block(b_io_fd fd, int slot) {
+	b_fcb* fcb = &fcbArray[fd];
+	int valid = fcb->block_valid[slot];
+	char* block = fcb->buf + slot * B_CHUNK_SIZE;
+	int block_index = fcb->buffer_first_block + slot;
+	int volume_block = -1;
+
+	if (valid == B_CHUNK_SIZE)
+		return 0;
+
+	if ((size_t)block_index * B_CHUNK_SIZE + valid < fcb->fi->size)
+		volume_block = locate_block(fd, block_index, false, NULL);
+
+	if (volume_block == -1) {
+		memset(block + valid, 0, B_CHUNK_SIZE - valid);
+	} else {
+		char volume_data[B_CHUNK_SIZE];
+
+		if (cache_read(volume_data, 1, volume_block) != 1) {
+			fprintf(stderr, "LBAread failure while reading from the volume\n");
+			return -1;
+		}
+
+		// The valid bytes are newer than what the volume has
+		memcpy(block + valid, volume_data + valid, B_CHUNK_SIZE - valid);
+	}
+
+	fcb->block_valid[slot] = B_CHUNK_SIZE;
+	return 0;
+}
+
+// Write the dirty buffer blocks to the volume, one call per run of blocks that are
+// consecutive in the file and on the volume
+static int flush_buffer(b_io_fd fd) {
+	b_fcb* fcb = &fcbArray[fd];
+	int slot = 0;
+
+	while (fcb->dirty_blocks > 0 && slot < fcb->buffer_blocks) {
+		// Skip clean blocks
+		if (!fcb->block_dirty[slot]) {
+			slot++;
+			continue;
+		}
+
+		// Find the run of dirty blocks, completing any that are only partly valid
+		int run_end = slot;
+		while (run_end < fcb->buffer_blocks && fcb->block_dirty[run_end]) {
+			if (load_buffer_block(fd, run_end) != 0)
+				return -1;
+			run_end++;
+		}
+
+		// A delayed allocation picks the blocks of the whole run at once
+		if (fcb->delayed_allocation &&
+			allocate_file_range(fd, fcb->buffer_first_block + slot,
+								fcb->buffer_first_block + run_end, false) != 0) {
+			fprintf(stderr, "Failed to allocate more blocks.\n");
+			return -1;
+		}
+
+		// Write the run in pieces that are consecutive on the volume
+		while (slot < run_end) {
+			int run_length;
+			int volume_block = locate_block(fd, fcb->buffer_first_block + slot, true, &run_length);
+
+			if (volume_block == -1) {
+				fprintf(stderr, "Failed to allocate more blocks.\n");
+				return -1;
+			}
+			if (run_length > run_end - slot)
+				run_length = run_end - slot;
+
+			if (cache_write(fcb->buf + slot * B_CHUNK_SIZE, run_length, volume_block) != run_length) {
+				fprintf(stderr, "LBAwrite failure while writing to the volume\n");
+				return -1;
+			}
+
+			for (int i = slot; i < slot + run_length; i++)
+				fcb->block_dirty[i] = false;
+			fcb->dirty_blocks -= run_length;
+			slot += run_length;
+		}
+	}
+
+	return 0;
+}
+
+// Make the buffer hold block_index of the file and return its slot in the buffer
+// If the buffer holds other blocks, they are written out and the buffer starts at block_index
+static int buffer_slot(b_io_fd fd, int block_index) {
+	b_fcb* fcb = &fcbArray[fd];
+
+	if (block_index < fcb->buffer_first_block ||
+		block_index >= fcb->buffer_first_block + fcb->buffer_blocks) {
+		if (flush_buffer(fd) != 0)
+			return -1;
+
+		fcb->buffer_first_block = block_index;
+		memset(fcb->block_valid, 0, fcb->buffer_blocks * sizeof(short));
+	}
+
+	return block_index - fcb->buffer_first_block;
+}
+
+// Forget the buffer blocks among block_count blocks from block_index, the volume has newer data
+static void drop_buffer_blocks(b_io_fd fd, int block_index, int block_count) {
+	b_fcb* fcb = &fcbArray[fd];
+
+	for (int i = 0; i < fcb->buffer_blocks; i++) {
+		int buffer_block = fcb->buffer_first_block + i;
+
+		if (buffer_block >= block_index && buffer_block < block_index + block_count) {
+			if (fcb->block_dirty[i])
+				fcb->dirty_blocks--;
+			fcb->block_dirty[i] = false;
+			fcb->block_valid[i] = 0;
+		}
+	}
+}
+
+// Whether any dirty buffer block is among block_count blocks from block_index
+static bool buffer_has_dirty_blocks(b_io_fd fd, int block_index, int block_count) {
+	b_fcb* fcb = &fcbArray[fd];
+
+	for (int i = 0; fcb->dirty_blocks > 0 && i < fcb->buffer_blocks; i++) {
+		int buffer_block = fcb->buffer_first_block + i;
+
+		if (fcb->block_dirty[i] && buffer_block >= block_index &&
+			buffer_block < block_index + block_count)
+			return true;
+	}
+
+	return false;
+}
+
+// Release the buffer of an FCB
+static void free_buffer(b_io_fd fd) {
+	free(fcbArray[fd].buf);
+	fcbArray[fd].buf = NULL;
+	free(fcbArray[fd].block_valid);
+	fcbArray[fd].block_valid = NULL;
+	free(fcbArray[fd].block_dirty);
+	fcbArray[fd].block_dirty = NULL;
+}
+
+// Write zeros over the bytes of the file from from_position up to to_position
+// Blocks only partly in the range are read and written back, the others are written whole,
+// one call per run of consecutive volume blocks. Holes already read as zeros
+static int zero_file_range(b_io_fd fd, int from_position, int to_position) {
+	if (from_position >= to_position)
+		return 0;
+
+	int block = from_position / B_CHUNK_SIZE;
+	int end_block = retrieve_num_of_blocks(to_position, B_CHUNK_SIZE);
+
+	// The volume must have the buffer's changes, and the buffer must not keep stale bytes
+	if (flush_buffer(fd) != 0)
+		return -1;
+	drop_buffer_blocks(fd, block, end_block - block);
+
+	char* zeros = NULL;
+
+	while (block < end_block) {
+		int run_length;
+		int volume_block = locate_block(fd, block, false, &run_length);
+		int block_position = block * B_CHUNK_SIZE;
+
+		if (run_length > end_block - block)
+			run_length = end_block - block;
+
+		if (volume_block == -1) {
+			block += run_length;
+			continue;
+		}
+
+		// Part of a block
+		if (from_position > block_position || to_position < block_position + B_CHUNK_SIZE) {
+			char data[B_CHUNK_SIZE];
+			int start = from_position > block_position ? from_position - block_position : 0;
+			int end = to_position < block_position + B_CHUNK_SIZE ?
+					  to_position - block_position : B_CHUNK_SIZE;
+
+			if (cache_read(data, 1, volume_block) != 1) {
+				fprintf(stderr, "LBAread failure while reading from the volume\n");
+				free(zeros);
+				return -1;
+			}
+
+			memset(data + start, 0, end - start);
+
+			if (cache_write(data, 1, volume_block) != 1) {
+				fprintf(stderr, "LBAwrite failure while writing to the volume\n");
+				free(zeros);
+				return -1;
+			}
+
+			block++;
+			continue;
+		}
+
+		// Whole blocks, up to the one holding to_position
+		if (run_length > (to_position - block_position) / B_CHUNK_SIZE)
+			run_length = (to_position - block_position) / B_CHUNK_SIZE;
+
+		if (zeros == NULL) {
+			zeros = calloc(end_block - block, B_CHUNK_SIZE);
+			if (zeros == NULL) {
+				fprintf(stderr, "Memory allocation failed for zero blocks.\n");
+				return -1;
+			}
+		}
+
+		if (cache_write(zeros, run_length, volume_block) != run_length) {
+			fprintf(stderr, "LBAwrite failure while writing to the volume\n");
+			free(zeros);
+			return -1;
+		}
+
+		block += run_length;
+	}
+
+	free(zeros);
+	return 0;
+}
+
+// Change the size of the file to length bytes
+// The blocks past the new end are freed, growing the file leaves a hole that reads as zeros
+static int truncate_file(b_io_fd fd, int length) {
+	b_fcb* fcb = &fcbArray[fd];
+	int keep_blocks = retrieve_num_of_blocks(length, B_CHUNK_SIZE);
+
+	if (length < (int)fcb->fi->size) {
+		// Buffered changes past the new end are never written out
+		drop_buffer_blocks(fd, keep_blocks, INT_MAX - keep_blocks);
+
+		if (flush_buffer(fd) != 0 || release_file_range(fd, keep_blocks, INT_MAX) != 0)
+			return -1;
+	}
+	// The bytes past the old end may still hold older data, unless they are in a hole
+	else if (zero_file_range(fd, fcb->fi->size, length) != 0) {
+		return -1;
+	}
+
+	fcb->fi->size = length;
+	fcb->num_blocks = keep_blocks;
+	fcb->fi->modification_time = time(NULL);
+
+	return 0;
+}
+
+// Free the blocks holding the bytes from from_position up to to_position, which then read
+// as zeros. Blocks only partly in the range keep their volume blocks, the bytes are zeroed
+static int punch_hole(b_io_fd fd, int from_position, int to_position) {
+	b_fcb* fcb = &fcbArray[fd];
+
+	if (to_position > (int)fcb->fi->size)
+		to_position = fcb->fi->size;
+	if (from_position >= to_position)
+		return 0;
+
+	// Whole blocks of the range, the last block of the file is whole up to its end
+	int first_block = retrieve_num_of_blocks(from_position, B_CHUNK_SIZE);
+	int end_block = to_position == (int)fcb->fi->size ?
+					retrieve_num_of_blocks(to_position, B_CHUNK_SIZE) : to_position / B_CHUNK_SIZE;
+
+	if (first_block >= end_block)
+		return zero_file_range(fd, from_position, to_position);
+
+	// Buffered changes to the freed blocks are never written out
+	drop_buffer_blocks(fd, first_block, end_block - first_block);
+
+	if (zero_file_range(fd, from_position, first_block * B_CHUNK_SIZE) != 0 ||
+		zero_file_range(fd, end_block * B_CHUNK_SIZE, to_position) != 0)
+		return -1;
+
+	return release_file_range(fd, first_block, end_block);
+}
+
+// Give blocks of zeros to the holes the directory entry has no room for, the FAT that maps
+// the rest of the file can't describe them
+static int fill_unstored_holes(b_io_fd fd) {
+	b_fcb* fcb = &fcbArray[fd];
+	int hole_block;
+	int hole_length;
+
+	extent_map_complete(&fcb->map);
+
+	while ((hole_block = extent_map_unstored_hole(&fcb->map, &hole_length)) != -1) {
+		if (allocate_file_range(fd, hole_block, hole_block + hole_length, true) != 0) {
+			fprintf(stderr, "Failed to fill the holes of the file.\n");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Readahead: when a read starts where the previous one ended, the blocks that follow it are
+ * read into the block cache before they are asked for, so a sequential reader pays one LBAread
+ * per window and not one per block.
+ * The window starts at READAHEAD_MIN_BLOCKS and doubles, up to READAHEAD_MAX_BLOCKS, each time
+ * half of it has been used while the reads stay sequential. The first read anywhere else drops
+ * it back to 0.
+ */
+static void read_ahead(b_io_fd fd, int position, int count) {
+	b_fcb* fcb = &fcbArray[fd];
+	int first_block = position / B_CHUNK_SIZE;
+	int end_block = (position + count + B_CHUNK_SIZE - 1) / B_CHUNK_SIZE;
+
+	// Count the blocks of this read that were read ahead
+	int hit_start = first_block > fcb->ra_hit_block ? first_block : fcb->ra_hit_block;
+	int hit_end = end_block < fcb->ra_next_block ? end_block : fcb->ra_next_block;
+	if (hit_end > hit_start) {
+		fcb->ra_hits += hit_end - hit_start;
+		fcb->ra_hit_block = hit_end;
+	}
+
+	// Detect the access pattern
+	if (position != fcb->ra_expected_position) {
+		fcb->ra_window = 0;
+		fcb->ra_next_block = end_block;
+		fcb->ra_hit_block = end_block;
+	} else if (fcb->ra_window == 0) {
+		fcb->ra_window = READAHEAD_MIN_BLOCKS;
+	}
+	fcb->ra_expected_position = position + count;
+
+	// Read ahead again only once less than half a window is left past this read
+	if (fcb->ra_window == 0 || fcb->ra_next_block - end_block >= fcb->ra_window / 2)
+		return;
+
+	int block = fcb->ra_next_block > end_block ? fcb->ra_next_block : end_block;
+
+	// Blocks before a gap in the read-ahead region were never read ahead
+	if (block > fcb->ra_next_block)
+		fcb->ra_hit_block = block;
+
+	int last_block = end_block + fcb->ra_window;
+	int file_blocks = retrieve_num_of_blocks(fcb->fi->size, B_CHUNK_SIZE);
+	if (last_block > file_blocks)
+		last_block = file_blocks;
+
+	// Read ahead each run of consecutive volume blocks with a single call
+	while (block < last_block) {
+		int run_length;
+		int volume_block = extent_map_lookup(&fcb->map, block, &run_length);
+		if (run_length > last_block - block)
+			run_length = last_block - block;
+
+		// Holes have nothing to read
+		if (volume_block != -1) {
+			cache_prefetch(run_length, volume_block);
+			fcb->ra_blocks += run_length;
+		}
+		block += run_length;
+	}
+	fcb->ra_next_block = block;
+
+	// The pattern held, read further ahead next time
+	if (fcb->ra_window < READAHEAD_MAX_BLOCKS)
+		fcb->ra_window *= 2;
+}
 	
 // Interface to open a buffered file
 // Modification of interface for this assignment, flags match the Linux flags for open
 // O_RDONLY, O_WRONLY, or O_RDWR
 b_io_fd b_open (char * filename, int flags) {
-    if (startup == 0) b_init();  // Initialize system
+	return b_open_buffered(filename, flags, B_DEFAULT_BUFFER_SIZE);
+}
 
+static int close_file (b_io_fd fd);
+
+// Open a file for b_open_buffered, the journal operation is begun by the caller when the
+// file may be created
+static b_io_fd open_file (char * filename, int flags, int buffer_size) {
     // Check if the filename is longer than the maximum size set
     if (strlen(filename) > MAX_NAME_SIZE) {
         fprintf(stderr, "Filename exceeds the maximum length.\n");
@@ -74,34 +733,67 @@ b_io_fd b_open (char * filename, int flags) {
     }
 
 	b_io_fd returnFd;
+	struct parse_path_return_data parse_path_info;
+
+	pthread_mutex_lock(&fcb_table_lock);
+	int mode = allocation_mode;
+	pthread_mutex_unlock(&fcb_table_lock);
 
     // Invalid path check
     if (parse_path(filename, &parse_path_info) != 0) {
         return -1;
     }
+
+	// Creating the file changes the parent, only looking it up reads it
+	// The parent was removed meanwhile
+	if (lock_parent(&parse_path_info, (flags & O_CREAT) ? DIR_LOCK_EXCLUSIVE : DIR_LOCK_SHARED) != 0) {
+		free_directory(parse_path_info.parent);
+		return -1;
+	}
 	int index = parse_path_info.last_element_index;
 
 	// Check invalid cases if file/dir is not found
 	if (index < 0) {
 		if (flags & O_RDONLY) {
             fprintf(stderr, "Read only: file not found.\n");
+			unlock_dir(parse_path_info.parent);
+			free_directory(parse_path_info.parent);
 			return -2;
 		}
 		if (!(flags & O_CREAT)) {
             fprintf(stderr, "Create flag is not set, new file cannot be created.\n");
+			unlock_dir(parse_path_info.parent);
+			free_directory(parse_path_info.parent);
 			return -2;
 		}
 	} else { // Check if DE is a directory
 		if (parse_path_info.parent[index].is_dir == FILE_TYPE_DIRECTORY) {
 			printf("%s is a directory and can't be opened as a file.\n", 
 			parse_path_info.parent[index].name);
+			unlock_dir(parse_path_info.parent);
+			free_directory(parse_path_info.parent);
 			return -2;
 		}
 	}
 	// Allocate memory for the buffer
-	char* buf = malloc(B_CHUNK_SIZE);
-	if (buf == NULL) {
+	int buffer_blocks = retrieve_num_of_blocks(buffer_size, B_CHUNK_SIZE);
+	if (buffer_blocks < 1) {
+		buffer_blocks = 1;
+	}
+	if (buffer_blocks > B_MAX_BUFFER_SIZE / B_CHUNK_SIZE) {
+		buffer_blocks = B_MAX_BUFFER_SIZE / B_CHUNK_SIZE;
+	}
+
+	char* buf = malloc(buffer_blocks * B_CHUNK_SIZE);
+	short* block_valid = calloc(buffer_blocks, sizeof(short));
+	bool* block_dirty = calloc(buffer_blocks, sizeof(bool));
+	if (buf == NULL || block_valid == NULL || block_dirty == NULL) {
         fprintf(stderr, "Buffer malloc failed\n");
+		free(buf);
+		free(block_valid);
+		free(block_dirty);
+		unlock_dir(parse_path_info.parent);
+		free_directory(parse_path_info.parent);
 		return -1;
 	}
 
@@ -109,6 +801,11 @@ b_io_fd b_open (char * filename, int flags) {
 	// Check for error - all used FCBs			
 	if (returnFd == -1) {
         fprintf(stderr, "No free FCB available.\n");
+		free(buf);
+		free(block_valid);
+		free(block_dirty);
+		unlock_dir(parse_path_info.parent);
+		free_directory(parse_path_info.parent);
 		return -1;
 	}
 
@@ -117,6 +814,12 @@ b_io_fd b_open (char * filename, int flags) {
 
 	if (fcbArray[returnFd].fi == NULL) {
         fprintf(stderr, "Malloc for fileInfo failed.\n");
+		free(buf);
+		free(block_valid);
+		free(block_dirty);
+		unlock_dir(parse_path_info.parent);
+		free_directory(parse_path_info.parent);
+		release_FCB(returnFd);
 		return -1;
 	}
 
@@ -125,20 +828,30 @@ b_io_fd b_open (char * filename, int flags) {
 	if (index > -1) {
 		memcpy(fcbArray[returnFd].fi, &parse_path_info.parent[index], sizeof(DirectoryEntry));
 		fcbArray[returnFd].file_index = index;
-        parent_index = index;
 	} else {
 		int new_file_index = get_available_DE_index(parse_path_info.parent);
+		int start_block = -1;
 
 		// Check if there's any available DE
-		if (new_file_index == -1) {
-			return -1; // No available DE
+		// With delayed allocation the file gets its blocks once data is written to it
+		if (new_file_index != -1) {
+			start_block = mode == B_ALLOC_DELAYED ?
+						  FILE_NO_BLOCKS :
+						  allocate_freespace_near(parse_path_info.parent[0].start_block,
+												  DEFAULT_FILE_BLOCKS);
 		}
 
-		int start_block = allocate_freespace(DEFAULT_FILE_BLOCKS);
-
-		// Check if there's enough free space available
+		// Check if there's an available DE and enough free space
 		if (start_block == -1) {
-			return -1; // No free space left
+			free(fcbArray[returnFd].fi);
+			fcbArray[returnFd].fi = NULL;
+			free(buf);
+			free(block_valid);
+			free(block_dirty);
+			unlock_dir(parse_path_info.parent);
+			free_directory(parse_path_info.parent);
+			release_FCB(returnFd);
+			return -1; // No available DE or no free space left
 		}
 
 		time_t current_time = time(NULL);
@@ -151,46 +864,104 @@ b_io_fd b_open (char * filename, int flags) {
 		parse_path_info.parent[new_file_index].access_time = current_time;
 		parse_path_info.parent[new_file_index].modification_time = current_time;
 		strcpy(parse_path_info.parent[new_file_index].name, parse_path_info.last_element_name);
+		clear_inline_extents(&parse_path_info.parent[new_file_index]);
 
-		write_dir(parse_path_info.parent);
+		write_dir_entry(parse_path_info.parent, new_file_index);
+		path_cache_invalidate(parse_path_info.parent[0].start_block);
 
 		memcpy(fcbArray[returnFd].fi, &parse_path_info.parent[new_file_index], 
 		sizeof(DirectoryEntry));
 		fcbArray[returnFd].file_index = new_file_index;
-        parent_index = new_file_index;
 	}
 
+	unlock_dir(parse_path_info.parent);
+
+	// The FCB keeps the parent until the file is closed, b_close updates the file's entry in it
+	fcbArray[returnFd].parent = parse_path_info.parent;
+
 	// Initialize fcbArray entries
 	fcbArray[returnFd].buf = buf;
-	fcbArray[returnFd].buffer_len = 0;
+	fcbArray[returnFd].buffer_blocks = buffer_blocks;
+	fcbArray[returnFd].buffer_first_block = 0;
+	fcbArray[returnFd].block_valid = block_valid;
+	fcbArray[returnFd].block_dirty = block_dirty;
+	fcbArray[returnFd].dirty_blocks = 0;
 	fcbArray[returnFd].buffer_offset = 0;
 	fcbArray[returnFd].block_index = 0;
-	fcbArray[returnFd].current_block = fcbArray[returnFd].fi->start_block;
 	fcbArray[returnFd].num_blocks = retrieve_num_of_blocks(fcbArray[returnFd].fi->size, B_CHUNK_SIZE);
 	fcbArray[returnFd].access_mode = flags;
-    fcbArray[returnFd].need_to_write_block = false;
+	fcbArray[returnFd].delayed_allocation = mode == B_ALLOC_DELAYED;
+	fcbArray[returnFd].reserved_blocks = 0;
+	fcbArray[returnFd].entry_start_block = fcbArray[returnFd].fi->start_block;
+	fcbArray[returnFd].tail_block = -1;
+	fcbArray[returnFd].grow_blocks = MORE_BLOCKS_DEFAULT;
+	fcbArray[returnFd].grow_first_block = -1;
+	fcbArray[returnFd].ra_window = 0;
+	fcbArray[returnFd].ra_expected_position = 0;
+	fcbArray[returnFd].ra_next_block = 0;
+	fcbArray[returnFd].ra_hit_block = 0;
+	fcbArray[returnFd].ra_blocks = 0;
+	fcbArray[returnFd].ra_hits = 0;
+
+	// Map the file's blocks so positions can be found without walking the FAT
+	if (extent_map_init(&fcbArray[returnFd].map, fcbArray[returnFd].fi) != 0) {
+		free(fcbArray[returnFd].fi);
+		fcbArray[returnFd].fi = NULL;
+		free_buffer(returnFd);
+		free_directory(fcbArray[returnFd].parent);
+		fcbArray[returnFd].parent = NULL;
+		release_FCB(returnFd);
+		return -1;
+	}
+
+	// The end of the chain is known when the runs from the directory entry reach it
+	int last_block = extent_map_last_block(&fcbArray[returnFd].map);
+	if (last_block != -1 && fs_freespace[last_block] == (unsigned int)last_block) {
+		fcbArray[returnFd].tail_block = last_block;
+	}
+
+	// If O_TRUNC is set, truncate the file size to 0 and free its blocks
+	// A file that couldn't be truncated isn't opened, closing it records the blocks it lost
+	if ((flags & O_TRUNC) && truncate_file(returnFd, 0) != 0) {
+		close_file(returnFd);
+		return -1;
+	}
 
-	// If O_TRUNC is set, truncate the file size to 0
-	if (flags & O_TRUNC) {
-		fcbArray[returnFd].fi->size = 0;
+	// If O_APPEND is set, start at the end of the file
+	if (flags & O_APPEND) {
+		fcbArray[returnFd].block_index = fcbArray[returnFd].fi->size / B_CHUNK_SIZE;
+		fcbArray[returnFd].buffer_offset = fcbArray[returnFd].fi->size % B_CHUNK_SIZE;
 	}
 
 	return (returnFd);	// All set
 	}
 
+// Interface to open a buffered file with a buffer of buffer_size bytes
+// The size is rounded up to whole blocks, a larger buffer absorbs more small writes before
+// they are written to the volume
+b_io_fd b_open_buffered (char * filename, int flags, int buffer_size) {
+	pthread_once(&startup, b_init);  // Initialize system
 
-// Interface to seek function	
-int b_seek (b_io_fd fd, off_t offset, int whence) {
+	if (!(flags & O_CREAT)) {
+		return open_file(filename, flags, buffer_size);
+	}
+
+	// A new entry and its blocks commit together
+	journal_begin();
+	b_io_fd fd = open_file(filename, flags, buffer_size);
+	journal_end();
+
+	return fd;
+}
+
+
+// Move the file position, for b_seek
+static int seek_file (b_io_fd fd, off_t offset, int whence) {
 	int new_file_pointer; // Variable to hold the new file pointer after seek
 
-	if (startup == 0) b_init();  // Initialize system
-	
 	// Check if the file is open
     if (fcbArray[fd].fi == NULL)  return -1;
 
-	// check that fd is between 0 and (MAXFCBS-1)
-	if ((fd < 0) || (fd >= MAXFCBS)) return -1; // Invalid file descriptor
-
 	// Calculate actual file pointer
 	int curr_file_pointer=(fcbArray[fd].block_index * B_CHUNK_SIZE)+fcbArray[fd].buffer_offset;
 	
@@ -214,65 +985,42 @@ int b_seek (b_io_fd fd, off_t offset, int whence) {
 	// Ensure not to seek to a negative value
 	if(new_file_pointer < 0) return -1;
 
-	// Check if the buffer is dirty, if so write it to the volume
-	if(fcbArray[fd].need_to_write_block){
-		if (LBAwrite(fcbArray[fd].buf,1,fcbArray[fd].current_block) != 1) {
-			fprintf(stderr, "LBAwrite failure while writing to the volume\n");
+	int new_block_index = new_file_pointer / B_CHUNK_SIZE;
+	int new_buff_offset = new_file_pointer % B_CHUNK_SIZE;
+
+	// Leaving the blocks held in the buffer, write out the changes made to them
+	// Blocks past the end of the chain are only allocated once they are written
+	if (new_block_index < fcbArray[fd].buffer_first_block ||
+		new_block_index >= fcbArray[fd].buffer_first_block + fcbArray[fd].buffer_blocks) {
+		if (flush_buffer(fd) != 0)
 			return -1;
-		}
-		fcbArray[fd].need_to_write_block = false;
 	}
 
-	int new_block_index = (retrieve_num_of_blocks(new_file_pointer, B_CHUNK_SIZE) - 1);
-	int new_buff_offset = new_file_pointer % B_CHUNK_SIZE;
-
-	// Update the file descriptor information to match the new location of the file pointer
-	// if moving from the current block
-	if((new_block_index != fcbArray[fd].block_index) ){
-		int temp_curr_block;
-		int num_block_to_move;
-		
-		// If we seek to a block before the current block
-		if(new_block_index < fcbArray[fd].block_index){	
-			// Start from start_block, then get blocks until the new block index		
-			temp_curr_block = fcbArray[fd].fi->start_block;	
-			num_block_to_move = new_block_index;
-		}
-		// If we seek beyond the current block
-		else if(new_block_index > fcbArray[fd].block_index){
-			// Start from current_block, then get blocks until the new block index
-			temp_curr_block = fcbArray[fd].current_block;
-			num_block_to_move = new_block_index - fcbArray[fd].block_index;
-		}
-		// Get the new current block 
-		for(int i=0; i< num_block_to_move; i++)
-			temp_curr_block = get_next_block(temp_curr_block, fcbArray[fd].fi->size);
-
-		// Change the information of the current block to match the new block
-		fcbArray[fd].block_index = new_block_index;
-		fcbArray[fd].current_block = temp_curr_block;
-		fcbArray[fd].buffer_len = 0;
-	}
-	// Update the bufffer offset to the new buffer offset
+	// Update the block index and the bufffer offset to the new position
+	fcbArray[fd].block_index = new_block_index;
 	fcbArray[fd].buffer_offset = new_buff_offset;
 	
 	return (0); 
 }
 
-// Interface to write function
-// b_io_fd: file descriptor
-// buffer: data to write to file
-// count: number of bytes to write
-int b_write(b_io_fd fd, char *buffer, int count) {
-    // Initialize system
-    if (startup == 0)
-        b_init();
+// Interface to seek function	
+int b_seek (b_io_fd fd, off_t offset, int whence) {
+	// check that fd is between 0 and (MAXFCBS-1)
+	if ((fd < 0) || (fd >= MAXFCBS)) return -1; // Invalid file descriptor
 
-    // Check that fd is a valid file descriptor
-    if (fd < 0 || fd >= MAXFCBS) {
-        return -1;
-    }
+	pthread_once(&startup, b_init);  // Initialize system
+
+	pthread_mutex_lock(&fcbArray[fd].lock);
+	int result = seek_file(fd, offset, whence);
+	pthread_mutex_unlock(&fcbArray[fd].lock);
+
+	return result;
+}
 
+// Write count bytes at *position from the buffers of iov, each one after the other, and move
+// *position past what was written, for write_file and b_pwrite. count is the total length of
+// the buffers. Only the FCB's buffer is used, the file position isn't read or moved
+static int write_range(b_io_fd fd, const struct iovec * iov, int count, int * position) {
     // Check if file is open
     if (fcbArray[fd].fi == NULL) {
         return -1;
@@ -284,8 +1032,24 @@ int b_write(b_io_fd fd, char *buffer, int count) {
         return -1;
     }
 
-    // Track where in the caller buffer to read next
-    int caller_buffer_offset = 0;
+    // With O_APPEND every write goes to the end of the file, wherever it was asked for
+    if (fcbArray[fd].access_mode & O_APPEND) {
+        *position = fcbArray[fd].fi->size;
+    }
+
+    // Writing past the end of the file, the bytes it skips must read as zeros. The blocks
+    // that have none stay holes
+    if (*position > (int)fcbArray[fd].fi->size &&
+        zero_file_range(fd, fcbArray[fd].fi->size, *position) != 0) {
+        return -1;
+    }
+
+    int block_index = *position / BLOCK_SIZE;
+    int buffer_offset = *position % BLOCK_SIZE;
+
+    // Track the caller buffer being written and how much of it was used
+    int segment = 0;
+    size_t segment_offset = 0;
 
     // Track the number of bytes written to the volume
     int bytes_written_to_volume = 0;
@@ -294,111 +1058,131 @@ int b_write(b_io_fd fd, char *buffer, int count) {
 	// buffer to the file's buffer, or written to the volume
     int number_of_bytes_moved = 0;
 
-    // Loop while there are bytes to write from the caller's buffer
+    // Loop while there are bytes to write from the caller's buffers
     while (count > 0) {
-        // If the file's buffer is empty and at least BLOCK_SIZE (512) 
-		// bytes needs to be written, directly write to the volume
-        if (fcbArray[fd].buffer_offset == 0 && count >= BLOCK_SIZE) {
-            // Write one block to the volume
-            // Check if LBAwrite is successful
-            if (LBAwrite(buffer + caller_buffer_offset, 1,fcbArray[fd].current_block) != 1) {
-                // Print the error
-                fprintf(stderr, "LBAwrite failure while writing to the volume\n");
-                // Exit the function
-                return bytes_written_to_volume;
-            }
-
-            // An entire block was written
-            number_of_bytes_moved = BLOCK_SIZE;
+        // Move on to the next caller buffer once this one is used up
+        if (segment_offset == iov[segment].iov_len) {
+            segment++;
+            segment_offset = 0;
+            continue;
+        }
 
-            // Move to the next volume block
-            int next_block = get_next_block(fcbArray[fd].current_block, fcbArray[fd].fi->size);
+        char* buffer = (char*) iov[segment].iov_base + segment_offset;
+        int available = iov[segment].iov_len - segment_offset;
+        if (available > count)
+            available = count;
+
+        // If the position is at the start of a block and more whole blocks need to be
+		// written than the file's buffer can hold, directly write to the volume
+        if (buffer_offset == 0 &&
+            available >= fcbArray[fd].buffer_blocks * BLOCK_SIZE) {
+            // Make sure the chain reaches the current block and find how many of the
+            // whole blocks to write are next to each other on the volume
+            // A delayed allocation picks all of them first, so they are allocated as one run
+            int run_length;
+            int volume_block = -1;
+            if (!fcbArray[fd].delayed_allocation ||
+                allocate_file_range(fd, block_index,
+                                    block_index + available / BLOCK_SIZE, false) == 0)
+                volume_block = locate_block(fd, block_index, true, &run_length);
 
             // Check if more blocks were allocated
-            if (next_block == -1) {
+            if (volume_block == -1) {
                 // Print the error
                 fprintf(stderr, "Failed to allocate more blocks.\n");
-                // Exit the function
-                return bytes_written_to_volume;
+                // Exit the loop
+                break;
             }
 
-            // Assign the next block
-            fcbArray[fd].current_block = next_block;
+            if (run_length > available / BLOCK_SIZE)
+                run_length = available / BLOCK_SIZE;
+
+            // The run overwrites these blocks, what the buffer holds for them is out of date
+            drop_buffer_blocks(fd, block_index, run_length);
+
+            // Write the run of blocks to the volume with a single call
+            // Check if LBAwrite is successful
+            if (cache_write(buffer, run_length, volume_block) != run_length) {
+                // Print the error
+                fprintf(stderr, "LBAwrite failure while writing to the volume\n");
+                // Exit the loop
+                break;
+            }
 
-            // Increment the number of blocks written to
-            fcbArray[fd].block_index++;
+            // The whole run was written, move to the block after it
+            number_of_bytes_moved = run_length * BLOCK_SIZE;
+            block_index += run_length;
         }
-        // Can't directly write a block from the buffer to the volume, 
-		// write a portion of a block
+        // Copy a portion of a block to the file's buffer
         else {
-            // Check if the file's buffer is empty
-            if (fcbArray[fd].buffer_offset == 0) {
-                // Load the current block to the buffer
-                // Check if LBAread is successful
-                if (LBAread(fcbArray[fd].buf,1,fcbArray[fd].current_block) != 1) {
-                    // Print the error
-                    fprintf(stderr, "LBAread failure while reading from the volume\n");
-                    // Exit the function
-                    return bytes_written_to_volume;
-                }
+            // Find the block in the buffer, writing out the buffer if it has to move
+            int slot = buffer_slot(fd, block_index);
+            if (slot == -1) {
+                // Exit the loop
+                break;
+            }
+
+            // A block in a hole or past the chain is completed with zeros before it gets a
+            // volume block, what that block holds isn't part of the file
+            if (!fcbArray[fd].block_dirty[slot] &&
+                locate_block(fd, block_index, false, NULL) == -1 &&
+                load_buffer_block(fd, slot) != 0) {
+                // Exit the loop
+                break;
+            }
+
+            // Link or reserve the block the first time it is changed, so running out of
+            // space is reported by the write and not when the buffer is written out
+            if (!fcbArray[fd].block_dirty[slot] &&
+                reserve_file_block(fd, block_index) != 0) {
+                // Print the error
+                fprintf(stderr, "Failed to allocate more blocks.\n");
+                // Exit the loop
+                break;
             }
 
-            // Calculate the number of bytes to copy to the current buffer
-            number_of_bytes_moved = BLOCK_SIZE - fcbArray[fd].buffer_offset;
+            // Calculate the number of bytes to copy to the current block
+            number_of_bytes_moved = BLOCK_SIZE - buffer_offset;
 
-            // Check if the number of bytes left to copy are less than the remaining size in the buffer
-            if (count < number_of_bytes_moved)
+            // Check if the number of bytes left to copy are less than the remaining size in the block
+            if (available < number_of_bytes_moved)
                 // If so, track the smaller value
-                number_of_bytes_moved = count;
+                number_of_bytes_moved = available;
+
+            // Writing past a gap after the valid bytes needs the rest of the block first,
+            // otherwise the block is built up from its start without reading it
+            if (buffer_offset > fcbArray[fd].block_valid[slot] &&
+                load_buffer_block(fd, slot) != 0) {
+                // Exit the loop
+                break;
+            }
 
             // Copy from the caller's buffer to the file's buffer
-            memcpy(fcbArray[fd].buf + fcbArray[fd].buffer_offset,buffer + caller_buffer_offset, 
-			number_of_bytes_moved);
+            memcpy(fcbArray[fd].buf + slot * BLOCK_SIZE + buffer_offset,
+			buffer, number_of_bytes_moved);
 
             // Increment the file pointer offset
-            fcbArray[fd].buffer_offset += number_of_bytes_moved;
-
-            // Set the flag indicating that the buffer needs to be written (for seek and close)
-            fcbArray[fd].need_to_write_block = true;
-
-            // Check if the file's buffer is full
-            if (fcbArray[fd].buffer_offset == BLOCK_SIZE) {
-                // Write the file's buffer to the volume
-                // Check if LBAwrite is successful
-                if (LBAwrite(fcbArray[fd].buf,1,fcbArray[fd].current_block) != 1) {
-                    // Print the error
-                    fprintf(stderr, "LBAwrite failure while writing to the volume\n");
-                    // Exit the function
-                    return bytes_written_to_volume;
-                }
-
-                // Reset the flag, since this block was just written
-                fcbArray[fd].need_to_write_block = false;
-
-                // Set the file pointer offset to 0 to indicate an empty block
-                fcbArray[fd].buffer_offset = 0;
-
-                // Move to the next volume block
-                int next_block = get_next_block(fcbArray[fd].current_block, fcbArray[fd].fi->size);
-
-                // Check if more blocks were allocated
-                if (next_block == -1) {
-                    // Print the error
-                    fprintf(stderr, "Failed to allocate more blocks.\n");
-                    // Exit the function
-                    return bytes_written_to_volume;
-                }
-
-                // Assign the next block
-                fcbArray[fd].current_block = next_block;
-
-                // Increment the number of blocks written to
-                fcbArray[fd].block_index++;
+            buffer_offset += number_of_bytes_moved;
+
+            // Track the valid bytes and mark the block as needing to be written
+            if (buffer_offset > fcbArray[fd].block_valid[slot])
+                fcbArray[fd].block_valid[slot] = buffer_offset;
+
+            if (!fcbArray[fd].block_dirty[slot]) {
+                fcbArray[fd].block_dirty[slot] = true;
+                fcbArray[fd].dirty_blocks++;
+            }
+
+            // Check if the end of the block was reached
+            if (buffer_offset == BLOCK_SIZE) {
+                // Move to the next block, it is written out with the rest of the buffer
+                block_index++;
+                buffer_offset = 0;
             }
         }
 
         // Increment the caller buffer index
-        caller_buffer_offset += number_of_bytes_moved;
+        segment_offset += number_of_bytes_moved;
 
         // Track the number of bytes written to the volume
         bytes_written_to_volume += number_of_bytes_moved;
@@ -408,7 +1192,8 @@ int b_write(b_io_fd fd, char *buffer, int count) {
     }
 
     // Calculate the last position written
-    int last_position_written = fcbArray[fd].block_index * BLOCK_SIZE + fcbArray[fd].buffer_offset;
+    int last_position_written = block_index * BLOCK_SIZE + buffer_offset;
+    *position = last_position_written;
 
     // Update the file size the number of blocks used by the file
     if (last_position_written > fcbArray[fd].fi->size) {
@@ -423,16 +1208,51 @@ int b_write(b_io_fd fd, char *buffer, int count) {
     return bytes_written_to_volume;
 }
 
-// Interface to read a buffer
+// Write count bytes from the buffers of iov at the file position, for b_write and b_writev
+static int write_file(b_io_fd fd, const struct iovec * iov, int count) {
+    int position = fcbArray[fd].block_index * BLOCK_SIZE + fcbArray[fd].buffer_offset;
+    int result = write_range(fd, iov, count, &position);
 
-// Filling the callers request is broken into three parts
-// Part 1 is what can be filled from the current buffer, which may or may not be enough
+    if (result >= 0) {
+        fcbArray[fd].block_index = position / BLOCK_SIZE;
+        fcbArray[fd].buffer_offset = position % BLOCK_SIZE;
+    }
+
+    return result;
+}
+
+// Interface to write function
+// b_io_fd: file descriptor
+// buffer: data to write to file
+// count: number of bytes to write
+int b_write(b_io_fd fd, char *buffer, int count) {
+    // Check that fd is a valid file descriptor
+    if (fd < 0 || fd >= MAXFCBS) {
+        return -1;
+    }
+
+    // Initialize system
+    pthread_once(&startup, b_init);
+
+    struct iovec one = { .iov_base = buffer, .iov_len = count > 0 ? count : 0 };
+
+    pthread_mutex_lock(&fcbArray[fd].lock);
+    int result = write_file(fd, &one, count);
+    pthread_mutex_unlock(&fcbArray[fd].lock);
+
+    return result;
+}
+
+// Interface to read a buffer
+
+// Filling the callers request is broken into three parts
+// Part 1 is what can be filled from the current block, through the file's buffer
 // Part 2 is after using what was left in our buffer there is still 1 or more block
 //        size chunks needed to fill the callers request.  This represents the number of
 //        bytes in multiples of the blocksize.
 // Part 3 is a value less than blocksize which is what remains to copy to the callers buffer
-//        after fulfilling part 1 and part 2.  This would always be filled from a refill 
-//        of our buffer.
+//        after fulfilling part 1 and part 2.  This is filled from the file's buffer, which
+//        loads the block unless it already holds the bytes.
 //  +-------------+------------------------------------------------+--------+
 //  |             |                                                |        |
 //  | filled from |  filled direct in multiples of the block size  | filled |
@@ -442,19 +1262,14 @@ int b_write(b_io_fd fd, char *buffer, int count) {
 //  |             |                                                |        |
 //  | Part1       |  Part 2                                        | Part3  |
 //  +-------------+------------------------------------------------+--------+
-int b_read (b_io_fd fd, char * buffer, int count) {
-	int blocks_read;
+//
+// The bytes at *position are read into the buffers of iov, each one after the other, count
+// being their total length, and *position is moved past them. Reads from the file position
+// (sequential) drive the readahead, the others leave its state alone
+static int read_range (b_io_fd fd, const struct iovec * iov, int count, int * position,
+					   bool sequential) {
 	int bytes_returned;
-	int part1, part2, part3;
-	int number_of_blocks_to_copy;
-	int remaining_bytes_in_my_buf;
-
-	if (startup == 0) b_init(); // Initialize system
-
-	// Check that fd is between 0 and (MAXFCBS-1)
-	if ((fd < 0) || (fd >= MAXFCBS)) {
-		return (-1); // Invalid file descriptor
-	}
+	int number_of_bytes_moved;
 
 	// Check if file is open
 	if (fcbArray[fd].fi == NULL) {
@@ -466,178 +1281,498 @@ int b_read (b_io_fd fd, char * buffer, int count) {
 		return -1;
 	}
 
-	// Number of available bytes to copy from buffer
-	remaining_bytes_in_my_buf = fcbArray[fd].buffer_len - fcbArray[fd].buffer_offset;
-
-	// Limit count to file length;
-	int amount_already_delivered = 
-	(fcbArray[fd].block_index * B_CHUNK_SIZE) - remaining_bytes_in_my_buf;
-	if ((count + amount_already_delivered) > fcbArray[fd].fi->size) {
-		count = fcbArray[fd].fi->size - amount_already_delivered;
+	// Limit count to file length
+	if (count > (int)fcbArray[fd].fi->size - *position) {
+		count = fcbArray[fd].fi->size - *position;
 
-		if (count < 0) {
-			printf("Error: Count: %d   Delivered: %d   Current Block: %d",
-			count, amount_already_delivered, fcbArray[fd].current_block);
+		if (count <= 0) {
 			return 0; // End of file
 		}
 	}
-	// Enough bytes in buffer to copy
-	if (remaining_bytes_in_my_buf >= count) {
-		part1 = count;
-		part2 = 0;
-		part3 = 0;
-	} else {
-		// part1 will contain what's left in the buffer
-		part1 = remaining_bytes_in_my_buf;
-		// part1 is not enough, set part3 to how much more bytes needed
-		part3 = count - remaining_bytes_in_my_buf;
-		// Calculate how many 512 byte chunks needed to copy
-		// to the caller's buffer
-		number_of_blocks_to_copy = part3 / B_CHUNK_SIZE;
-		// part2 contains how many bytes to give to the caller's buffer
-		part2 = number_of_blocks_to_copy * B_CHUNK_SIZE;
-
-		// Reduce part3 by the number of bytes that can be copied in chunks
-		// part3 is the remainder. It has to be less than block size
-		part3 = part3 - part2;
-	}
-	// Copy part1 bytes to caller's buffer
-	if (part1 > 0) {
-		memcpy(buffer, fcbArray[fd].buf + fcbArray[fd].buffer_offset, part1);
-		fcbArray[fd].buffer_offset += part1;
-	}
-	// Blocks to copy direct to caller's buffer
-	if (part2 > 0) {
-		blocks_read = 0;
-		for (int i = 0; i < number_of_blocks_to_copy; i++) {
-			blocks_read = LBAread(buffer + part1 + (i * B_CHUNK_SIZE), 1,
-						  fcbArray[fd].current_block);
-			fcbArray[fd].current_block = get_next_block(fcbArray[fd].current_block, fcbArray[fd].fi->size);
-		}
-		fcbArray[fd].block_index += blocks_read;
-		part2 = blocks_read * B_CHUNK_SIZE;
-	}
-	// Buffer is empty, part3 is less than 512 bytes
-	if (part3 > 0) {
-		// LBAread the remaining block into the my buffer
-		blocks_read = LBAread(fcbArray[fd].buf, 1, fcbArray[fd].current_block);
-		blocks_read = blocks_read * B_CHUNK_SIZE;
-
-		fcbArray[fd].current_block = get_next_block(fcbArray[fd].current_block, fcbArray[fd].fi->size);
-		fcbArray[fd].block_index += 1;
-		fcbArray[fd].buffer_offset = 0; // Reset buffer offset
-		fcbArray[fd].buffer_len = blocks_read;
-
-		if (blocks_read < part3) {
-			part3 = blocks_read;
-		}
-		// Memcpy part3 bytes
-		if (part3 > 0) {
-			memcpy(buffer + part1 + part2, fcbArray[fd].buf + fcbArray[fd].buffer_offset,
-			part3);
-			fcbArray[fd].buffer_offset += part3; // Adjust buffer offset
+
+	// Read the blocks after this read into the cache if the reads are sequential
+	if (sequential) {
+		read_ahead(fd, *position, count);
+	}
+
+	int block_index = *position / B_CHUNK_SIZE;
+	int buffer_offset = *position % B_CHUNK_SIZE;
+
+	// The caller buffer being filled and how much of it is
+	int segment = 0;
+	size_t segment_offset = 0;
+
+	bytes_returned = 0;
+	while (count > 0) {
+		// Move on to the next caller buffer once this one is full
+		if (segment_offset == iov[segment].iov_len) {
+			segment++;
+			segment_offset = 0;
+			continue;
 		}
+
+		char* buffer = (char*) iov[segment].iov_base + segment_offset;
+		int available = iov[segment].iov_len - segment_offset;
+		if (available > count) {
+			available = count;
+		}
+
+		// Part 2: whole blocks are copied directly to the caller's buffer, one call for
+		// each run of consecutive volume blocks
+		if (buffer_offset == 0 && available >= B_CHUNK_SIZE) {
+			// The file's buffer may hold changes to blocks that are about to be read, with
+			// delayed allocation those blocks are only picked when they are written out
+			if (buffer_has_dirty_blocks(fd, block_index, available / B_CHUNK_SIZE) &&
+				flush_buffer(fd) != 0) {
+				break;
+			}
+
+			int run_length;
+			int block = locate_block(fd, block_index, false, &run_length);
+			if (run_length > available / B_CHUNK_SIZE) {
+				run_length = available / B_CHUNK_SIZE;
+			}
+
+			// A hole reads as zeros without touching the volume
+			if (block == -1) {
+				memset(buffer, 0, run_length * B_CHUNK_SIZE);
+			}
+			else if (cache_read(buffer, run_length, block) != run_length) {
+				break;
+			}
+
+			// Move past the blocks that were read
+			number_of_bytes_moved = run_length * B_CHUNK_SIZE;
+			block_index += run_length;
+		}
+		// Parts 1 and 3: the rest of a block is copied from the file's buffer
+		else {
+			int slot = buffer_slot(fd, block_index);
+			if (slot == -1) {
+				break;
+			}
+
+			number_of_bytes_moved = B_CHUNK_SIZE - buffer_offset;
+			if (available < number_of_bytes_moved) {
+				number_of_bytes_moved = available;
+			}
+
+			// Load the block unless the bytes to copy are already valid
+			if (buffer_offset + number_of_bytes_moved > fcbArray[fd].block_valid[slot] &&
+				load_buffer_block(fd, slot) != 0) {
+				break;
+			}
+
+			memcpy(buffer, fcbArray[fd].buf + slot * B_CHUNK_SIZE + buffer_offset,
+				   number_of_bytes_moved);
+			buffer_offset += number_of_bytes_moved;
+
+			// The rest of the block was used, move to the next one
+			if (buffer_offset == B_CHUNK_SIZE) {
+				block_index++;
+				buffer_offset = 0;
+			}
+		}
+
+		segment_offset += number_of_bytes_moved;
+		bytes_returned += number_of_bytes_moved;
+		count -= number_of_bytes_moved;
 	}
 
+	*position = block_index * B_CHUNK_SIZE + buffer_offset;
 	fcbArray[fd].fi->access_time = time(NULL); // Set access time to current time
-	bytes_returned = part1 + part2 + part3;
 
 	return bytes_returned;
 }
 
-int b_move(char* source_file_name, char* destination_file_name) {
-	struct parse_path_return_data pp_info_src_file;
-	struct parse_path_return_data pp_info_dest_file;
-	DirectoryEntry* destination_dir;
+// Read count bytes into the buffers of iov from the file position, for b_read and b_readv
+static int read_file (b_io_fd fd, const struct iovec * iov, int count) {
+	int position = fcbArray[fd].block_index * B_CHUNK_SIZE + fcbArray[fd].buffer_offset;
+	int result = read_range(fd, iov, count, &position, true);
 
-	// Invalid source path check
-    if (parse_path(source_file_name, &pp_info_src_file) != 0) {
-        fprintf(stderr, "invalid source path.\n");
-        return -1;
-    }
+	if (result >= 0) {
+		fcbArray[fd].block_index = position / B_CHUNK_SIZE;
+		fcbArray[fd].buffer_offset = position % B_CHUNK_SIZE;
+	}
 
-	// Invalid destination path check
-    if (parse_path(destination_file_name, &pp_info_dest_file) != 0) {
-        fprintf(stderr, "invalid destination path.\n");
-        return -1;
-    }
+	return result;
+}
+
+// Interface to read a buffer, the work is done by read_file
+int b_read (b_io_fd fd, char * buffer, int count) {
+	// Check that fd is between 0 and (MAXFCBS-1)
+	if ((fd < 0) || (fd >= MAXFCBS)) {
+		return (-1); // Invalid file descriptor
+	}
+
+	pthread_once(&startup, b_init); // Initialize system
+
+	struct iovec one = { .iov_base = buffer, .iov_len = count > 0 ? count : 0 };
+
+	pthread_mutex_lock(&fcbArray[fd].lock);
+	int result = read_file(fd, &one, count);
+	pthread_mutex_unlock(&fcbArray[fd].lock);
+
+	return result;
+}
 
-	int source_file_index = pp_info_src_file.last_element_index;
+// Read or write count bytes at offset, for b_pread and b_pwrite
+// The offset is passed down as the position of the transfer: the file position and the
+// readahead of the descriptor's sequential reads are left as they were
+static int transfer_at (b_io_fd fd, char * buffer, int count, off_t offset, bool writing) {
+	// Check if the file is open
+	if (fcbArray[fd].fi == NULL) {
+		return -1;
+	}
+
+	// Positions in the file are ints, the whole range has to fit
+	if (count < 0 || offset < 0 || offset > INT_MAX - count) {
+		return -1;
+	}
+
+	struct iovec one = { .iov_base = buffer, .iov_len = count };
+	int position = offset;
+
+	return writing ? write_range(fd, &one, count, &position)
+				   : read_range(fd, &one, count, &position, false);
+}
+
+// Interface to read count bytes at offset, the file position doesn't move
+// Threads sharing a descriptor each read their own records without a b_seek in between
+int b_pread (b_io_fd fd, char * buffer, int count, off_t offset) {
+	// Check that fd is between 0 and (MAXFCBS-1)
+	if ((fd < 0) || (fd >= MAXFCBS)) {
+		return (-1); // Invalid file descriptor
+	}
+
+	pthread_once(&startup, b_init); // Initialize system
+
+	pthread_mutex_lock(&fcbArray[fd].lock);
+	int result = transfer_at(fd, buffer, count, offset, false);
+	pthread_mutex_unlock(&fcbArray[fd].lock);
+
+	return result;
+}
+
+// Interface to write count bytes at offset, the file position doesn't move
+// As with pwrite on Linux, a file opened with O_APPEND is still written at its end
+int b_pwrite (b_io_fd fd, char * buffer, int count, off_t offset) {
+	// Check that fd is between 0 and (MAXFCBS-1)
+	if ((fd < 0) || (fd >= MAXFCBS)) {
+		return (-1); // Invalid file descriptor
+	}
+
+	pthread_once(&startup, b_init); // Initialize system
+
+	pthread_mutex_lock(&fcbArray[fd].lock);
+	int result = transfer_at(fd, buffer, count, offset, true);
+	pthread_mutex_unlock(&fcbArray[fd].lock);
+
+	return result;
+}
+
+// Read or write the iovcnt buffers of iov one after the other from the file position, for
+// b_readv and b_writev, as a single transfer of their total length. Each buffer continues
+// where the previous one ended, so the blocks are visited once, in order, and whole blocks
+// still go straight between the volume and the caller's buffers. Stops at the end of the file
+// or when the volume is full
+static int transfer_vector (b_io_fd fd, const struct iovec * iov, int iovcnt, bool writing) {
+	// Check if the file is open
+	if (fcbArray[fd].fi == NULL) {
+		return -1;
+	}
+
+	if (iov == NULL || iovcnt < 0 || iovcnt > B_MAX_IOVECS) {
+		return -1;
+	}
+
+	// The total is returned as an int, like the count of b_read and b_write
+	size_t total = 0;
+	for (int i = 0; i < iovcnt; i++) {
+		if (iov[i].iov_len > INT_MAX - total) {
+			return -1;
+		}
+		total += iov[i].iov_len;
+	}
+
+	return writing ? write_file(fd, iov, total) : read_file(fd, iov, total);
+}
+
+// Interface to read into iovcnt buffers from the file position, in one call
+int b_readv (b_io_fd fd, const struct iovec * iov, int iovcnt) {
+	// Check that fd is between 0 and (MAXFCBS-1)
+	if ((fd < 0) || (fd >= MAXFCBS)) {
+		return (-1); // Invalid file descriptor
+	}
+
+	pthread_once(&startup, b_init); // Initialize system
+
+	pthread_mutex_lock(&fcbArray[fd].lock);
+	int result = transfer_vector(fd, iov, iovcnt, false);
+	pthread_mutex_unlock(&fcbArray[fd].lock);
+
+	return result;
+}
+
+// Interface to write iovcnt buffers at the file position, in one call
+int b_writev (b_io_fd fd, const struct iovec * iov, int iovcnt) {
+	// Check that fd is between 0 and (MAXFCBS-1)
+	if ((fd < 0) || (fd >= MAXFCBS)) {
+		return (-1); // Invalid file descriptor
+	}
+
+	pthread_once(&startup, b_init); // Initialize system
+
+	pthread_mutex_lock(&fcbArray[fd].lock);
+	int result = transfer_vector(fd, iov, iovcnt, true);
+	pthread_mutex_unlock(&fcbArray[fd].lock);
+
+	return result;
+}
+
+// Move the entry found by src into the directory found by dest, both already parsed
+// Both parents come from the directory table, so when they are the same directory the two
+// updates apply to the same array
+static int move_entry(struct parse_path_return_data* pp_info_src_file,
+					  struct parse_path_return_data* pp_info_dest_file) {
+	DirectoryEntry* destination_dir;
+	bool destination_locked = false;
+
+	int source_file_index = pp_info_src_file->last_element_index;
 	if (source_file_index < 0) {
         fprintf(stderr, "Source file or directory not found.\n");
         return -1;
     }
 
-	int destination_file_index = pp_info_dest_file.last_element_index;
+	int destination_file_index = pp_info_dest_file->last_element_index;
 
 	// Last element exists
 	if(destination_file_index > 0){
 		// Last element is a file
-		if (pp_info_dest_file.parent[destination_file_index].is_dir == FILE_TYPE_REGULAR) {
+		if (pp_info_dest_file->parent[destination_file_index].is_dir == FILE_TYPE_REGULAR) {
             fprintf(stderr, "Cannot move to a file.\n");
 			return -1;
 		}
 		// Last element is a directory
 		// Load the last element(the destination directory)
-		destination_dir = load_dir(&pp_info_dest_file.parent[destination_file_index]);
+		destination_dir = load_dir(&pp_info_dest_file->parent[destination_file_index]);
+		if (destination_dir == NULL) {
+			return -1;
+		}
+
+		// The parents are locked by the caller, the destination may be one of them
+		if (destination_dir != pp_info_src_file->parent &&
+			destination_dir != pp_info_dest_file->parent) {
+			lock_dir(destination_dir, DIR_LOCK_EXCLUSIVE);
+			destination_locked = true;
+		}
 
 		// Check if the destination dir has a file or directory with the same name as source
-		int name_exist=is_DE_exist(destination_dir,pp_info_src_file.last_element_name);
+		int name_exist=is_DE_exist(destination_dir,pp_info_src_file->last_element_name);
 		if(name_exist == 0){ // Directory has file or directory of source name
             fprintf(stderr, "Destination file/directory with this name already exists.\n");
+			if (destination_locked)
+				unlock_dir(destination_dir);
+			free_directory(destination_dir);
 			return -1;
 		}
 	}
 	// Last element doesn't exist
 	else if(destination_file_index == -1){
 		// Check if destination parent has a file or directory with the same name as source
-		int name_exist=is_DE_exist(pp_info_dest_file.parent, pp_info_dest_file.last_element_name);
+		int name_exist=is_DE_exist(pp_info_dest_file->parent, pp_info_dest_file->last_element_name);
 			if(name_exist == 0){ // Directory has file or directory of source name
                 fprintf(stderr, "Destination file/directory with this name already exists.\n");
 			return -1;
 		}
 		// Rename the source as last elements name
-		strcpy(pp_info_src_file.last_element_name, pp_info_dest_file.last_element_name);
-		destination_dir = pp_info_dest_file.parent;//the directory destination
+		strcpy(pp_info_src_file->last_element_name, pp_info_dest_file->last_element_name);
+		destination_dir = dir_cache_hold(pp_info_dest_file->parent);//the directory destination
+	}
+	else {
+        fprintf(stderr, "Invalid destination.\n");
+		return -1;
 	}
 
 	// Get the next available DE in destination directory
 	int new_destination_index = get_available_DE_index(destination_dir);
 	if (new_destination_index == -1) {
+		if (destination_locked)
+			unlock_dir(destination_dir);
+		free_directory(destination_dir);
 		return -1; // No available DE index left
 	}
 
-	// Copy the src dir entry to the dest dir entry
-	strcpy(destination_dir[new_destination_index].name, pp_info_src_file.last_element_name);
-	destination_dir[new_destination_index].size = 
-	pp_info_src_file.parent[source_file_index].size;
-	destination_dir[new_destination_index].start_block = 
-	pp_info_dest_file.parent[source_file_index].start_block;
-	destination_dir[new_destination_index].is_dir = 
-	pp_info_dest_file.parent[source_file_index].is_dir;
-	destination_dir[new_destination_index].creation_time = 
-	pp_info_src_file.parent[source_file_index].creation_time;
-	destination_dir[new_destination_index].access_time = 
-	pp_info_src_file.parent[source_file_index].access_time;
-	destination_dir[new_destination_index].modification_time = 
-	pp_info_src_file.parent[source_file_index].modification_time;
+	// Copy the src dir entry to the dest dir entry, including the extents stored in it
+	destination_dir[new_destination_index] = pp_info_src_file->parent[source_file_index];
+	strcpy(destination_dir[new_destination_index].name, pp_info_src_file->last_element_name);
 
 	// Update changes to disk
-	write_dir(destination_dir);
+	write_dir_entry(destination_dir, new_destination_index);
+	path_cache_invalidate(destination_dir[0].start_block);
 
 	// Reset the source dir entry 
-	strcpy(pp_info_src_file.parent[source_file_index].name, "");
-    pp_info_src_file.parent[source_file_index].size = 0;
+	strcpy(pp_info_src_file->parent[source_file_index].name, "");
+    pp_info_src_file->parent[source_file_index].size = 0;
     time_t actual_time = time(NULL);
-    pp_info_src_file.parent[0].modification_time = actual_time;
-    pp_info_src_file.parent[0].access_time = actual_time;
+    pp_info_src_file->parent[0].modification_time = actual_time;
+    pp_info_src_file->parent[0].access_time = actual_time;
 
     // Update changes to disk
-    write_dir(pp_info_src_file.parent);
+    write_dir_entry(pp_info_src_file->parent, source_file_index);
+    write_dir_entry(pp_info_src_file->parent, 0);
+    path_cache_invalidate(pp_info_src_file->parent[0].start_block);
 
+	if (destination_locked)
+		unlock_dir(destination_dir);
+	free_directory(destination_dir);
 	return 0;
+}
+
+// Lock the parents of both paths of a move, then look their last elements up again
+// Neither parent is known to be above the other, so waiting for one while holding the other
+// could deadlock with a thread locking them top-down. The second is only tried, when it is
+// busy the first is let go and the other order is tried
+static int lock_move_parents(struct parse_path_return_data* src, struct parse_path_return_data* dest) {
+	DirectoryEntry* first = src->parent;
+	DirectoryEntry* second = dest->parent;
+
+	while (true) {
+		lock_dir(first, DIR_LOCK_EXCLUSIVE);
+		if (second == first || dir_cache_trylock(second, DIR_LOCK_EXCLUSIVE) == 0)
+			break;
+
+		unlock_dir(first);
+		DirectoryEntry* swap = first;
+		first = second;
+		second = swap;
+		sched_yield();
+	}
+
+	// A parent was removed meanwhile
+	if (dir_cache_removed(src->parent) || dir_cache_removed(dest->parent)) {
+		unlock_dir(first);
+		if (second != first)
+			unlock_dir(second);
+		return -1;
+	}
+
+	src->last_element_index = get_DE_index(src->parent, src->last_element_name);
+	dest->last_element_index = get_DE_index(dest->parent, dest->last_element_name);
+
+	return 0;
+}
+
+int b_move(char* source_file_name, char* destination_file_name) {
+	struct parse_path_return_data pp_info_src_file;
+	struct parse_path_return_data pp_info_dest_file;
 
+	// The move and the write back of both parents commit together
+	// Nothing else moves or removes entries while the paths are parsed and used
+	journal_begin();
+	lock_tree();
+
+	// Invalid source path check
+    if (parse_path(source_file_name, &pp_info_src_file) != 0) {
+        fprintf(stderr, "invalid source path.\n");
+        unlock_tree();
+        journal_end();
+        return -1;
+    }
+
+	// Invalid destination path check
+    if (parse_path(destination_file_name, &pp_info_dest_file) != 0) {
+        fprintf(stderr, "invalid destination path.\n");
+        free_directory(pp_info_src_file.parent);
+        unlock_tree();
+        journal_end();
+        return -1;
+    }
+
+	int result = -1;
+	if (lock_move_parents(&pp_info_src_file, &pp_info_dest_file) == 0) {
+		result = move_entry(&pp_info_src_file, &pp_info_dest_file);
+
+		unlock_dir(pp_info_src_file.parent);
+		if (pp_info_dest_file.parent != pp_info_src_file.parent)
+			unlock_dir(pp_info_dest_file.parent);
+	}
+
+	// The parents are written back as they are released
+	free_directory(pp_info_dest_file.parent);
+	free_directory(pp_info_src_file.parent);
+	unlock_tree();
+	journal_end();
+
+	return result;
 }	
+// Close the file for b_close
+static int close_file (b_io_fd fd) {
+	// Check if the file is open
+	if (fcbArray[fd].fi == NULL) {
+		return -1;
+	}
+
+    // The last blocks of the file and its entry commit together
+    journal_begin();
+
+    // With delayed allocation the blocks are picked here, a failure (no space left for a
+    // reservation, a write error) is reported by close. The file is closed all the same,
+    // its entry keeps what did reach the volume
+    int result = 0;
+
+    // Write the changed blocks of the file's buffer to the volume
+    if (flush_buffer(fd) != 0)
+        result = -1;
+
+    // Blocks reserved for writes that never reached the volume are free again
+    release_reserved_freespace(fcbArray[fd].reserved_blocks);
+    fcbArray[fd].reserved_blocks = 0;
+
+    // Blocks linked ahead of writes that didn't come are free again
+    if (fcbArray[fd].grow_first_block != -1) {
+        int first_unused = fcbArray[fd].num_blocks > fcbArray[fd].grow_first_block ?
+                           fcbArray[fd].num_blocks : fcbArray[fd].grow_first_block;
+        if (release_file_range(fd, first_unused, INT_MAX) != 0)
+            result = -1;
+    }
+
+    // Holes the directory entry can't keep become blocks of zeros
+    if (fill_unstored_holes(fd) != 0)
+        result = -1;
+
+    // Store the first runs of the file in its directory entry for the next open
+    extent_map_complete(&fcbArray[fd].map);
+    extent_map_store(&fcbArray[fd].map, fcbArray[fd].fi);
+
+    // Update the file's entry in its parent, unless the entry was removed or reused meanwhile
+    // A file opened and closed without changes leaves its parent untouched
+    // The file's start block may have changed since it was opened, its name hasn't
+    DirectoryEntry* parent = fcbArray[fd].parent;
+    int file_index = fcbArray[fd].file_index;
+    lock_dir(parent, DIR_LOCK_EXCLUSIVE);
+    bool same_file = parent[file_index].start_block == fcbArray[fd].entry_start_block &&
+        strcmp(parent[file_index].name, fcbArray[fd].fi->name) == 0;
+    if (same_file &&
+        memcmp(&parent[file_index], fcbArray[fd].fi, sizeof(DirectoryEntry)) != 0) {
+        parent[file_index] = *(fcbArray[fd].fi);
+        write_dir_entry(parent, file_index);
+    }
+    unlock_dir(parent);
+    free_directory(parent);
+    fcbArray[fd].parent = NULL;
+    journal_end();
+
+	// Free allocated memory
+	extent_map_free(&fcbArray[fd].map);
+	free(fcbArray[fd].fi);
+	fcbArray[fd].fi = NULL;
+	free_buffer(fd);
+	release_FCB(fd);
+
+	return result;
+}
+
 // Interface to close the file	
 int b_close (b_io_fd fd) {
 	// Check that fd is between 0 and (MAXFCBS-1)
@@ -645,23 +1780,182 @@ int b_close (b_io_fd fd) {
 		return (-1); // Invalid file descriptor
 	}
 
-    // Check if the current block needs to be written
-    if (fcbArray[fd].need_to_write_block == true) {
-        // Write the file's buffer to the volume
-        // Check if LBAwrite is successful
-        if (LBAwrite(fcbArray[fd].buf,1,fcbArray[fd].current_block) != 1)
-            // Print the error
-            fprintf(stderr, "LBAwrite failure while writing to the volume\n");
-    }
+	pthread_once(&startup, b_init);  // Initialize system
 
-    parse_path_info.parent[parent_index] = *(fcbArray[fd].fi);
-    write_dir(parse_path_info.parent);
+	pthread_mutex_lock(&fcbArray[fd].lock);
+	int result = close_file(fd);
+	pthread_mutex_unlock(&fcbArray[fd].lock);
 
-	// Free allocated memory
-	free(fcbArray[fd].fi);
-	fcbArray[fd].fi = NULL;
-	free(fcbArray[fd].buf);
-	fcbArray[fd].buf = NULL;
+	return result;
+}
+
+// Interface to get the readahead state of an open file
+int b_get_readahead_stats (b_io_fd fd, struct b_readahead_stats* stats) {
+	// Check that fd is between 0 and (MAXFCBS-1)
+	if ((fd < 0) || (fd >= MAXFCBS)) {
+		return (-1); // Invalid file descriptor
+	}
+
+	pthread_once(&startup, b_init);  // Initialize system
+
+	int result = -1;
+	pthread_mutex_lock(&fcbArray[fd].lock);
+	if (fcbArray[fd].fi != NULL) {
+		stats->window = fcbArray[fd].ra_window;
+		stats->blocks_read_ahead = fcbArray[fd].ra_blocks;
+		stats->hits = fcbArray[fd].ra_hits;
+		result = 0;
+	}
+	pthread_mutex_unlock(&fcbArray[fd].lock);
+
+	return result;
+}
+
+// Allocate the blocks of a range of the file before it is written
+// Every block from offset up to offset + len gets a volume block, each missing range as a
+// single run, next to the blocks around it in the chain when those blocks are free. Unless
+// flags has B_FALLOC_KEEP_SIZE the file grows to offset + len and the new bytes read as zeros
+// With B_FALLOC_PUNCH_HOLE the blocks of the range are freed instead, the size is kept
+static int fallocate_file (b_io_fd fd, off_t offset, off_t len, int flags) {
+	// Check if the file is open
+	if (fcbArray[fd].fi == NULL) {
+		return -1;
+	}
+
+	// Check file write access
+	if ((fcbArray[fd].access_mode & O_RDONLY)) {
+		fprintf(stderr, "File does not have write access.\n");
+		return -1;
+	}
+
+	if (offset < 0 || len <= 0) {
+		fprintf(stderr, "Invalid range to allocate.\n");
+		return -1;
+	}
+
+	if (flags & B_FALLOC_PUNCH_HOLE) {
+		off_t end_position = offset + len;
+		return punch_hole(fd, offset, end_position < MAX_FILE_SIZE + B_CHUNK_SIZE ?
+							  end_position : MAX_FILE_SIZE + B_CHUNK_SIZE);
+	}
+
+	// Files end in the block holding byte MAX_FILE_SIZE, as they do when written
+	off_t end_position = offset + len;
+	if ((end_position - 1) / B_CHUNK_SIZE * B_CHUNK_SIZE >= MAX_FILE_SIZE) {
+		fprintf(stderr, "Unable to allocate blocks, greater than size allowed: %d.\n", MAX_FILE_SIZE);
+		return -1;
+	}
+
+	// Allocate the missing blocks, taking over any the file reserved
+	// The range may cover holes inside the file, which must still read as zeros
+	int block_count = retrieve_num_of_blocks(end_position, B_CHUNK_SIZE);
+	if (allocate_file_range(fd, offset / B_CHUNK_SIZE, block_count, true) != 0) {
+		fprintf(stderr, "Failed to allocate more blocks.\n");
+		return -1;
+	}
+
+	// Blocks the chain was grown by are kept at b_close from now on, the caller asked for them
+	fcbArray[fd].grow_first_block = -1;
+
+	// Grow the file over the range, what the new blocks held before isn't part of it
+	if (!(flags & B_FALLOC_KEEP_SIZE) && end_position > (off_t)fcbArray[fd].fi->size) {
+		if (zero_file_range(fd, fcbArray[fd].fi->size, end_position) != 0)
+			return -1;
+
+		fcbArray[fd].fi->size = end_position;
+		fcbArray[fd].num_blocks = block_count;
+		fcbArray[fd].fi->modification_time = time(NULL);
+	}
 
 	return 0;
 }
+
+// Interface to allocate the blocks of a range of the file, the work is done by fallocate_file
+int b_fallocate (b_io_fd fd, off_t offset, off_t len, int flags) {
+	// Check that fd is between 0 and (MAXFCBS-1)
+	if ((fd < 0) || (fd >= MAXFCBS)) {
+		return (-1); // Invalid file descriptor
+	}
+
+	pthread_once(&startup, b_init);  // Initialize system
+
+	pthread_mutex_lock(&fcbArray[fd].lock);
+	int result = fallocate_file(fd, offset, len, flags);
+	pthread_mutex_unlock(&fcbArray[fd].lock);
+
+	return result;
+}
+
+// Change the size of the open file for b_ftruncate
+static int ftruncate_file (b_io_fd fd, off_t length) {
+	// Check if the file is open
+	if (fcbArray[fd].fi == NULL) {
+		return -1;
+	}
+
+	// Check file write access
+	if ((fcbArray[fd].access_mode & O_RDONLY)) {
+		fprintf(stderr, "File does not have write access.\n");
+		return -1;
+	}
+
+	if (length < 0) {
+		fprintf(stderr, "Invalid file length.\n");
+		return -1;
+	}
+
+	// Files end in the block holding byte MAX_FILE_SIZE, as they do when written
+	if (length > 0 && (length - 1) / B_CHUNK_SIZE * B_CHUNK_SIZE >= MAX_FILE_SIZE) {
+		fprintf(stderr, "Unable to grow the file, greater than size allowed: %d.\n", MAX_FILE_SIZE);
+		return -1;
+	}
+
+	return truncate_file(fd, length);
+}
+
+// Interface to change the size of an open file to length bytes
+// A shorter file frees the blocks past its new end, a longer one grows by a hole
+int b_ftruncate (b_io_fd fd, off_t length) {
+	// Check that fd is between 0 and (MAXFCBS-1)
+	if ((fd < 0) || (fd >= MAXFCBS)) {
+		return (-1); // Invalid file descriptor
+	}
+
+	pthread_once(&startup, b_init);  // Initialize system
+
+	pthread_mutex_lock(&fcbArray[fd].lock);
+	int result = ftruncate_file(fd, length);
+	pthread_mutex_unlock(&fcbArray[fd].lock);
+
+	return result;
+}
+
+// Interface to change the size of the file at path to length bytes
+int b_truncate (char * filename, off_t length) {
+	b_io_fd fd = b_open(filename, O_WRONLY);
+	if (fd < 0) {
+		return -1;
+	}
+
+	int result = b_ftruncate(fd, length);
+
+	if (b_close(fd) != 0) {
+		return -1;
+	}
+
+	return result;
+}
+
+// Interface to choose how files opened from now on get their blocks
+// B_ALLOC_DELAYED or B_ALLOC_IMMEDIATE, returns the previous mode
+int b_set_allocation_mode (int mode) {
+	pthread_mutex_lock(&fcb_table_lock);
+	int previous_mode = allocation_mode;
+
+	if (mode == B_ALLOC_DELAYED || mode == B_ALLOC_IMMEDIATE) {
+		allocation_mode = mode;
+	}
+	pthread_mutex_unlock(&fcb_table_lock);
+
+	return previous_mode;
+}
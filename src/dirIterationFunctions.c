@@ -14,29 +14,84 @@
 #include "../include/mfs.h"
 #include "../include/fsHelperFuncs.h"
 #include "../include/fsDirectory.h"
+#include "../include/fsDirCache.h"
+
+
+// The entry at position of a directory that isn't loaded, read from its block on the volume
+// Blocks are read in order, following the chain from the last one read, and one block is
+// kept at a time. Returns NULL if the block can't be read or the chain ends before it
+// The directory is locked by the caller, nobody changes it while it isn't loaded
+static DirectoryEntry* stream_entry(fdDir* dirp, int position) {
+    int entries_per_block = dir_entries_in_blocks(1);
+    int block = position / entries_per_block;
+
+    if (block != dirp->buffered_block) {
+        if (dirp->block_entries == NULL) {
+            dirp->block_entries = malloc(entries_per_block * sizeof(DirectoryEntry));
+            if (dirp->block_entries == NULL) {
+                printf("Memory allocation for directory entries failed\n");
+                return NULL;
+            }
+        }
+
+        while (dirp->chain_block < block) {
+            int next_block = fs_freespace[dirp->chain_volume_block];
+
+            // If the FAT entry's value is its own index, this was the last block
+            if (next_block == dirp->chain_volume_block)
+                return NULL;
+
+            dirp->chain_volume_block = next_block;
+            dirp->chain_block++;
+        }
+
+        if (read_dir_block(dirp->chain_volume_block, dirp->block_entries) != 0)
+            return NULL;
+        dirp->buffered_block = block;
+    }
+
+    return &dirp->block_entries[position % entries_per_block];
+}
 
-   
 fdDir * fs_opendir(const char *pathname) {
     struct parse_path_return_data parse_path_info;
     // Invalid path
 	if (parse_path((char*) pathname, &parse_path_info) != 0) 
 		return NULL; 
 
+    // The parent was removed meanwhile
+    if (lock_parent(&parse_path_info, DIR_LOCK_SHARED) != 0) {
+        free_directory(parse_path_info.parent);
+        return NULL;
+    }
+
     int index = parse_path_info.last_element_index;
     // Last element doesn't exist, so you can't open it
     // or last element is a file, so we can't open it with fs_opendir
 	if (index < 0 || parse_path_info.parent[index].is_dir != FILE_TYPE_DIRECTORY){
+        unlock_dir(parse_path_info.parent);
         free_directory(parse_path_info.parent);
         return NULL;
     }
 
-    // Load the directory to iterate
-    DirectoryEntry* dir = load_dir(&parse_path_info.parent[index]);
+    // Hold the directory to iterate until fs_closedir. On compact volumes it isn't loaded for
+    // this, a directory that isn't in memory is read from the volume a block at a time
+    DirectoryEntry* dir;
+    if (compact_dirs())
+        dir = dir_cache_open(parse_path_info.parent[index].start_block);
+    else
+        dir = load_dir(&parse_path_info.parent[index]);
+    int start_block = parse_path_info.parent[index].start_block;
+    unlock_dir(parse_path_info.parent);
+    free_directory(parse_path_info.parent);
+    if (dir == NULL)
+        return NULL;
       
     // Allocate memory for the directory descriptor 
     fdDir * fd_dir = malloc(sizeof(fdDir));
     if (fd_dir == NULL) {
         printf("Memory allocation for directory descriptor failed\n");
+        free_directory(dir);
         return NULL;
     }
 
@@ -44,6 +99,8 @@ fdDir * fs_opendir(const char *pathname) {
     struct fs_diriteminfo * dir_info = malloc(sizeof(struct fs_diriteminfo));
     if (dir_info == NULL) {
         printf("Memory allocation for directory info failed\n");
+        free(fd_dir);
+        free_directory(dir);
         return NULL;
     }
     
@@ -52,40 +109,81 @@ fdDir * fs_opendir(const char *pathname) {
     fd_dir->dirEntryPosition = 0;
     fd_dir->directory = dir;
     fd_dir->di = dir_info;
-    fd_dir->number_DE = fd_dir->directory->size / sizeof(DirectoryEntry);
-
-    free_directory(parse_path_info.parent);
+    fd_dir->block_entries = NULL;
+    fd_dir->buffered_block = -1;
+    fd_dir->chain_block = 0;
+    fd_dir->chain_volume_block = start_block;
+
+    lock_dir(dir, DIR_LOCK_SHARED);
+    if (dir_cache_loaded(dir)) {
+        fd_dir->number_DE = dir[0].size / sizeof(DirectoryEntry);
+    } else {
+        // The size of the directory is the one . holds in its first block
+        DirectoryEntry* dot = stream_entry(fd_dir, 0);
+        fd_dir->number_DE = dot != NULL ? dot->size / sizeof(DirectoryEntry) : 0;
+        if (fd_dir->number_DE > DIR_ENTRIES_LIMIT)
+            fd_dir->number_DE = DIR_ENTRIES_LIMIT;
+    }
+    unlock_dir(dir);
 
     return fd_dir;
 }
 
-
-struct fs_diriteminfo *fs_readdir(fdDir *dirp) {
+// Read the next used entry into dirp->di, and into statbuf unless it is NULL
+// The directory is locked shared while the entry is copied, others may change it in between
+static struct fs_diriteminfo *read_entry(fdDir *dirp, struct fs_stat *statbuf) {
     // Verify if dirp is valid
     if((dirp == NULL) ||(dirp->directory == NULL) || (dirp->dirEntryPosition < 0)
-        || dirp->dirEntryPosition >= dirp->number_DE || (dirp->di == NULL)){
+        || (dirp->di == NULL)){
         return NULL;
     }
 
+    lock_dir(dirp->directory, DIR_LOCK_SHARED);
+
+    // The directory was removed since it was opened, its blocks may belong to others now
+    if (dir_cache_removed(dirp->directory)) {
+        unlock_dir(dirp->directory);
+        return NULL;
+    }
+
+    // A directory that isn't loaded is read from the volume, it can't change meanwhile
+    // A loaded one may have grown since it was opened
+    bool loaded = dir_cache_loaded(dirp->directory);
+    if (loaded)
+        dirp->number_DE = dirp->directory[0].size / sizeof(DirectoryEntry);
+
     // Read the next available DE
     // keep incrementing the position of DE untile reaching an available DE
     // check each time if at end of directory
+    DirectoryEntry* entry = NULL;
     while((dirp->dirEntryPosition) < (dirp->number_DE)){
-        if(strcmp(dirp->directory[dirp->dirEntryPosition].name, "") != 0)
+        entry = loaded ? &dirp->directory[dirp->dirEntryPosition] :
+                         stream_entry(dirp, dirp->dirEntryPosition);
+        if (entry == NULL || strcmp(entry->name, "") != 0)
             break;
         dirp->dirEntryPosition++;
     }
+    // Only unused DEs were left
+    if (dirp->dirEntryPosition >= dirp->number_DE || entry == NULL) {
+        unlock_dir(dirp->directory);
+        return NULL;
+    }
+
     // Struct to be returned by fs_readdir
     struct fs_diriteminfo *read_info = dirp->di;
 
     // Copy the name of the directory to read_info structure
-    strcpy(read_info->d_name, dirp->directory[dirp->dirEntryPosition].name);
+    strcpy(read_info->d_name, entry->name);
 
     // Copy the file type of the directory to read_info structure
-    if(dirp->directory[dirp->dirEntryPosition].is_dir == FILE_TYPE_DIRECTORY)
+    if(entry->is_dir == FILE_TYPE_DIRECTORY)
         read_info->fileType = FT_DIRECTORY;
     else
         read_info->fileType = FT_REGFILE;
+
+    if (statbuf != NULL)
+        fill_stat_from_DE(entry, statbuf);
+    unlock_dir(dirp->directory);
     
     // Increment the position to point to the next DE
     dirp->dirEntryPosition++;
@@ -93,6 +191,16 @@ struct fs_diriteminfo *fs_readdir(fdDir *dirp) {
     return read_info;   
 }
 
+struct fs_diriteminfo *fs_readdir(fdDir *dirp) {
+    return read_entry(dirp, NULL);
+}
+
+// Same as fs_readdir, and fill statbuf with the data of the entry returned
+// The data comes from the directory loaded by fs_opendir, no path is resolved
+struct fs_diriteminfo *fs_readdirplus(fdDir *dirp, struct fs_stat *statbuf) {
+    return read_entry(dirp, statbuf);
+}
+
 int fs_closedir(fdDir *dirp) {
     if (dirp == NULL) {
         fprintf(stderr, "fs_closedir() failed, fdDir is NULL.\n");
@@ -102,8 +210,10 @@ int fs_closedir(fdDir *dirp) {
         free(dirp->di);
         dirp->di = NULL;
     }
+    free(dirp->block_entries);
+    dirp->block_entries = NULL;
     if(dirp->directory != NULL){
-        free(dirp->directory);
+        free_directory(dirp->directory);
         dirp->directory = NULL;
     }
     free(dirp);
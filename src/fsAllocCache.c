@@ -0,0 +1,394 @@
+/**************************************************************
+* Contains the allocation caches each thread keeps in front of
+* the free space map
+**************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "../include/fsAllocCache.h"
+#include "../include/fsFreespace.h"
+#include "../include/fsFreeIndex.h"
+
+/*
+ * Every allocation and every free went through the free space lock, and in FAT_FLUSH_IMMEDIATE
+ * mode each of them also wrote the changed FAT blocks before letting go of it, so threads
+ * creating files in parallel took turns in the allocator.
+ *
+ * Each thread now keeps a few runs of free blocks of its own:
+ * - A new chain that fits in a cached run is carved from the front of the smallest such run
+ *   (in the allocation group of the goal block when there is one). A chain being extended
+ *   only uses the run starting right after its end, so it stays a single run.
+ * - When no run fits, ALLOC_CACHE_BATCH blocks are taken from the free space map at once
+ *   (take_freespace_run()), near the goal block.
+ * - Freed runs are kept, merged with the cached runs next to them, up to
+ *   ALLOC_CACHE_MAX_BLOCKS. Past that they go back to the free space map.
+ *
+ * The blocks of a cache are marked used in the free space index, so other threads never pick
+ * them, but they stay free in the FAT: after a crash they are simply free. They don't count
+ * in the VCB's free block count while they are cached. They go back to the free space map
+ * when the thread exits, when alloc_cache_release() is called, and when an allocation,
+ * reservation or extension would fail for lack of free blocks: alloc_cache_reclaim() empties
+ * every cache before the free space map gives up. alloc_cache_shutdown() empties them all at
+ * unmount, so the count written to the volume is exact.
+ *
+ * The caches don't change when the FAT reaches the volume: in FAT_FLUSH_IMMEDIATE mode the FAT
+ * blocks changed by an allocation or a free made through a cache are still written before it
+ * returns (fsFreespace.c).
+ *
+ * Each cache has a mutex that only its thread and a reclaim ever take, so handing out
+ * blocks never waits for another thread. The list of caches has a mutex of its own. Locks are
+ * taken in the order free space lock, list, cache, and a thread never asks for the free space
+ * lock while holding its cache's lock.
+ */
+
+typedef struct alloc_cache {
+    pthread_mutex_t lock;            // Taken by the thread owning the cache and by reclaims
+    int run_start[ALLOC_CACHE_RUNS]; // First block of each cached run
+    int run_length[ALLOC_CACHE_RUNS];
+    int run_count;
+    int blocks;                      // Blocks in all the runs
+    uint64_t allocations;
+    uint64_t frees;
+    uint64_t refills;
+    uint64_t returned_blocks;
+    struct alloc_cache* next;        // Next cache in the list of all caches
+} alloc_cache;
+
+static pthread_mutex_t list_lock = PTHREAD_MUTEX_INITIALIZER;
+static alloc_cache* caches;                   // Every thread's cache
+static struct alloc_cache_stats retired;      // Counters of the threads that exited, and the reclaims
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cache_key;               // Runs release_thread_cache() at thread exit
+static __thread alloc_cache* thread_cache;    // This thread's cache, NULL until it allocates
+
+// Give every run of a cache back to the free space map
+// The caller holds the free space lock and the cache's lock
+static void drain_cache(alloc_cache* cache) {
+    for (int run = 0; run < cache->run_count; run++)
+        return_freespace_run(cache->run_start[run], cache->run_length[run]);
+
+    cache->returned_blocks += cache->blocks;
+    cache->run_count = 0;
+    cache->blocks = 0;
+}
+
+// Empty every cache, the caller holds the free space lock
+static void drain_all_caches() {
+    pthread_mutex_lock(&list_lock);
+
+    for (alloc_cache* cache = caches; cache != NULL; cache = cache->next) {
+        pthread_mutex_lock(&cache->lock);
+        drain_cache(cache);
+        pthread_mutex_unlock(&cache->lock);
+    }
+
+    pthread_mutex_unlock(&list_lock);
+}
+
+// Give the blocks of an exiting thread back and drop its cache
+static void release_thread_cache(void* arg) {
+    alloc_cache* cache = arg;
+
+    if (cache->blocks > 0) {
+        lock_freespace();
+        pthread_mutex_lock(&cache->lock);
+        drain_cache(cache);
+        pthread_mutex_unlock(&cache->lock);
+        unlock_freespace();
+    }
+
+    pthread_mutex_lock(&list_lock);
+    for (alloc_cache** link = &caches; *link != NULL; link = &(*link)->next) {
+        if (*link == cache) {
+            *link = cache->next;
+            break;
+        }
+    }
+
+    retired.allocations += cache->allocations;
+    retired.frees += cache->frees;
+    retired.refills += cache->refills;
+    retired.returned_blocks += cache->returned_blocks;
+    pthread_mutex_unlock(&list_lock);
+
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
+
+static void create_cache_key() {
+    pthread_key_create(&cache_key, release_thread_cache);
+}
+
+// The calling thread's cache, created on first use. NULL if it can't be created, the caller
+// then goes to the free space map
+static alloc_cache* get_cache() {
+    if (thread_cache != NULL)
+        return thread_cache;
+
+    pthread_once(&key_once, create_cache_key);
+
+    alloc_cache* cache = calloc(1, sizeof(alloc_cache));
+    if (cache == NULL) {
+        fprintf(stderr, "Memory allocation failed for an allocation cache.\n");
+        return NULL;
+    }
+    pthread_mutex_init(&cache->lock, NULL);
+
+    pthread_mutex_lock(&list_lock);
+    cache->next = caches;
+    caches = cache;
+    pthread_mutex_unlock(&list_lock);
+
+    pthread_setspecific(cache_key, cache);
+    thread_cache = cache;
+
+    return cache;
+}
+
+static void remove_run(alloc_cache* cache, int run) {
+    cache->run_count--;
+    cache->run_start[run] = cache->run_start[cache->run_count];
+    cache->run_length[run] = cache->run_length[cache->run_count];
+}
+
+// Add a run to a cache, merged with the runs on either side of it
+// Returns -1 when the cache has no room for it
+static int add_run(alloc_cache* cache, int start_block, int block_count) {
+    if (cache->blocks + block_count > ALLOC_CACHE_MAX_BLOCKS)
+        return -1;
+
+    int merged = -1;
+    for (int run = 0; run < cache->run_count && merged == -1; run++) {
+        if (cache->run_start[run] + cache->run_length[run] == start_block) {
+            cache->run_length[run] += block_count;
+            merged = run;
+        } else if (start_block + block_count == cache->run_start[run]) {
+            cache->run_start[run] = start_block;
+            cache->run_length[run] += block_count;
+            merged = run;
+        }
+    }
+
+    if (merged == -1) {
+        if (cache->run_count == ALLOC_CACHE_RUNS)
+            return -1;
+
+        merged = cache->run_count++;
+        cache->run_start[merged] = start_block;
+        cache->run_length[merged] = block_count;
+    }
+
+    // The grown run may now touch another one
+    for (int run = 0; run < cache->run_count; run++) {
+        int merged_end = cache->run_start[merged] + cache->run_length[merged];
+
+        if (run != merged && (cache->run_start[run] == merged_end ||
+                              cache->run_start[run] + cache->run_length[run] == cache->run_start[merged])) {
+            if (cache->run_start[merged] < cache->run_start[run])
+                cache->run_start[run] = cache->run_start[merged];
+            cache->run_length[run] += cache->run_length[merged];
+            remove_run(cache, merged);
+            break;
+        }
+    }
+
+    cache->blocks += block_count;
+    return 0;
+}
+
+// Take block_count blocks from the front of a run
+static int carve_run(alloc_cache* cache, int run, int block_count) {
+    int start_block = cache->run_start[run];
+
+    cache->run_start[run] += block_count;
+    cache->run_length[run] -= block_count;
+    cache->blocks -= block_count;
+    cache->allocations++;
+
+    if (cache->run_length[run] == 0)
+        remove_run(cache, run);
+
+    return start_block;
+}
+
+// The smallest run holding at least block_count blocks, in the allocation group of goal_block
+// unless it is -1. Returns -1 if no run fits
+static int best_run(alloc_cache* cache, int goal_block, int block_count) {
+    int best = -1;
+
+    for (int run = 0; run < cache->run_count; run++) {
+        if (cache->run_length[run] < block_count)
+            continue;
+        if (goal_block >= 0 &&
+            cache->run_start[run] / FREE_GROUP_BLOCKS != goal_block / FREE_GROUP_BLOCKS)
+            continue;
+        if (best == -1 || cache->run_length[run] < cache->run_length[best])
+            best = run;
+    }
+
+    return best;
+}
+
+// Take block_count consecutive blocks from this thread's cache, for a chain ending at
+// prev_block (-1 for a new chain, placed near goal_block unless it is -1)
+// The blocks are handed out without the free space lock, the caller links them in the FAT.
+// Returns the first block, -1 when the free space map should be used instead
+int alloc_cache_allocate(int prev_block, int goal_block, int block_count) {
+    if (block_count < 1 || block_count > ALLOC_CACHE_BATCH)
+        return -1;
+
+    alloc_cache* cache = get_cache();
+    if (cache == NULL)
+        return -1;
+
+    int start_block = -1;
+    int evicted_start[ALLOC_CACHE_RUNS];
+    int evicted_length[ALLOC_CACHE_RUNS];
+    int evicted_count = 0;
+
+    pthread_mutex_lock(&cache->lock);
+
+    // A chain keeps growing in place only with the blocks right after its end
+    if (prev_block >= 0) {
+        int run = 0;
+        while (run < cache->run_count && cache->run_start[run] != prev_block + 1)
+            run++;
+
+        if (run < cache->run_count && cache->run_length[run] >= block_count) {
+            start_block = carve_run(cache, run, block_count);
+        } else if (run < cache->run_count) {
+            // Too short, the free space map may continue the chain with it and what follows
+            evicted_start[evicted_count] = cache->run_start[run];
+            evicted_length[evicted_count++] = cache->run_length[run];
+            cache->blocks -= cache->run_length[run];
+            cache->returned_blocks += cache->run_length[run];
+            remove_run(cache, run);
+        }
+
+        pthread_mutex_unlock(&cache->lock);
+        if (evicted_count > 0)
+            return_freespace_run(evicted_start[0], evicted_length[0]);
+
+        return start_block;
+    }
+
+    int run = best_run(cache, goal_block, block_count);
+    if (run != -1) {
+        start_block = carve_run(cache, run, block_count);
+        pthread_mutex_unlock(&cache->lock);
+        return start_block;
+    }
+
+    // Make room for a new batch, the smallest runs go back first
+    while (cache->run_count > 0 && (cache->run_count == ALLOC_CACHE_RUNS ||
+           cache->blocks + ALLOC_CACHE_BATCH > ALLOC_CACHE_MAX_BLOCKS)) {
+        int smallest = 0;
+        for (int other = 1; other < cache->run_count; other++) {
+            if (cache->run_length[other] < cache->run_length[smallest])
+                smallest = other;
+        }
+
+        evicted_start[evicted_count] = cache->run_start[smallest];
+        evicted_length[evicted_count++] = cache->run_length[smallest];
+        cache->blocks -= cache->run_length[smallest];
+        cache->returned_blocks += cache->run_length[smallest];
+        remove_run(cache, smallest);
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    for (int evicted = 0; evicted < evicted_count; evicted++)
+        return_freespace_run(evicted_start[evicted], evicted_length[evicted]);
+
+    // No batch long enough near the goal, the free space map places the blocks itself
+    int batch_start = take_freespace_run(goal_block, ALLOC_CACHE_BATCH);
+    if (batch_start == -1)
+        return -1;
+
+    // The batch may have been merged with a cached run, the chain starts where that run does
+    pthread_mutex_lock(&cache->lock);
+    cache->refills++;
+    bool kept = add_run(cache, batch_start, ALLOC_CACHE_BATCH) == 0;
+    if (kept) {
+        run = 0;
+        while (cache->run_start[run] > batch_start ||
+               cache->run_start[run] + cache->run_length[run] <= batch_start)
+            run++;
+        start_block = carve_run(cache, run, block_count);
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    if (!kept)
+        return_freespace_run(batch_start, ALLOC_CACHE_BATCH);
+
+    return start_block;
+}
+
+// Keep a freed run of blocks in this thread's cache, its FAT entries are already cleared
+// Returns -1 when the cache has no room, the caller gives the run to the free space map
+int alloc_cache_free(int start_block, int block_count) {
+    if (block_count < 1)
+        return -1;
+
+    alloc_cache* cache = get_cache();
+    if (cache == NULL)
+        return -1;
+
+    pthread_mutex_lock(&cache->lock);
+    int result = add_run(cache, start_block, block_count);
+    if (result == 0)
+        cache->frees++;
+    pthread_mutex_unlock(&cache->lock);
+
+    return result;
+}
+
+// Give the blocks held by this thread's cache back to the free space map
+void alloc_cache_release() {
+    if (thread_cache == NULL)
+        return;
+
+    lock_freespace();
+    pthread_mutex_lock(&thread_cache->lock);
+    drain_cache(thread_cache);
+    pthread_mutex_unlock(&thread_cache->lock);
+    unlock_freespace();
+}
+
+// Give the blocks held by every thread's cache back to the free space map, when the volume
+// runs short of free blocks. The caller holds the free space lock
+void alloc_cache_reclaim() {
+    drain_all_caches();
+
+    pthread_mutex_lock(&list_lock);
+    retired.reclaims++;
+    pthread_mutex_unlock(&list_lock);
+}
+
+// Empty every cache before the free space map is written for the last time and released
+void alloc_cache_shutdown() {
+    lock_freespace();
+    drain_all_caches();
+    unlock_freespace();
+}
+
+void alloc_cache_get_stats(struct alloc_cache_stats* stats) {
+    pthread_mutex_lock(&list_lock);
+    *stats = retired;
+    stats->cached_blocks = 0;
+
+    for (alloc_cache* cache = caches; cache != NULL; cache = cache->next) {
+        pthread_mutex_lock(&cache->lock);
+        stats->allocations += cache->allocations;
+        stats->frees += cache->frees;
+        stats->refills += cache->refills;
+        stats->returned_blocks += cache->returned_blocks;
+        stats->cached_blocks += cache->blocks;
+        pthread_mutex_unlock(&cache->lock);
+    }
+
+    pthread_mutex_unlock(&list_lock);
+}
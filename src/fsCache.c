@@ -0,0 +1,671 @@
+/**************************************************************
+* Contains the block cache that sits between the file system
+* and LBAread/LBAwrite
+**************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "../include/fsCache.h"
+#include "../include/fsLow.h"
+
+#define NO_ENTRY -1
+#define SEGMENT_PROBATION 0
+#define SEGMENT_PROTECTED 1
+
+/*
+ * The cache holds whole volume blocks, indexed by block number through a chained hash table.
+ *
+ * Eviction uses a segmented LRU so that a single pass over a large file can't flush out the
+ * directory and FAT blocks that are used over and over:
+ * - A block that is read or written for the first time goes to the probation list
+ * - A block that is used again while on probation is promoted to the protected list
+ * - When the protected list grows past its limit, its least recently used block is demoted
+ *   back to probation
+ * - Victims are always taken from the least recently used end of probation first
+ *
+ * Writes are write-back: the block is only marked dirty and reaches the volume when it is
+ * evicted or when cache_flush() is called. Neighbouring dirty blocks are written together so
+ * that a write-back costs one LBAwrite per contiguous run and not one per block.
+ *
+ * Transfers of CACHE_BYPASS_BLOCKS or more go straight to the volume (while still honouring
+ * any cached copies) so that bulk file data doesn't wipe out the cache.
+ *
+ * A block can be pinned (cache_pin()) by the journal while it belongs to a transaction that
+ * isn't committed yet. A pinned block is never evicted or written back, so the volume never
+ * sees a metadata change before the journal holds it. cache_unpin() releases it once the
+ * transaction is committed.
+ *
+ * A block is only evicted once it is clean. When no block can be evicted, because every
+ * block is pinned or the dirty victim couldn't be written back, a new block can't be cached:
+ * a write fails and returns the blocks written before it, a read is still served without
+ * keeping the blocks, and read-ahead stops.
+ *
+ * cache_prefetch() reads blocks before anyone asks for them (readahead). They are placed on
+ * probation like any new block, and the first read of a prefetched block counts as its first
+ * use, so a stream that is read ahead doesn't get promoted into the protected list.
+ *
+ * One mutex guards the whole cache. fsLow isn't safe to call from several threads (it seeks
+ * and then reads or writes), so every LBAread and LBAwrite is made under that mutex too:
+ * the journal writes to the volume through cache_volume_read() and cache_volume_write().
+ */
+
+typedef struct {
+    uint64_t lba;  // Volume block held by this entry
+    char* data;    // Contents of the block
+    bool dirty;    // The block changed since it was last written to the volume
+    bool prefetched; // The block was read ahead and hasn't been read yet
+    bool pinned;   // Held for an uncommitted journal transaction, not written or evicted
+    int segment;   // Which LRU list the entry is on
+    int prev;      // Next entry towards the most recently used end of the list
+    int next;      // Next entry towards the least recently used end of the list
+    int hash_next; // Next entry in the same hash bucket
+} cache_entry;
+
+typedef struct {
+    int head;  // Most recently used entry
+    int tail;  // Least recently used entry
+    int count; // Number of entries in the list
+} cache_list;
+
+static cache_entry* entries;  // All cache entries
+static char* block_pool;      // Memory holding the cached blocks
+static char* run_buffer;      // Scratch memory used to write back a run of blocks at once
+static char* prefetch_buffer; // Scratch memory used to read ahead a run of blocks at once
+static int* buckets;          // Hash buckets, each holding the first entry of its chain
+static int bucket_mask;       // Number of buckets - 1 (the number of buckets is a power of 2)
+static int capacity;          // Number of blocks the cache can hold
+static int free_head;         // First unused entry
+static int protected_limit;   // Maximum number of entries on the protected list
+static uint64_t cache_block_size;
+static cache_list lists[2];
+static struct cache_stats stats;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Hash a block number into a bucket index
+static int hash_index(uint64_t lba) {
+    return (int)((lba * 0x9E3779B97F4A7C15ULL) >> 32) & bucket_mask;
+}
+
+// Find the entry holding a block, NO_ENTRY if the block isn't cached
+static int hash_find(uint64_t lba) {
+    int index = buckets[hash_index(lba)];
+
+    while (index != NO_ENTRY && entries[index].lba != lba)
+        index = entries[index].hash_next;
+
+    return index;
+}
+
+static void hash_insert(int index) {
+    int bucket = hash_index(entries[index].lba);
+
+    entries[index].hash_next = buckets[bucket];
+    buckets[bucket] = index;
+}
+
+static void hash_remove(int index) {
+    int* link = &buckets[hash_index(entries[index].lba)];
+
+    // Walk the chain until the link pointing at this entry is found
+    while (*link != index)
+        link = &entries[*link].hash_next;
+
+    *link = entries[index].hash_next;
+}
+
+static void list_remove(int index) {
+    cache_list* list = &lists[entries[index].segment];
+
+    if (entries[index].prev != NO_ENTRY)
+        entries[entries[index].prev].next = entries[index].next;
+    else
+        list->head = entries[index].next;
+
+    if (entries[index].next != NO_ENTRY)
+        entries[entries[index].next].prev = entries[index].prev;
+    else
+        list->tail = entries[index].prev;
+
+    list->count--;
+}
+
+// Insert an entry at the most recently used end of a list
+static void list_push(int segment, int index) {
+    cache_list* list = &lists[segment];
+
+    entries[index].segment = segment;
+    entries[index].prev = NO_ENTRY;
+    entries[index].next = list->head;
+
+    if (list->head != NO_ENTRY)
+        entries[list->head].prev = index;
+    else
+        list->tail = index;
+
+    list->head = index;
+    list->count++;
+}
+
+// Record a use of a cached block, promoting it to the protected list if it is re-used
+static void touch_entry(int index) {
+    list_remove(index);
+    list_push(SEGMENT_PROTECTED, index);
+
+    // Keep the protected list within its limit by demoting its oldest entry
+    if (lists[SEGMENT_PROTECTED].count > protected_limit) {
+        int demoted = lists[SEGMENT_PROTECTED].tail;
+        list_remove(demoted);
+        list_push(SEGMENT_PROBATION, demoted);
+    }
+}
+
+/*
+ * Write a dirty block back to the volume together with the dirty blocks cached directly
+ * before and after it, so that the whole run costs a single LBAwrite
+ */
+static int write_back(int index) {
+    int max_run = CACHE_BYPASS_BLOCKS;
+    uint64_t first = entries[index].lba;
+    uint64_t last = entries[index].lba;
+    int neighbour;
+
+    // Extend the run backwards
+    while (first > 0 && (int)(last - first + 1) < max_run) {
+        neighbour = hash_find(first - 1);
+        if (neighbour == NO_ENTRY || !entries[neighbour].dirty || entries[neighbour].pinned)
+            break;
+        first--;
+    }
+
+    // Extend the run forwards
+    while ((int)(last - first + 1) < max_run) {
+        neighbour = hash_find(last + 1);
+        if (neighbour == NO_ENTRY || !entries[neighbour].dirty || entries[neighbour].pinned)
+            break;
+        last++;
+    }
+
+    int run_length = (int)(last - first + 1);
+
+    // Gather the run into the scratch buffer
+    for (int i = 0; i < run_length; i++) {
+        neighbour = hash_find(first + i);
+        memcpy(run_buffer + i * cache_block_size, entries[neighbour].data, cache_block_size);
+    }
+
+    stats.lba_writes++;
+    if (LBAwrite(run_buffer, run_length, first) != run_length) {
+        fprintf(stderr, "LBAwrite failed to write back cached blocks.\n");
+        return -1;
+    }
+    stats.blocks_written += run_length;
+    stats.write_backs += run_length;
+
+    // The whole run is now clean
+    for (int i = 0; i < run_length; i++)
+        entries[hash_find(first + i)].dirty = false;
+
+    stats.dirty -= run_length;
+
+    return 0;
+}
+
+// Get an unused entry, evicting the least valuable block if the cache is full
+// Returns NO_ENTRY when every block is pinned, or when the victim is dirty and couldn't be
+// written back; it then stays in the cache with its data
+static int get_free_entry() {
+    int index;
+
+    if (free_head != NO_ENTRY) {
+        index = free_head;
+        free_head = entries[index].next;
+        stats.in_use++;
+        return index;
+    }
+
+    // Take the victim from probation first, so re-used blocks survive a scan
+    // Pinned blocks are skipped, the journal keeps them few enough that a victim is found
+    index = lists[SEGMENT_PROBATION].tail;
+    while (index != NO_ENTRY && entries[index].pinned)
+        index = entries[index].prev;
+
+    if (index == NO_ENTRY) {
+        index = lists[SEGMENT_PROTECTED].tail;
+        while (index != NO_ENTRY && entries[index].pinned)
+            index = entries[index].prev;
+    }
+
+    // A pinned block can't reach the volume before its transaction commits
+    if (index == NO_ENTRY)
+        return NO_ENTRY;
+
+    if (entries[index].dirty && write_back(index) != 0)
+        return NO_ENTRY;
+
+    if (entries[index].prefetched)
+        stats.prefetch_unused++;
+
+    list_remove(index);
+    hash_remove(index);
+    stats.evictions++;
+
+    return index;
+}
+
+// Place a block in the cache, the caller fills in the data
+// Returns NO_ENTRY when no entry could be freed for it
+static int insert_entry(uint64_t lba) {
+    int index = get_free_entry();
+    if (index == NO_ENTRY)
+        return NO_ENTRY;
+
+    entries[index].lba = lba;
+    entries[index].dirty = false;
+    entries[index].prefetched = false;
+    entries[index].pinned = false;
+    hash_insert(index);
+    list_push(SEGMENT_PROBATION, index);
+
+    return index;
+}
+
+// Order entries by block number so a flush can write contiguous runs
+static int compare_lba(const void* a, const void* b) {
+    uint64_t lba_a = entries[*(const int*)a].lba;
+    uint64_t lba_b = entries[*(const int*)b].lba;
+
+    return (lba_a > lba_b) - (lba_a < lba_b);
+}
+
+// Allocate the cache using at most budget_bytes of memory for block data
+int cache_init(uint64_t budget_bytes, uint64_t block_size) {
+    if (entries != NULL)
+        cache_shutdown();
+
+    cache_block_size = block_size;
+    capacity = budget_bytes / block_size;
+
+    // A cache too small to hold a directory is useless, keep a sane minimum
+    if (capacity < CACHE_BYPASS_BLOCKS)
+        capacity = CACHE_BYPASS_BLOCKS;
+
+    protected_limit = capacity * CACHE_PROTECTED_PERCENT / 100;
+
+    // Use at least twice as many buckets as entries to keep the chains short
+    int number_of_buckets = 1;
+    while (number_of_buckets < capacity * 2)
+        number_of_buckets <<= 1;
+    bucket_mask = number_of_buckets - 1;
+
+    entries = malloc(capacity * sizeof(cache_entry));
+    block_pool = malloc(capacity * block_size);
+    run_buffer = malloc(CACHE_BYPASS_BLOCKS * block_size);
+    prefetch_buffer = malloc(CACHE_BYPASS_BLOCKS * block_size);
+    buckets = malloc(number_of_buckets * sizeof(int));
+
+    if (entries == NULL || block_pool == NULL || run_buffer == NULL || prefetch_buffer == NULL ||
+        buckets == NULL) {
+        fprintf(stderr, "Memory allocation failed for the block cache.\n");
+        free(entries);
+        free(block_pool);
+        free(run_buffer);
+        free(prefetch_buffer);
+        free(buckets);
+        entries = NULL;
+        return -1;
+    }
+
+    for (int i = 0; i < number_of_buckets; i++)
+        buckets[i] = NO_ENTRY;
+
+    // Chain every entry on the free list
+    for (int i = 0; i < capacity; i++) {
+        entries[i].data = block_pool + (uint64_t)i * block_size;
+        entries[i].next = (i + 1 < capacity) ? i + 1 : NO_ENTRY;
+    }
+    free_head = 0;
+
+    for (int i = 0; i < 2; i++) {
+        lists[i].head = NO_ENTRY;
+        lists[i].tail = NO_ENTRY;
+        lists[i].count = 0;
+    }
+
+    memset(&stats, 0, sizeof(stats));
+    stats.capacity = capacity;
+
+    return 0;
+}
+
+// Read blocks through the cache, the cache is locked by the caller
+static uint64_t read_blocks(void* buffer, uint64_t lba_count, uint64_t lba_position) {
+    // Without a cache, fall through to the volume
+    if (entries == NULL)
+        return LBAread(buffer, lba_count, lba_position);
+
+    // Large transfers are not kept, so they can't push out the metadata
+    bool keep_blocks = lba_count < CACHE_BYPASS_BLOCKS;
+    char* destination = buffer;
+    uint64_t i = 0;
+
+    while (i < lba_count) {
+        int index = hash_find(lba_position + i);
+
+        // Serve a cached block
+        if (index != NO_ENTRY) {
+            memcpy(destination + i * cache_block_size, entries[index].data, cache_block_size);
+            stats.hits++;
+
+            // The first read of a read-ahead block is its first use, it stays on probation
+            if (entries[index].prefetched) {
+                entries[index].prefetched = false;
+                stats.prefetch_hits++;
+                list_remove(index);
+                list_push(SEGMENT_PROBATION, index);
+            } else {
+                touch_entry(index);
+            }
+            i++;
+            continue;
+        }
+
+        // Find the run of blocks that aren't cached and read them with a single call
+        uint64_t run_start = i;
+        while (i < lba_count && hash_find(lba_position + i) == NO_ENTRY)
+            i++;
+
+        uint64_t run_length = i - run_start;
+        char* run_destination = destination + run_start * cache_block_size;
+
+        stats.lba_reads++;
+        uint64_t blocks_read = LBAread(run_destination, run_length, lba_position + run_start);
+        stats.misses += run_length;
+        stats.blocks_read += blocks_read;
+
+        if (blocks_read != run_length)
+            return run_start + blocks_read;
+
+        // Blocks that can't be cached were still read
+        if (keep_blocks) {
+            for (uint64_t j = 0; j < run_length; j++) {
+                index = insert_entry(lba_position + run_start + j);
+                if (index == NO_ENTRY)
+                    break;
+                memcpy(entries[index].data, run_destination + j * cache_block_size,
+                       cache_block_size);
+            }
+        }
+    }
+
+    return lba_count;
+}
+
+// Read blocks through the cache, same interface as LBAread
+uint64_t cache_read(void* buffer, uint64_t lba_count, uint64_t lba_position) {
+    pthread_mutex_lock(&cache_lock);
+    uint64_t blocks_read = read_blocks(buffer, lba_count, lba_position);
+    pthread_mutex_unlock(&cache_lock);
+
+    return blocks_read;
+}
+
+// Read blocks into the cache ahead of use, the cache is locked by the caller
+static uint64_t prefetch_blocks(uint64_t lba_count, uint64_t lba_position) {
+    if (entries == NULL)
+        return 0;
+
+    // Never read ahead more than a quarter of the cache, or the read-ahead evicts itself
+    if (lba_count > (uint64_t)capacity / 4)
+        lba_count = capacity / 4;
+
+    uint64_t blocks_prefetched = 0;
+    uint64_t i = 0;
+
+    while (i < lba_count) {
+        if (hash_find(lba_position + i) != NO_ENTRY) {
+            i++;
+            continue;
+        }
+
+        // Find the run of blocks that aren't cached and read them with a single call
+        uint64_t run_start = i;
+        while (i < lba_count && i - run_start < CACHE_BYPASS_BLOCKS &&
+               hash_find(lba_position + i) == NO_ENTRY)
+            i++;
+
+        uint64_t run_length = i - run_start;
+
+        stats.lba_reads++;
+        // Inserting may write back an evicted block through run_buffer, so read into our own
+        uint64_t blocks_read = LBAread(prefetch_buffer, run_length, lba_position + run_start);
+        stats.blocks_read += blocks_read;
+
+        uint64_t blocks_cached = 0;
+        while (blocks_cached < blocks_read) {
+            int index = insert_entry(lba_position + run_start + blocks_cached);
+            if (index == NO_ENTRY)
+                break;
+
+            memcpy(entries[index].data, prefetch_buffer + blocks_cached * cache_block_size,
+                   cache_block_size);
+            entries[index].prefetched = true;
+            blocks_cached++;
+        }
+
+        stats.prefetched += blocks_cached;
+        blocks_prefetched += blocks_cached;
+
+        if (blocks_cached != run_length)
+            break;
+    }
+
+    return blocks_prefetched;
+}
+
+// Read blocks into the cache ahead of use, returns the number of blocks that were read
+// Blocks already cached are left alone, the others are read in runs of up to
+// CACHE_BYPASS_BLOCKS blocks
+uint64_t cache_prefetch(uint64_t lba_count, uint64_t lba_position) {
+    pthread_mutex_lock(&cache_lock);
+    uint64_t blocks_prefetched = prefetch_blocks(lba_count, lba_position);
+    pthread_mutex_unlock(&cache_lock);
+
+    return blocks_prefetched;
+}
+
+// Write blocks through the cache, the cache is locked by the caller
+static uint64_t write_blocks(void* buffer, uint64_t lba_count, uint64_t lba_position) {
+    // Without a cache, fall through to the volume
+    if (entries == NULL)
+        return LBAwrite(buffer, lba_count, lba_position);
+
+    char* source = buffer;
+
+    // Large transfers go straight to the volume, cached copies are refreshed and become clean
+    if (lba_count >= CACHE_BYPASS_BLOCKS) {
+        stats.lba_writes++;
+        uint64_t blocks_written = LBAwrite(buffer, lba_count, lba_position);
+        stats.blocks_written += blocks_written;
+
+        for (uint64_t i = 0; i < lba_count; i++) {
+            int index = hash_find(lba_position + i);
+
+            if (index != NO_ENTRY) {
+                memcpy(entries[index].data, source + i * cache_block_size, cache_block_size);
+
+                if (entries[index].dirty && i < blocks_written) {
+                    entries[index].dirty = false;
+                    stats.dirty--;
+                }
+            }
+        }
+
+        return blocks_written;
+    }
+
+    // Small writes only update the cache, the volume is written on eviction or flush
+    for (uint64_t i = 0; i < lba_count; i++) {
+        int index = hash_find(lba_position + i);
+
+        if (index != NO_ENTRY)
+            touch_entry(index);
+        else
+            index = insert_entry(lba_position + i);
+
+        // The cache can't take the block, the blocks before it were written
+        if (index == NO_ENTRY)
+            return i;
+
+        entries[index].prefetched = false;
+
+        memcpy(entries[index].data, source + i * cache_block_size, cache_block_size);
+
+        if (!entries[index].dirty) {
+            entries[index].dirty = true;
+            stats.dirty++;
+        }
+    }
+
+    return lba_count;
+}
+
+// Write blocks through the cache, same interface as LBAwrite
+uint64_t cache_write(void* buffer, uint64_t lba_count, uint64_t lba_position) {
+    pthread_mutex_lock(&cache_lock);
+    uint64_t blocks_written = write_blocks(buffer, lba_count, lba_position);
+    pthread_mutex_unlock(&cache_lock);
+
+    return blocks_written;
+}
+
+// Read blocks straight from the volume, leaving the cache alone
+// For blocks the cache never holds, LBAread can't be called while the cache uses the volume
+uint64_t cache_volume_read(void* buffer, uint64_t lba_count, uint64_t lba_position) {
+    pthread_mutex_lock(&cache_lock);
+    uint64_t blocks_read = LBAread(buffer, lba_count, lba_position);
+    pthread_mutex_unlock(&cache_lock);
+
+    return blocks_read;
+}
+
+// Write blocks straight to the volume, leaving the cache alone
+// For blocks the cache never holds, LBAwrite can't be called while the cache uses the volume
+uint64_t cache_volume_write(void* buffer, uint64_t lba_count, uint64_t lba_position) {
+    pthread_mutex_lock(&cache_lock);
+    uint64_t blocks_written = LBAwrite(buffer, lba_count, lba_position);
+    pthread_mutex_unlock(&cache_lock);
+
+    return blocks_written;
+}
+
+// Write every dirty block to the volume, the cache is locked by the caller
+static int flush_blocks() {
+    if (entries == NULL || stats.dirty == 0)
+        return 0;
+
+    int* dirty_entries = malloc(stats.dirty * sizeof(int));
+    if (dirty_entries == NULL) {
+        fprintf(stderr, "Memory allocation failed while flushing the block cache.\n");
+        return -1;
+    }
+
+    // Collect the dirty entries from both lists, pinned blocks wait for their transaction
+    int number_dirty = 0;
+    for (int segment = 0; segment < 2; segment++) {
+        for (int index = lists[segment].head; index != NO_ENTRY; index = entries[index].next) {
+            if (entries[index].dirty && !entries[index].pinned)
+                dirty_entries[number_dirty++] = index;
+        }
+    }
+
+    qsort(dirty_entries, number_dirty, sizeof(int), compare_lba);
+
+    // write_back() picks up the neighbouring dirty blocks, so most entries are already clean
+    // by the time the loop reaches them
+    int result = 0;
+    for (int i = 0; i < number_dirty; i++) {
+        if (entries[dirty_entries[i]].dirty && write_back(dirty_entries[i]) != 0)
+            result = -1;
+    }
+
+    free(dirty_entries);
+
+    return result;
+}
+
+// Write every dirty block to the volume, in block order and in contiguous runs
+int cache_flush() {
+    pthread_mutex_lock(&cache_lock);
+    int result = flush_blocks();
+    pthread_mutex_unlock(&cache_lock);
+
+    return result;
+}
+
+// Keep a cached block from reaching the volume until cache_unpin() is called
+// Returns -1 if the block isn't cached
+int cache_pin(uint64_t lba) {
+    int result = -1;
+    pthread_mutex_lock(&cache_lock);
+
+    int index = entries == NULL ? NO_ENTRY : hash_find(lba);
+    if (index != NO_ENTRY) {
+        if (!entries[index].pinned) {
+            entries[index].pinned = true;
+            stats.pinned++;
+        }
+        result = 0;
+    }
+
+    pthread_mutex_unlock(&cache_lock);
+    return result;
+}
+
+// Let a pinned block be written back and evicted again
+void cache_unpin(uint64_t lba) {
+    pthread_mutex_lock(&cache_lock);
+
+    int index = entries == NULL ? NO_ENTRY : hash_find(lba);
+    if (index != NO_ENTRY && entries[index].pinned) {
+        entries[index].pinned = false;
+        stats.pinned--;
+    }
+
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// Write back all dirty blocks and release the cache
+void cache_shutdown() {
+    pthread_mutex_lock(&cache_lock);
+
+    if (entries == NULL) {
+        pthread_mutex_unlock(&cache_lock);
+        return;
+    }
+
+    flush_blocks();
+
+    free(entries);
+    free(block_pool);
+    free(run_buffer);
+    free(prefetch_buffer);
+    free(buckets);
+    entries = NULL;
+    block_pool = NULL;
+    run_buffer = NULL;
+    prefetch_buffer = NULL;
+    buckets = NULL;
+
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// Copy the current cache counters into stats
+void cache_get_stats(struct cache_stats* out_stats) {
+    pthread_mutex_lock(&cache_lock);
+    *out_stats = stats;
+    pthread_mutex_unlock(&cache_lock);
+}
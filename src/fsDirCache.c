@@ -0,0 +1,871 @@
+/**************************************************************
+* Contains the table of directories held in memory
+**************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "../include/fsDirCache.h"
+#include "../include/mfs.h"
+#include "../include/fsDirectory.h"
+#include "../include/fsHelperFuncs.h"
+
+/*
+ * Every directory in memory is one shared object in this table, keyed by the start block of
+ * the directory. load_dir() and parse_path() hand out the same DirectoryEntry array to
+ * everyone using that directory, so a change made through one user is seen by all of them,
+ * and a directory already in memory is never read from the volume again.
+ *
+ * Each object counts its users. Whoever gets a directory (load_dir, parse_path, fs_opendir,
+ * b_open for the parent of the file) releases it with free_directory() once done. The root
+ * and the current directory are held by fs_dir_root and fs_dir_curr for as long as they are
+ * in those roles.
+ *
+ * write_dir() only marks the directory as dirty. A dirty directory is written to the volume
+ * when one of its users releases it, so an operation that changes a directory several times
+ * writes it once, at the end.
+ *
+ * Most operations change one or two entries, so each directory also flags which of its blocks
+ * changed. write_dir_entry() flags the blocks holding one entry, write_dir() flags them all,
+ * and the write back only writes the flagged blocks. A directory that wasn't changed isn't
+ * written at all.
+ *
+ * Each directory also gets a name index (fsDirIndex) when it enters the table. The same
+ * reports of changed entries keep it up to date.
+ *
+ * Directories nobody uses stay in memory, in least recently used order, until the memory
+ * they take exceeds the budget. Directories in use are never evicted, even past the budget,
+ * and neither is the directory released last: a directory larger than the budget stays in
+ * memory while it is being worked on, instead of being read and indexed again by every
+ * operation.
+ *
+ * fs_opendir() holds a directory with dir_cache_open(), which doesn't load it. If the
+ * directory isn't in memory the table keeps an object for it whose entries aren't loaded,
+ * and fs_readdir() reads its blocks from the volume one at a time, under the object's lock.
+ * Nobody can change a directory that isn't loaded, since changing it takes loading it. The
+ * first user that gets it loads the entries into the object's array, and the readers use the
+ * array from then on. The object also marks the directory removed if it is removed meanwhile.
+ * An object that was never loaded is freed with its last user.
+ *
+ * A directory grows when it runs out of free slots (grow_directory()). Its users keep pointers
+ * into the array, so the array can't move: each array sits in a range of addresses reserved
+ * for DIR_ENTRIES_LIMIT entries, which takes no memory, and only the pages holding the
+ * directory's entries are mapped. dir_cache_reserve() maps more before the directory grows.
+ * The memory counted for a directory is what is mapped for it, an object that isn't loaded
+ * takes a page for its header.
+ *
+ * A removed directory is forgotten by the table. If it is still in use it stays in memory,
+ * detached from its start block, until its last user releases it, and it is never written
+ * back since its blocks may already belong to something else.
+ *
+ * A reader/writer lock guards the table itself: the buckets, the least recently used list,
+ * the memory counters and the removed flags. Each directory also has a reader/writer lock
+ * guarding its entries, its dirty flags and its name index. Whoever reads a directory locks it
+ * shared (dir_cache_lock()), whoever changes it locks it exclusive and reports the change
+ * before unlocking. A directory is released unlocked, its write back tries its lock. The
+ * table's lock is taken inside a directory lock, never the other way around: unused
+ * directories are written back under the table's lock alone, since nobody else can reach
+ * them, and dir_cache_flush() holds the directories in use and writes them after unlocking the
+ * table. A directory is marked removed with both its lock and the table's lock held, so
+ * whoever holds either one can read the flag.
+ *
+ * Each array handed out by the table is preceded by a header pointing to its object, so the
+ * calls made with an array the caller holds (locking it, reporting changes, getting its name
+ * index, adding or dropping a user) reach the object without the table's lock. Only finding a
+ * directory by its start block takes the lock, shared when the directory is in use, and only
+ * changes to the table take it exclusive: loading, inserting and evicting a directory, and a
+ * directory becoming unused or used again. The count of users is changed atomically; it goes
+ * from 0 to 1 and from 1 to 0 only with the table's lock held exclusive, since that moves the
+ * directory out of or into the least recently used list.
+ */
+
+typedef struct dir_object {
+    DirectoryEntry* entries;     // The directory, shared by all its users
+    int start_block;             // Start block of the directory on the volume
+    size_t bytes;                // Memory mapped for the header and the entries
+    int refcount;                // Number of users holding the directory, changed atomically
+    bool dirty;                  // Changed since it was last written to the volume
+    bool* dirty_blocks;          // Which directory blocks changed, NULL to always write them all
+    int block_count;             // Number of blocks the directory occupies
+    dir_name_index names;        // Slot of each name and the free slots
+    bool has_names;              // Whether names could be built, lookups scan the slots if not
+    bool removed;                // Forgotten by the table, freed once its last user is done
+    bool loaded;                 // Whether entries holds the directory, set atomically
+    pthread_rwlock_t lock;       // Shared to read the directory, exclusive to change it
+    struct dir_object* hash_next;
+    struct dir_object* lru_prev; // Neighbours in the list of unused directories
+    struct dir_object* lru_next;
+} dir_object;
+
+static dir_object* buckets[DIR_CACHE_BUCKETS];
+static dir_object* lru_head;     // Most recently released unused directory
+static dir_object* lru_tail;     // Least recently released, evicted first
+static size_t budget;
+static struct dir_cache_stats stats;
+static uint64_t hits;           // Counted apart from stats, lookups add to it under a shared lock
+static pthread_rwlock_t table_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// What precedes each array handed out by the table
+typedef struct {
+    struct dir_object* object;   // The object holding the array, NULL until it is inserted
+    void* reserved;              // Keeps the array aligned as malloc() would
+} entries_header;
+
+#define ENTRIES_RESERVED_SIZE (sizeof(entries_header) + DIR_ENTRIES_LIMIT * sizeof(DirectoryEntry))
+
+static int bucket_of(int start_block) {
+    return (unsigned int)start_block & (DIR_CACHE_BUCKETS - 1);
+}
+
+static void lru_unlink(dir_object* object) {
+    if (object->lru_prev != NULL)
+        object->lru_prev->lru_next = object->lru_next;
+    else
+        lru_head = object->lru_next;
+
+    if (object->lru_next != NULL)
+        object->lru_next->lru_prev = object->lru_prev;
+    else
+        lru_tail = object->lru_prev;
+
+    object->lru_prev = NULL;
+    object->lru_next = NULL;
+}
+
+static void lru_push_front(dir_object* object) {
+    object->lru_prev = NULL;
+    object->lru_next = lru_head;
+
+    if (lru_head != NULL)
+        lru_head->lru_prev = object;
+    else
+        lru_tail = object;
+
+    lru_head = object;
+}
+
+static void hash_unlink(dir_object* object) {
+    dir_object** link = &buckets[bucket_of(object->start_block)];
+
+    while (*link != NULL && *link != object)
+        link = &(*link)->hash_next;
+
+    if (*link != NULL)
+        *link = object->hash_next;
+
+    object->hash_next = NULL;
+}
+
+// Memory mapped for an array holding bytes bytes of entries, with its header, in whole pages
+static size_t mapping_size(size_t bytes) {
+    size_t page_size = sysconf(_SC_PAGESIZE);
+
+    return (sizeof(entries_header) + bytes + page_size - 1) / page_size * page_size;
+}
+
+// Map the first bytes bytes of entries, *mapped holding how much of its array already is
+// Returns 0 on success, -1 on failure
+static int map_entries(DirectoryEntry* entries, size_t* mapped, size_t bytes) {
+    size_t size = mapping_size(bytes);
+    if (size <= *mapped)
+        return 0;
+
+    char* start = (char*) ((entries_header*) entries - 1);
+    if (mprotect(start + *mapped, size - *mapped, PROT_READ | PROT_WRITE) != 0) {
+        fprintf(stderr, "Memory allocation failed for a directory.\n");
+        return -1;
+    }
+
+    *mapped = size;
+    return 0;
+}
+
+// Reserve an array a directory can grow in without moving, with bytes bytes of it mapped
+// *mapped is set to the memory mapped. Returns NULL if it can't be reserved
+static DirectoryEntry* reserve_entries(size_t bytes, size_t* mapped) {
+    entries_header* header = mmap(NULL, ENTRIES_RESERVED_SIZE, PROT_NONE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+    if (header == MAP_FAILED) {
+        fprintf(stderr, "Memory allocation failed for a directory.\n");
+        return NULL;
+    }
+
+    DirectoryEntry* entries = (DirectoryEntry*) (header + 1);
+
+    *mapped = 0;
+    if (map_entries(entries, mapped, bytes) != 0) {
+        munmap(header, ENTRIES_RESERVED_SIZE);
+        return NULL;
+    }
+
+    return entries;
+}
+
+static void release_entries(DirectoryEntry* entries) {
+    munmap((entries_header*) entries - 1, ENTRIES_RESERVED_SIZE);
+}
+
+static void free_object(dir_object* object) {
+    stats.objects--;
+    stats.bytes -= object->bytes;
+    release_entries(object->entries);
+    free(object->dirty_blocks);
+    dir_index_free(&object->names);
+    pthread_rwlock_destroy(&object->lock);
+    free(object);
+}
+
+// The directory starting at start_block, NULL if it isn't in memory
+static dir_object* find_block(int start_block) {
+    for (dir_object* object = buckets[bucket_of(start_block)]; object != NULL;
+         object = object->hash_next) {
+        if (object->start_block == start_block && !object->removed)
+            return object;
+    }
+
+    return NULL;
+}
+
+// The object holding an array handed out by the table
+// The caller holds the array, so the object can't go away meanwhile
+static dir_object* find_entries(DirectoryEntry* dir) {
+    return ((entries_header*) dir - 1)->object;
+}
+
+// Add a user to an object that already has one, without the table's lock
+// Returns false if it had none, its first user is added with the table locked exclusive
+static bool hold_object(dir_object* object) {
+    int refcount = __atomic_load_n(&object->refcount, __ATOMIC_RELAXED);
+
+    while (refcount > 0) {
+        if (__atomic_compare_exchange_n(&object->refcount, &refcount, refcount + 1, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return true;
+    }
+
+    return false;
+}
+
+// Take away a user of an object that has others, without the table's lock
+// Returns false if it is the last one, which is dropped with the table locked exclusive
+static bool unhold_object(dir_object* object) {
+    int refcount = __atomic_load_n(&object->refcount, __ATOMIC_RELAXED);
+
+    while (refcount > 1) {
+        if (__atomic_compare_exchange_n(&object->refcount, &refcount, refcount - 1, false,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            return true;
+    }
+
+    return false;
+}
+
+// Write a dirty directory to the volume
+// Returns the number of blocks written, -1 on failure. The caller adds them to the counters
+// with count_write_back() under the table's mutex
+static int write_back(dir_object* object) {
+    if (!object->dirty || object->removed)
+        return 0;
+
+    if (write_dir_blocks(object->entries, object->dirty_blocks) != 0)
+        return -1;
+
+    int blocks_written = object->block_count;
+    if (object->dirty_blocks != NULL) {
+        blocks_written = 0;
+
+        for (int block = 0; block < object->block_count; block++) {
+            if (object->dirty_blocks[block])
+                blocks_written++;
+            object->dirty_blocks[block] = false;
+        }
+    }
+
+    object->dirty = false;
+    return blocks_written;
+}
+
+static void count_write_back(int blocks_written) {
+    if (blocks_written > 0) {
+        stats.write_backs++;
+        stats.blocks_written += blocks_written;
+    }
+}
+
+// Drop unused directories, oldest first, until the table fits in the budget
+static void evict_to_budget() {
+    while (stats.bytes > budget && lru_tail != NULL && lru_tail != lru_head) {
+        dir_object* object = lru_tail;
+
+        count_write_back(write_back(object));
+        lru_unlink(object);
+        hash_unlink(object);
+        free_object(object);
+        stats.evictions++;
+    }
+}
+
+// Add an object for the directory starting at start_block, with one user and its entries
+// not loaded yet, its array having mapped bytes mapped
+static dir_object* new_object(DirectoryEntry* dir, int start_block, size_t mapped) {
+    dir_object* object = calloc(1, sizeof(dir_object));
+    if (object == NULL) {
+        fprintf(stderr, "Memory allocation failed for the directory table.\n");
+        return NULL;
+    }
+
+    object->entries = dir;
+    object->start_block = start_block;
+    object->bytes = mapped;
+    object->refcount = 1;
+    ((entries_header*) dir - 1)->object = object;
+    pthread_rwlock_init(&object->lock, NULL);
+
+    int bucket = bucket_of(start_block);
+    object->hash_next = buckets[bucket];
+    buckets[bucket] = object;
+
+    stats.objects++;
+    stats.bytes += mapped;
+    return object;
+}
+
+// Record that the entries of an object were loaded
+static void loaded_object(dir_object* object) {
+    DirectoryEntry* dir = object->entries;
+
+    object->block_count = dir_block_count(dir[0].size / sizeof(DirectoryEntry));
+
+    // Without the flags every write back writes the whole directory
+    object->dirty_blocks = calloc(object->block_count, sizeof(bool));
+
+    // Index the names of the directory for lookups and slot allocation
+    object->has_names = dir_index_build(&object->names, dir,
+                                        dir[0].size / sizeof(DirectoryEntry)) == 0;
+
+    // Readers of a directory that wasn't loaded switch to the array from now on
+    __atomic_store_n(&object->loaded, true, __ATOMIC_RELEASE);
+}
+
+// Add a directory array to the table with one user, mapped bytes of it being mapped
+static dir_object* insert(DirectoryEntry* dir, int start_block, size_t mapped) {
+    dir_object* object = new_object(dir, start_block, mapped);
+    if (object == NULL)
+        return NULL;
+
+    loaded_object(object);
+    evict_to_budget();
+    return object;
+}
+
+// Start an empty table that keeps unused directories up to budget_bytes
+int dir_cache_init(size_t budget_bytes) {
+    dir_cache_shutdown();
+
+    budget = budget_bytes;
+    memset(&stats, 0, sizeof(stats));
+    __atomic_store_n(&hits, 0, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// Read the directory starting at start_block into dir, size being the size its entry holds
+// The array is mapped as far as the entries need, *mapped holding how much of it is
+// Returns its number of entries, -1 if it can't be read
+static int load_entries(DirectoryEntry* dir, size_t* mapped, int start_block, size_t size) {
+    // A directory holds at least . and ..
+    int entry_count = size / sizeof(DirectoryEntry);
+    if (entry_count < 2) {
+        fprintf(stderr, "Invalid directory size: %zu.\n", size);
+        return -1;
+    }
+
+    if (entry_count > DIR_ENTRIES_LIMIT)
+        entry_count = DIR_ENTRIES_LIMIT;
+
+    if (map_entries(dir, mapped, entry_count * sizeof(DirectoryEntry)) != 0 ||
+        load_dir_helper(dir, start_block, entry_count) != 0)
+        return -1;
+
+    // The size held by the parent is only a hint, . holds the size the directory grew to
+    int actual_count = dir[0].size / sizeof(DirectoryEntry);
+    if (actual_count != entry_count && actual_count >= 2 && actual_count <= DIR_ENTRIES_LIMIT) {
+        if (actual_count < entry_count)
+            memset(&dir[actual_count], 0, (entry_count - actual_count) * sizeof(DirectoryEntry));
+        else if (map_entries(dir, mapped, actual_count * sizeof(DirectoryEntry)) != 0 ||
+                 load_dir_helper(dir, start_block, actual_count) != 0)
+            return -1;
+
+        entry_count = actual_count;
+    }
+
+    return entry_count;
+}
+
+// Get a directory, the table is locked exclusive by the caller
+static DirectoryEntry* get_directory(int start_block, size_t size) {
+    dir_object* object = find_block(start_block);
+
+    if (object != NULL && object->loaded) {
+        // An unused directory is in use again, it can't be evicted
+        if (__atomic_fetch_add(&object->refcount, 1, __ATOMIC_ACQUIRE) == 0)
+            lru_unlink(object);
+
+        __atomic_fetch_add(&hits, 1, __ATOMIC_RELAXED);
+        return object->entries;
+    }
+
+    stats.misses++;
+
+    // Readers hold the directory without its entries, they are loaded into its array
+    if (object != NULL) {
+        size_t mapped = object->bytes;
+        int entry_count = load_entries(object->entries, &mapped, start_block, size);
+
+        // What got mapped stays mapped until the object is freed, even if loading failed
+        stats.bytes += mapped - object->bytes;
+        object->bytes = mapped;
+
+        if (entry_count < 0)
+            return NULL;
+
+        __atomic_fetch_add(&object->refcount, 1, __ATOMIC_ACQUIRE);
+        loaded_object(object);
+        evict_to_budget();
+        return object->entries;
+    }
+
+    size_t mapped;
+    DirectoryEntry* dir = reserve_entries(0, &mapped);
+    if (dir == NULL)
+        return NULL;
+
+    int entry_count = load_entries(dir, &mapped, start_block, size);
+    if (entry_count < 0 || insert(dir, start_block, mapped) == NULL) {
+        release_entries(dir);
+        return NULL;
+    }
+
+    return dir;
+}
+
+// Get the directory starting at start_block, loading it if it isn't in memory
+// Returns NULL if it can't be loaded. Release it with dir_cache_release() once done
+DirectoryEntry* dir_cache_get(int start_block, size_t size) {
+    // A directory in use is shared with a shared lock on the table
+    pthread_rwlock_rdlock(&table_lock);
+    dir_object* object = find_block(start_block);
+    if (object != NULL && object->loaded && hold_object(object)) {
+        pthread_rwlock_unlock(&table_lock);
+        __atomic_fetch_add(&hits, 1, __ATOMIC_RELAXED);
+        return object->entries;
+    }
+    pthread_rwlock_unlock(&table_lock);
+
+    // Loading with the table locked exclusive keeps two threads from loading the same directory
+    pthread_rwlock_wrlock(&table_lock);
+    DirectoryEntry* dir = get_directory(start_block, size);
+    pthread_rwlock_unlock(&table_lock);
+
+    return dir;
+}
+
+// Add a user to a directory the caller already holds, returns dir
+DirectoryEntry* dir_cache_hold(DirectoryEntry* dir) {
+    dir_object* object = find_entries(dir);
+
+    // The caller's hold keeps the count above 0
+    if (object != NULL)
+        __atomic_fetch_add(&object->refcount, 1, __ATOMIC_RELAXED);
+
+    return dir;
+}
+
+// Hold the directory starting at start_block without loading it, for reading it a block at a
+// time. Returns its array, which holds its entries only once dir_cache_loaded() says so, NULL
+// on failure. Release it with dir_cache_release() once done
+DirectoryEntry* dir_cache_open(int start_block) {
+    pthread_rwlock_wrlock(&table_lock);
+    dir_object* object = find_block(start_block);
+
+    if (object != NULL) {
+        if (__atomic_fetch_add(&object->refcount, 1, __ATOMIC_ACQUIRE) == 0)
+            lru_unlink(object);
+
+        pthread_rwlock_unlock(&table_lock);
+        return object->entries;
+    }
+
+    // Only the header is mapped until the entries are loaded
+    size_t mapped;
+    DirectoryEntry* dir = reserve_entries(0, &mapped);
+    if (dir != NULL && new_object(dir, start_block, mapped) == NULL) {
+        release_entries(dir);
+        dir = NULL;
+    }
+
+    pthread_rwlock_unlock(&table_lock);
+    return dir;
+}
+
+// Whether the entries of a directory from dir_cache_open() are in its array
+// The caller holds the directory locked, it stays loaded until its last user releases it
+bool dir_cache_loaded(DirectoryEntry* dir) {
+    return __atomic_load_n(&find_entries(dir)->loaded, __ATOMIC_ACQUIRE);
+}
+
+// Forget the directory starting at start_block, the table is locked by the caller
+static void forget_block(int start_block) {
+    dir_object* object = find_block(start_block);
+
+    if (object == NULL)
+        return;
+
+    if (__atomic_load_n(&object->refcount, __ATOMIC_RELAXED) > 0) {
+        // Its users may still read it, it is freed by the last one
+        object->removed = true;
+        return;
+    }
+
+    lru_unlink(object);
+    hash_unlink(object);
+    free_object(object);
+}
+
+// Take away a user of a directory, the table is locked exclusive by the caller
+static void drop_user(dir_object* object) {
+    if (__atomic_sub_fetch(&object->refcount, 1, __ATOMIC_RELEASE) > 0)
+        return;
+
+    // A directory that was never loaded has nothing to keep
+    if (object->removed || !object->loaded) {
+        hash_unlink(object);
+        free_object(object);
+        return;
+    }
+
+    lru_push_front(object);
+    evict_to_budget();
+}
+
+// Hand a newly created directory of bytes bytes over to the table, with one user
+// The table copies it into an array it can grow in and frees dir
+// Returns the array to use from now on, NULL on failure (dir is left to the caller)
+DirectoryEntry* dir_cache_adopt(DirectoryEntry* dir, size_t bytes) {
+    size_t mapped;
+    DirectoryEntry* entries = reserve_entries(bytes, &mapped);
+    if (entries == NULL)
+        return NULL;
+
+    memcpy(entries, dir, bytes);
+
+    pthread_rwlock_wrlock(&table_lock);
+
+    // The start block was released by a directory the table still remembers
+    forget_block(dir[0].start_block);
+
+    if (insert(entries, entries[0].start_block, mapped) == NULL) {
+        pthread_rwlock_unlock(&table_lock);
+        release_entries(entries);
+        return NULL;
+    }
+
+    pthread_rwlock_unlock(&table_lock);
+    free(dir);
+    return entries;
+}
+
+// Map the array of a directory for entry_count entries, before it grows to them
+// The caller holds the directory locked exclusive
+// Returns 0 on success, -1 if the memory can't be mapped
+int dir_cache_reserve(DirectoryEntry* dir, int entry_count) {
+    dir_object* object = find_entries(dir);
+
+    if (object == NULL)
+        return 0;
+
+    // Only a user holding the directory locked exclusive maps more of a loaded one
+    size_t mapped = object->bytes;
+    if (map_entries(dir, &mapped, entry_count * sizeof(DirectoryEntry)) != 0)
+        return -1;
+
+    pthread_rwlock_wrlock(&table_lock);
+    stats.bytes += mapped - object->bytes;
+    object->bytes = mapped;
+    pthread_rwlock_unlock(&table_lock);
+
+    return 0;
+}
+
+// Record that a directory grew to entry_count entries, dir[0].size already holding the new size
+// Its new blocks and . are written back when a user releases it
+// The caller holds the directory locked exclusive
+int dir_cache_grow(DirectoryEntry* dir, int entry_count) {
+    dir_object* object = find_entries(dir);
+
+    if (object == NULL)
+        return write_dir_helper(dir);
+
+    int block_count = dir_block_count(entry_count);
+
+    bool* dirty_blocks = realloc(object->dirty_blocks, block_count * sizeof(bool));
+    if (dirty_blocks == NULL) {
+        // Without the flags every write back writes the whole directory
+        free(object->dirty_blocks);
+    } else {
+        for (int block = object->block_count; block < block_count; block++)
+            dirty_blocks[block] = true;
+        dirty_blocks[0] = true;
+    }
+
+    object->dirty_blocks = dirty_blocks;
+    object->block_count = block_count;
+    object->dirty = true;
+
+    // The new slots are all free
+    object->has_names = dir_index_build(&object->names, dir, entry_count) == 0;
+    return 0;
+}
+
+// Release a directory, writing it to the volume if it changed
+// Once unused it stays in memory, as long as the budget allows
+// The caller must not hold the directory locked. A directory someone else holds locked is
+// written back by that user's release, or by the next dir_cache_flush()
+void dir_cache_release(DirectoryEntry* dir) {
+    if (dir == NULL)
+        return;
+
+    dir_object* object = find_entries(dir);
+
+    if (object == NULL) {
+        fprintf(stderr, "Released a directory that isn't in the directory table.\n");
+        return;
+    }
+
+    // The caller's hold keeps the object alive while the table is unlocked
+    // Releasing never waits for a directory lock, the caller may hold another directory
+    int blocks_written = 0;
+    if (pthread_rwlock_trywrlock(&object->lock) == 0) {
+        blocks_written = write_back(object);
+        pthread_rwlock_unlock(&object->lock);
+    }
+
+    // The table is only locked to count a write back or to drop the last user
+    if (blocks_written == 0 && unhold_object(object))
+        return;
+
+    pthread_rwlock_wrlock(&table_lock);
+    count_write_back(blocks_written);
+    drop_user(object);
+    pthread_rwlock_unlock(&table_lock);
+}
+
+// Lock a directory from the table, DIR_LOCK_SHARED to read it or DIR_LOCK_EXCLUSIVE to change it
+void dir_cache_lock(DirectoryEntry* dir, int mode) {
+    dir_object* object = find_entries(dir);
+
+    if (object == NULL)
+        return;
+
+    if (mode == DIR_LOCK_EXCLUSIVE)
+        pthread_rwlock_wrlock(&object->lock);
+    else
+        pthread_rwlock_rdlock(&object->lock);
+}
+
+// Same as dir_cache_lock, but gives up if someone else holds the lock
+// Returns 0 once locked, -1 if the directory is busy
+int dir_cache_trylock(DirectoryEntry* dir, int mode) {
+    dir_object* object = find_entries(dir);
+
+    if (object == NULL)
+        return 0;
+
+    if (mode == DIR_LOCK_EXCLUSIVE)
+        return pthread_rwlock_trywrlock(&object->lock) == 0 ? 0 : -1;
+
+    return pthread_rwlock_tryrdlock(&object->lock) == 0 ? 0 : -1;
+}
+
+// Unlock a directory locked with dir_cache_lock or dir_cache_trylock
+void dir_cache_unlock(DirectoryEntry* dir) {
+    dir_object* object = find_entries(dir);
+
+    if (object != NULL)
+        pthread_rwlock_unlock(&object->lock);
+}
+
+// Whether a directory was removed while the caller held it
+// The caller holds the directory locked, the flag is only set with its lock held exclusive
+bool dir_cache_removed(DirectoryEntry* dir) {
+    dir_object* object = find_entries(dir);
+
+    return object != NULL && object->removed;
+}
+
+// Record that a whole directory changed, it is written back when a user releases it
+// The caller holds the directory locked exclusive
+void dir_cache_mark_dirty(DirectoryEntry* dir) {
+    dir_object* object = find_entries(dir);
+
+    if (object == NULL) {
+        write_dir_helper(dir);
+        return;
+    }
+
+    object->dirty = true;
+
+    if (object->dirty_blocks != NULL) {
+        for (int block = 0; block < object->block_count; block++)
+            object->dirty_blocks[block] = true;
+    }
+
+    // Any entry may have changed
+    object->has_names = dir_index_build(&object->names, dir,
+                                        dir[0].size / sizeof(DirectoryEntry)) == 0;
+}
+
+// Record that the entry at index changed, only its blocks are written back
+// The caller holds the directory locked exclusive
+void dir_cache_mark_entry_dirty(DirectoryEntry* dir, int index) {
+    dir_object* object = find_entries(dir);
+
+    if (object == NULL) {
+        write_dir_helper(dir);
+        return;
+    }
+
+    object->dirty = true;
+
+    if (object->dirty_blocks != NULL) {
+        int first_block, last_block;
+        dir_entry_blocks(index, &first_block, &last_block);
+
+        for (int block = first_block; block <= last_block && block < object->block_count; block++)
+            object->dirty_blocks[block] = true;
+    }
+
+    if (object->has_names)
+        dir_index_update(&object->names, dir, index);
+}
+
+// Forget the directory starting at start_block, call when the directory is removed
+// A directory in use must be locked exclusive by the caller
+void dir_cache_forget(int start_block) {
+    pthread_rwlock_wrlock(&table_lock);
+    forget_block(start_block);
+    pthread_rwlock_unlock(&table_lock);
+}
+
+// The name index of a directory from the table, NULL if it has none
+// The index is guarded by the directory's lock, held by the caller
+dir_name_index* dir_cache_name_index(DirectoryEntry* dir) {
+    dir_object* object = find_entries(dir);
+
+    if (object == NULL || !object->has_names)
+        return NULL;
+
+    return &object->names;
+}
+
+// Write every changed directory to the volume
+int dir_cache_flush() {
+    int result = 0;
+    int in_use = 0;
+
+    pthread_rwlock_wrlock(&table_lock);
+
+    // Unused directories can only be reached through the table, they are written right away
+    for (int bucket = 0; bucket < DIR_CACHE_BUCKETS; bucket++) {
+        for (dir_object* object = buckets[bucket]; object != NULL; object = object->hash_next) {
+            if (__atomic_load_n(&object->refcount, __ATOMIC_RELAXED) > 0) {
+                in_use++;
+                continue;
+            }
+
+            int blocks_written = write_back(object);
+            if (blocks_written < 0)
+                result = -1;
+            count_write_back(blocks_written);
+        }
+    }
+
+    // Directories in use are held, and written under their own lock once the table is unlocked
+    dir_object** held = NULL;
+    if (in_use > 0) {
+        held = malloc(in_use * sizeof(dir_object*));
+        if (held == NULL) {
+            pthread_rwlock_unlock(&table_lock);
+            fprintf(stderr, "Memory allocation failed while flushing the directory table.\n");
+            return -1;
+        }
+    }
+
+    int held_count = 0;
+    for (int bucket = 0; bucket < DIR_CACHE_BUCKETS; bucket++) {
+        for (dir_object* object = buckets[bucket]; object != NULL; object = object->hash_next) {
+            if (__atomic_load_n(&object->refcount, __ATOMIC_RELAXED) > 0 && !object->removed) {
+                __atomic_fetch_add(&object->refcount, 1, __ATOMIC_RELAXED);
+                held[held_count++] = object;
+            }
+        }
+    }
+
+    pthread_rwlock_unlock(&table_lock);
+
+    for (int i = 0; i < held_count; i++) {
+        pthread_rwlock_wrlock(&held[i]->lock);
+        int blocks_written = write_back(held[i]);
+        pthread_rwlock_unlock(&held[i]->lock);
+
+        if (blocks_written < 0)
+            result = -1;
+
+        pthread_rwlock_wrlock(&table_lock);
+        count_write_back(blocks_written);
+        pthread_rwlock_unlock(&table_lock);
+    }
+
+    pthread_rwlock_wrlock(&table_lock);
+    for (int i = 0; i < held_count; i++)
+        drop_user(held[i]);
+    pthread_rwlock_unlock(&table_lock);
+
+    free(held);
+    return result;
+}
+
+// Write every changed directory to the volume and free the whole table
+void dir_cache_shutdown() {
+    dir_cache_flush();
+    pthread_rwlock_wrlock(&table_lock);
+
+    for (int bucket = 0; bucket < DIR_CACHE_BUCKETS; bucket++) {
+        dir_object* object = buckets[bucket];
+
+        while (object != NULL) {
+            dir_object* next = object->hash_next;
+            free_object(object);
+            object = next;
+        }
+
+        buckets[bucket] = NULL;
+    }
+
+    lru_head = NULL;
+    lru_tail = NULL;
+    pthread_rwlock_unlock(&table_lock);
+}
+
+// Copy the current table counters into out_stats
+void dir_cache_get_stats(struct dir_cache_stats* out_stats) {
+    pthread_rwlock_rdlock(&table_lock);
+    *out_stats = stats;
+    out_stats->hits = __atomic_load_n(&hits, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&table_lock);
+}
@@ -0,0 +1,177 @@
+/**************************************************************
+* Contains the name index kept for each directory in memory
+**************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/fsDirIndex.h"
+#include "../include/mfs.h"
+
+/*
+ * Looking a name up in a directory compared it with every slot of the directory, and finding
+ * a free slot walked the slots until an unused one showed up. The directory table builds this
+ * index for each directory it loads:
+ *
+ * - An open addressing hash table from the hash of each name to its slot. Lookups compare
+ *   the name only with the slots whose hash matches.
+ * - A stack of the unused slots, so a slot for a new entry is found without walking the
+ *   directory.
+ *
+ * The index isn't stored on the volume. Whoever changes a slot reports it through
+ * write_dir_entry(), which moves the slot in the index (write_dir() rebuilds the whole index).
+ * The stack is cleaned lazily: slots on it that were used meanwhile are dropped when they
+ * reach the top.
+ */
+
+#define BUCKET_EMPTY -1   // Never used, ends a probe sequence
+#define BUCKET_DELETED -2 // Used before, probing continues past it
+
+// FNV-1a hash of a name
+static unsigned int hash_name(const char* name) {
+    unsigned int hash = 2166136261u;
+
+    for (const char* c = name; *c != '\0'; c++) {
+        hash ^= (unsigned char)*c;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static void insert_name(dir_name_index* index, DirectoryEntry* dir, int slot) {
+    unsigned int hash = hash_name(dir[slot].name);
+    int mask = index->bucket_count - 1;
+    int bucket = hash & mask;
+
+    while (index->buckets[bucket] >= 0)
+        bucket = (bucket + 1) & mask;
+
+    if (index->buckets[bucket] == BUCKET_DELETED)
+        index->deleted_buckets--;
+
+    index->buckets[bucket] = slot;
+    index->bucket_hash[bucket] = hash;
+    index->slot_bucket[slot] = bucket;
+}
+
+static void push_free_slot(dir_name_index* index, int slot) {
+    if (index->slot_on_stack[slot])
+        return;
+
+    index->free_slots[index->free_count++] = slot;
+    index->slot_on_stack[slot] = true;
+}
+
+// Index the names and the free slots of a directory of slot_count slots
+int dir_index_build(dir_name_index* index, DirectoryEntry* dir, int slot_count) {
+    dir_index_free(index);
+
+    // Keep the table at most half full, so probe sequences stay short
+    int bucket_count = 16;
+    while (bucket_count < slot_count * 2)
+        bucket_count *= 2;
+
+    index->buckets = malloc(bucket_count * sizeof(int));
+    index->bucket_hash = malloc(bucket_count * sizeof(unsigned int));
+    index->slot_bucket = malloc(slot_count * sizeof(int));
+    index->free_slots = malloc(slot_count * sizeof(int));
+    index->slot_on_stack = calloc(slot_count, sizeof(bool));
+
+    if (index->buckets == NULL || index->bucket_hash == NULL || index->slot_bucket == NULL ||
+        index->free_slots == NULL || index->slot_on_stack == NULL) {
+        fprintf(stderr, "Memory allocation failed for a directory name index.\n");
+        dir_index_free(index);
+        return -1;
+    }
+
+    index->bucket_count = bucket_count;
+    index->deleted_buckets = 0;
+    index->slot_count = slot_count;
+    index->free_count = 0;
+
+    for (int bucket = 0; bucket < bucket_count; bucket++)
+        index->buckets[bucket] = BUCKET_EMPTY;
+
+    for (int slot = 0; slot < slot_count; slot++) {
+        index->slot_bucket[slot] = -1;
+
+        if (strcmp(dir[slot].name, "") != 0)
+            insert_name(index, dir, slot);
+    }
+
+    // Slots 0 and 1 are . and .., push the others from the top so the lowest is used first
+    for (int slot = slot_count - 1; slot >= 2; slot--) {
+        if (index->slot_bucket[slot] == -1)
+            push_free_slot(index, slot);
+    }
+
+    return 0;
+}
+
+// Release the memory used by the index
+void dir_index_free(dir_name_index* index) {
+    free(index->buckets);
+    free(index->bucket_hash);
+    free(index->slot_bucket);
+    free(index->free_slots);
+    free(index->slot_on_stack);
+    memset(index, 0, sizeof(dir_name_index));
+}
+
+// Slot of name in the directory, -1 if no slot has it
+int dir_index_find(dir_name_index* index, DirectoryEntry* dir, const char* name) {
+    unsigned int hash = hash_name(name);
+    int mask = index->bucket_count - 1;
+
+    for (int bucket = hash & mask; index->buckets[bucket] != BUCKET_EMPTY;
+         bucket = (bucket + 1) & mask) {
+        int slot = index->buckets[bucket];
+
+        if (slot >= 0 && index->bucket_hash[bucket] == hash &&
+            strcmp(dir[slot].name, name) == 0)
+            return slot;
+    }
+
+    return -1;
+}
+
+// Move a slot whose entry changed to where its new name belongs
+void dir_index_update(dir_name_index* index, DirectoryEntry* dir, int slot) {
+    if (slot < 0 || slot >= index->slot_count)
+        return;
+
+    // Forget the name the slot had
+    if (index->slot_bucket[slot] != -1) {
+        index->buckets[index->slot_bucket[slot]] = BUCKET_DELETED;
+        index->slot_bucket[slot] = -1;
+        index->deleted_buckets++;
+    }
+
+    if (strcmp(dir[slot].name, "") != 0)
+        insert_name(index, dir, slot);
+    else if (slot >= 2)
+        push_free_slot(index, slot);
+
+    // Too many deleted buckets make every probe longer, start over from the directory
+    if (index->deleted_buckets > index->bucket_count / 4)
+        dir_index_build(index, dir, index->slot_count);
+}
+
+// An unused slot of the directory, -1 if it is full
+// The slot stays free until the caller names it and reports the change
+int dir_index_free_slot(dir_name_index* index, DirectoryEntry* dir) {
+    while (index->free_count > 0) {
+        int slot = index->free_slots[index->free_count - 1];
+
+        if (strcmp(dir[slot].name, "") == 0)
+            return slot;
+
+        // The slot was used since it was pushed
+        index->free_count--;
+        index->slot_on_stack[slot] = false;
+    }
+
+    return -1;
+}
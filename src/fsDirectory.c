@@ -12,23 +12,49 @@
 #include "../include/mfs.h"
 #include "../include/fsHelperFuncs.h"
 #include "../include/fsLow.h"
+#include "../include/fsCache.h"
 #include "../include/fsFreespace.h"
+#include "../include/fsExtent.h"
+#include "../include/fsDirCache.h"
+#include "../include/fsPathCache.h"
+#include "../include/fsJournal.h"
 
-int space_needed; // Space needed for the initial number of DE
-int block_needed; // Block needed for the space needed
-int space_allocated; // Space actually allocated according to the number of blocks needed
-int actual_DE_num; // Actual number of DE that fit in the spaceAlloctaed
-int actual_size_needed;  // Actual size needed after adjusting the number of DE
 size_t size_DE = sizeof(DirectoryEntry); // Size of directory entry
 
-// Calculate the space to allocate, number of DE that fit in that space
-// Calculate number of blocks needed for that space
-void init_space_block_needed(int entries) {
-    space_needed = size_DE * entries;  
-    block_needed = retrieve_num_of_blocks(space_needed, BLOCK_SIZE);   
-    space_allocated = block_needed * BLOCK_SIZE;
-    actual_DE_num = space_allocated / size_DE; 
-    actual_size_needed = actual_DE_num * size_DE;
+/*
+ * Directories are DirectoryEntry arrays in memory. On the volume the entries are stored in
+ * one of two layouts, selected by the format version in the VCB:
+ * - Volumes older than FS_FORMAT_COMPACT_DIRS store the arrays as they are in memory, so an
+ *   entry takes sizeof(DirectoryEntry) bytes and may straddle two blocks
+ * - FS_FORMAT_COMPACT_DIRS volumes store CompactDirectoryEntry records, DE_COMPACT_PER_BLOCK
+ *   in each block and none straddling two blocks. Each block is decoded straight into the
+ *   array when loaded and encoded straight from it when written
+ * In memory the size of a directory is its number of entries times sizeof(DirectoryEntry),
+ * the size of the array. CompactDirectoryEntry records store the size of directories as
+ * their number of entries times sizeof(CompactDirectoryEntry), what they take on the
+ * volume, so the volume doesn't depend on the layout of DirectoryEntry of the build that
+ * wrote it. Entries are converted between the two as blocks are encoded and decoded
+ *
+ * A directory starts with MAX_DIR_ENTRIES entries and grows once all its slots are used:
+ * grow_directory() links more blocks to the end of its chain, doubling it (at most
+ * DIR_GROW_MAX_BLOCKS at a time), up to DIR_ENTRIES_LIMIT entries. Slots keep their index
+ * when it grows. The size in . is the one loads trust, the entry in the parent is updated
+ * too so listing the parent shows it
+ */
+
+#define DIR_GROW_MAX_BLOCKS (MAX_FILE_SIZE / BLOCK_SIZE) // Most blocks one allocation can give
+
+// Whether the directories of the volume use CompactDirectoryEntry
+bool compact_dirs() {
+    return fs_vcb->format_magic == VCB_FORMAT_MAGIC &&
+           fs_vcb->format_version >= FS_FORMAT_COMPACT_DIRS;
+}
+
+// Calculate number of blocks needed for a directory of entries entries, and the number of DE
+// that fit in those blocks
+void init_space_block_needed(int entries, int* block_needed, int* actual_DE_num) {
+    *block_needed = dir_block_count(entries);
+    *actual_DE_num = dir_entries_in_blocks(*block_needed);
 }
 
 // Return the new directory entry
@@ -37,7 +63,10 @@ DirectoryEntry* create_directory(DirectoryEntry* parent, int number_dir_entries)
     bool is_root = false;
     time_t actual_time = time(NULL); // Actual time for the directory creation
 
-    init_space_block_needed(number_dir_entries);
+    int block_needed; // Block needed for the initial number of DE
+    int actual_DE_num; // Actual number of DE that fit in the blocks needed
+    init_space_block_needed(number_dir_entries, &block_needed, &actual_DE_num);
+    int space_allocated = actual_DE_num * size_DE; // Space allocated for those DE
 
     // Allocate array of DirectoryEntries according to the number of blocks needed
     fs_dir = malloc(space_allocated);
@@ -47,9 +76,12 @@ DirectoryEntry* create_directory(DirectoryEntry* parent, int number_dir_entries)
     }
 
     // Get starting location of directory by calling freespace
-    int start_dir = allocate_freespace(block_needed);  
+    // Other directories than root are placed by the allocation groups' free blocks
+    int start_dir = parent == NULL ? allocate_freespace(block_needed) :
+                    allocate_freespace_near(directory_goal_block(parent[0].start_block), block_needed);
     // Set the number of blocks occupied by root dir
-    fs_vcb->root_blocks = block_needed;
+    if (parent == NULL)
+        fs_vcb->root_blocks = block_needed;
 
     // Initialize each entry in the directory to free state
     // initialize the name to empty string to indicate that the DE is not used
@@ -59,12 +91,13 @@ DirectoryEntry* create_directory(DirectoryEntry* parent, int number_dir_entries)
 
     // Initialize dir[0] to "."
     strcpy(fs_dir[0].name, ".");               // Copies the directory name into the entry
-    fs_dir[0].size = actual_size_needed;       // Sets the size of the directory/file
+    fs_dir[0].size = space_allocated;          // Sets the size of the directory/file
     fs_dir[0].start_block = start_dir;         // Sets starting block of the directory/file on disk
     fs_dir[0].is_dir = FILE_TYPE_DIRECTORY;    // Sets whether the entry is a directory
     fs_dir[0].creation_time = actual_time;     // Set creation time to actual time
     fs_dir[0].modification_time = actual_time; // Set modification time to actual time 
     fs_dir[0].access_time = actual_time;       // Set access time to actual time
+    clear_inline_extents(&fs_dir[0]);          // Directories are mapped from the FAT
 
     // Check if the created directory is root or another directory
     if (parent == NULL) { // It is root    
@@ -79,8 +112,16 @@ DirectoryEntry* create_directory(DirectoryEntry* parent, int number_dir_entries)
     fs_dir[1].creation_time = parent[0].creation_time;     
     fs_dir[1].modification_time = parent[0].modification_time;  
     fs_dir[1].access_time = parent[0].access_time;                    
+    clear_inline_extents(&fs_dir[1]);
+
+    // The directory table owns the new directory from now on
+    DirectoryEntry* adopted = dir_cache_adopt(fs_dir, space_allocated);
+    if (adopted == NULL) {
+        free(fs_dir);
+        return NULL;
+    }
+    fs_dir = adopted;
 
-    
     // If is root, assign the directory created to the root to keep it in memory
     if (is_root)
         fs_dir_root = fs_dir;
@@ -91,30 +132,134 @@ DirectoryEntry* create_directory(DirectoryEntry* parent, int number_dir_entries)
     return fs_dir;
 }
 
-// Load root directory to memory
+// Set the size of the entry of dir in its parent after dir changed size
+// dir is locked exclusive by the caller. The size in the parent is only a hint, it isn't
+// updated when someone else holds the parent locked: waiting for it could deadlock with a
+// thread locking down the tree from the parent
+static void update_parent_entry(DirectoryEntry* dir) {
+    // The root is its own parent
+    if (dir[1].start_block == dir[0].start_block) {
+        dir[1].size = dir[0].size;
+
+        // The VCB also holds the free block counters
+        lock_freespace();
+        fs_vcb->root_blocks = dir_block_count(dir[0].size / size_DE);
+
+        if (journal_write(fs_vcb, 1, 0) != 1)
+            fprintf(stderr, "Failed to write the VCB after growing the root directory.\n");
+        unlock_freespace();
+        return;
+    }
+
+    DirectoryEntry* parent = dir_cache_get(dir[1].start_block, dir[1].size);
+    if (parent == NULL)
+        return;
+
+    if (dir_cache_trylock(parent, DIR_LOCK_EXCLUSIVE) != 0) {
+        free_directory(parent);
+        return;
+    }
+
+    int num_DE = parent[0].size / size_DE;
+    for (int i = 2; i < num_DE; i++) {
+        if (parent[i].start_block == dir[0].start_block && is_DE_a_directory(&parent[i])) {
+            parent[i].size = dir[0].size;
+            write_dir_entry(parent, i);
+            path_cache_invalidate(parent[0].start_block);
+            break;
+        }
+    }
+
+    unlock_dir(parent);
+    free_directory(parent);
+}
+
+// Add free slots to a directory whose slots are all used
+// Returns 0 on success, -1 if it is at DIR_ENTRIES_LIMIT or the volume is full
+int grow_directory(DirectoryEntry* dir) {
+    int entry_count = dir[0].size / size_DE;
+    if (entry_count >= DIR_ENTRIES_LIMIT) {
+        fprintf(stderr, "Directory is full, it can't hold more than %d entries.\n",
+                DIR_ENTRIES_LIMIT);
+        return -1;
+    }
+
+    // Double the directory, growing it by at least one block
+    int block_count = dir_block_count(entry_count);
+    int more_blocks = block_count;
+    if (more_blocks > DIR_GROW_MAX_BLOCKS)
+        more_blocks = DIR_GROW_MAX_BLOCKS;
+    while (more_blocks > 1 && dir_entries_in_blocks(block_count + more_blocks - 1) >= DIR_ENTRIES_LIMIT)
+        more_blocks--;
+
+    int new_count = dir_entries_in_blocks(block_count + more_blocks);
+    if (new_count > DIR_ENTRIES_LIMIT)
+        new_count = DIR_ENTRIES_LIMIT;
+
+    // Room for the new slots in memory, before any block is linked
+    if (dir_cache_reserve(dir, new_count) != 0)
+        return -1;
+
+    // The last block of the directory's chain
+    int last_block = dir[0].start_block;
+    while (fs_freespace[last_block] != (unsigned int) last_block)
+        last_block = fs_freespace[last_block];
+
+    // Link the new blocks to the end of the chain, right after it when those blocks are free
+    int new_block = insert_freespace(last_block, -1, last_block, more_blocks);
+
+    if (new_block == -1)
+        return -1;
+
+    // The new slots are unused
+    memset(&dir[entry_count], 0, (new_count - entry_count) * size_DE);
+    dir[0].size = new_count * size_DE;
+
+    if (dir_cache_grow(dir, new_count) != 0)
+        return -1;
+
+    update_parent_entry(dir);
+    return 0;
+}
+
+// Load root directory to memory, fs_dir_root holds it until the volume is closed
 int load_root_directory() {
-    load_dir_helper(fs_dir_root, fs_vcb->location_of_rootdir);
+    int root_entries = dir_entries_in_blocks(fs_vcb->root_blocks);
+
+    fs_dir_root = dir_cache_get(fs_vcb->location_of_rootdir, root_entries * size_DE);
+    if (fs_dir_root == NULL)
+        return -1;
+
     return fs_vcb->root_blocks;
 }
 
 // Load a selected directory to memory
+// The directory is shared with everyone else using it, release it with free_directory()
 DirectoryEntry* load_dir(DirectoryEntry* dir){
-    // Number of blocks to allocate for dir
-    int dir_blocks = retrieve_num_of_blocks(dir->size, BLOCK_SIZE);
-
-    // Malloc memory to load dir
-    DirectoryEntry* loaded_dir = malloc(dir_blocks * BLOCK_SIZE);
+    // The directory table loads it only if it isn't in memory yet
+    return dir_cache_get(dir->start_block, dir->size);
+}
 
-    // Call helper function to load the directory since the freespace may not be contiguous
-    load_dir_helper(loaded_dir, dir->start_block);
+// Lock a directory, DIR_LOCK_SHARED to read its entries or DIR_LOCK_EXCLUSIVE to change them
+// Unlock it with unlock_dir() before releasing it
+void lock_dir(DirectoryEntry* dir, int mode) {
+    dir_cache_lock(dir, mode);
+}
 
-    return loaded_dir;
+void unlock_dir(DirectoryEntry* dir) {
+    dir_cache_unlock(dir);
 }
 
 // Write a directory to drive
+// The directory is written when its user releases it, so several changes are written once
 void write_dir(DirectoryEntry* dir) {
-    // Call helper function to write the directory since the freespace may not be contiguous
-    write_dir_helper(dir);
+    dir_cache_mark_dirty(dir);
+}
+
+// Write one changed entry of a directory to drive
+// Only the blocks holding the changed entries are written when the directory is released
+void write_dir_entry(DirectoryEntry* dir, int index) {
+    dir_cache_mark_entry_dirty(dir, index);
 }
 
 /*
@@ -123,135 +268,235 @@ void write_dir(DirectoryEntry* dir) {
  * contiguous, each block must be located and written individually
  */
 int write_dir_helper(DirectoryEntry* dir) {
+    return write_dir_blocks(dir, NULL);
+}
+
+// Size of an entry as the volume stores it, for a directory the size of its entries on the
+// volume rather than in memory
+size_t dir_stored_size(DirectoryEntry* entry) {
+    if (!compact_dirs() || entry->is_dir != FILE_TYPE_DIRECTORY)
+        return entry->size;
+
+    return entry->size / size_DE * sizeof(CompactDirectoryEntry);
+}
+
+// Copy an entry into its compact form, names past MAX_NAME_SIZE are cut
+static void encode_entry(DirectoryEntry* entry, CompactDirectoryEntry* compact) {
+    strncpy(compact->name, entry->name, MAX_NAME_SIZE);
+    compact->name[MAX_NAME_SIZE] = '\0';
+    compact->is_dir = entry->is_dir;
+    compact->num_extents = 0;
+    compact->reserved = 0;
+    compact->size = dir_stored_size(entry);
+    compact->start_block = entry->start_block;
+    compact->creation_time = entry->creation_time;
+    compact->modification_time = entry->modification_time;
+    compact->access_time = entry->access_time;
+
+    if (entry->extent_magic != DE_EXTENT_MAGIC)
+        return;
+
+    // Keep the runs that fit, the extent map continues along the FAT past the last one
+    for (int i = 0; i < entry->num_extents && i < DE_COMPACT_EXTENTS; i++) {
+        if (entry->extents[i].length > 0xFFFF)
+            break;
+
+        compact->extent_start[i] = entry->extents[i].start_block;
+        compact->extent_length[i] = entry->extents[i].length;
+        compact->num_extents++;
+    }
+}
+
+// Fill in an entry from its compact form
+static void decode_entry(CompactDirectoryEntry* compact, DirectoryEntry* entry) {
+    memset(entry, 0, sizeof(DirectoryEntry));
+    memcpy(entry->name, compact->name, MAX_NAME_SIZE);
+    entry->name[MAX_NAME_SIZE] = '\0';
+    entry->is_dir = compact->is_dir;
+    entry->size = compact->size;
+    if (entry->is_dir == FILE_TYPE_DIRECTORY)
+        entry->size = compact->size / sizeof(CompactDirectoryEntry) * size_DE;
+    entry->start_block = compact->start_block;
+    entry->creation_time = compact->creation_time;
+    entry->modification_time = compact->modification_time;
+    entry->access_time = compact->access_time;
+
+    if (compact->num_extents == 0 || compact->num_extents > DE_COMPACT_EXTENTS)
+        return;
+
+    entry->extent_magic = DE_EXTENT_MAGIC;
+    entry->num_extents = compact->num_extents;
+
+    for (int i = 0; i < compact->num_extents; i++) {
+        entry->extents[i].start_block = compact->extent_start[i];
+        entry->extents[i].length = compact->extent_length[i];
+    }
+}
+
+// Fill buffer with block number block of a directory of entry_count entries
+// Returns the address to write from, which is the array itself when a whole block of an
+// uncompacted directory lies in it
+static char* encode_dir_block(DirectoryEntry* dir, int entry_count, int block, char* buffer) {
+    if (compact_dirs()) {
+        CompactDirectoryEntry* compact = (CompactDirectoryEntry*) buffer;
+        int first_entry = block * DE_COMPACT_PER_BLOCK;
+
+        memset(buffer, 0, BLOCK_SIZE);
+        for (int i = 0; i < (int) DE_COMPACT_PER_BLOCK && first_entry + i < entry_count; i++)
+            encode_entry(&dir[first_entry + i], &compact[i]);
+
+        return buffer;
+    }
+
+    int dir_bytes = entry_count * size_DE;
+    int offset = block * BLOCK_SIZE;
+
+    if (dir_bytes - offset >= BLOCK_SIZE)
+        return (char*) dir + offset;
+
+    // Copy the part of the directory in the last block and clear the rest of the block
+    memcpy(buffer, (char*) dir + offset, dir_bytes - offset);
+    memset(buffer + dir_bytes - offset, 0, BLOCK_SIZE - (dir_bytes - offset));
+    return buffer;
+}
+
+// Copy block number block of a directory of entry_count entries from buffer into the array
+static void decode_dir_block(DirectoryEntry* dir, int entry_count, int block, char* buffer) {
+    if (compact_dirs()) {
+        CompactDirectoryEntry* compact = (CompactDirectoryEntry*) buffer;
+        int first_entry = block * DE_COMPACT_PER_BLOCK;
+
+        for (int i = 0; i < (int) DE_COMPACT_PER_BLOCK && first_entry + i < entry_count; i++)
+            decode_entry(&compact[i], &dir[first_entry + i]);
+        return;
+    }
+
+    int dir_bytes = entry_count * size_DE;
+    int offset = block * BLOCK_SIZE;
+    int bytes_to_copy = dir_bytes - offset < BLOCK_SIZE ? dir_bytes - offset : BLOCK_SIZE;
+
+    memcpy((char*) dir + offset, buffer, bytes_to_copy);
+}
+
+// Read the directory block at volume_block and decode its entries into entries, which holds
+// dir_entries_in_blocks(1) of them. Only directories of compact volumes can be read a block at
+// a time, their entries never straddle two blocks
+// Returns 0 on success, -1 on failure
+int read_dir_block(int volume_block, DirectoryEntry* entries) {
+    char buffer[BLOCK_SIZE];
+
+    if (!compact_dirs())
+        return -1;
+
+    if (cache_read(buffer, 1, volume_block) != 1) {
+        fprintf(stderr, "Failed to read a directory buffer.\n");
+        return -1;
+    }
+
+    CompactDirectoryEntry* compact = (CompactDirectoryEntry*) buffer;
+    for (int i = 0; i < (int) DE_COMPACT_PER_BLOCK; i++)
+        decode_entry(&compact[i], &entries[i]);
+
+    return 0;
+}
+
+/*
+ * Write the blocks of a directory whose flag is set in dirty_blocks, or all of them if it is
+ * NULL
+ */
+int write_dir_blocks(DirectoryEntry* dir, const bool* dirty_blocks) {
     char buffer[BLOCK_SIZE];
-    int number_of_directory_entries = actual_DE_num;
+    int entry_count = dir[0].size / size_DE;
+    int block_count = dir_block_count(entry_count);
     int volume_block = dir->start_block;
-    int dir_index = 0;
-    int dir_offset = 0;
-    int buffer_offset = 0;
-
-    // Set each value in the buffer to 0
-    memset(buffer, 0, BLOCK_SIZE);
-
-    // Iterate through all the directory entries
-    while (dir_index < number_of_directory_entries) {
-        int space_in_buffer = BLOCK_SIZE - buffer_offset;
-        int dir_bytes_remaining = size_DE - dir_offset;
-        int bytes_to_copy = space_in_buffer >= 
-        dir_bytes_remaining ? dir_bytes_remaining : space_in_buffer;
-
-        // Copy a part of or the whole directory to the buffer
-        memcpy(buffer + buffer_offset, ((char*) &dir[dir_index]) + dir_offset, bytes_to_copy);
-
-        // Increment offset for the buffer and the current directory
-        buffer_offset += bytes_to_copy;
-        dir_offset += bytes_to_copy;
-
-        // If the entire directory has been copied
-        if (dir_offset == size_DE) {
-            // Reset the directory entry offset
-            dir_offset = 0;
-            // Iterate the count of the directories
-            dir_index++;
-        }
 
-        // If buffer is full
-        if (buffer_offset == BLOCK_SIZE) {
-            // Write a new block of data to the buffer
-            if (LBAwrite(buffer, 1, volume_block) != 1) {
+    for (int block = 0; block < block_count; block++) {
+        if (dirty_blocks == NULL || dirty_blocks[block]) {
+            char* data = encode_dir_block(dir, entry_count, block, buffer);
+
+            if (journal_write(data, 1, volume_block) != 1) {
                 fprintf(stderr, "Failed to write a directory buffer.\n");
-                free(dir);
                 return -1;
             }
+        }
 
-            // If the FAT entry's value is its own index, this was the last block allocated for
-            // this directory
-            if (fs_freespace[volume_block] == volume_block)
-                break;
+        // If the FAT entry's value is its own index, this was the last block allocated for
+        // this directory
+        if (fs_freespace[volume_block] == volume_block)
+            break;
 
-            // Track the index of the next block in the FAT
-            volume_block = fs_freespace[volume_block];
-            buffer_offset = 0;
-        }
+        // Track the index of the next block in the FAT
+        volume_block = fs_freespace[volume_block];
     }
 
-    // If there's partial data remaining in the buffer
-    if (buffer_offset > 0) {
-        // Clear the part of the buffer that wasn't most recently written to
-        memset(buffer + buffer_offset, 0, BLOCK_SIZE - buffer_offset);
+    return 0;
+}
 
-        // Write the block to the volume
-        if (LBAwrite(buffer, 1, volume_block) != 1) {
-            fprintf(stderr, "Failed to write the last directory buffer.\n");
-            free(dir);
-            return -1;
-        }
+// Number of blocks a directory of entry_count entries occupies on the volume
+int dir_block_count(int entry_count) {
+    if (compact_dirs())
+        return retrieve_num_of_blocks(entry_count, DE_COMPACT_PER_BLOCK);
+
+    return retrieve_num_of_blocks(entry_count * size_DE, BLOCK_SIZE);
+}
+
+// Number of entries that fit in a directory of block_count blocks
+int dir_entries_in_blocks(int block_count) {
+    if (compact_dirs())
+        return block_count * DE_COMPACT_PER_BLOCK;
+
+    return block_count * BLOCK_SIZE / size_DE;
+}
+
+// Range of directory blocks holding the entry at index
+void dir_entry_blocks(int index, int* first_block, int* last_block) {
+    if (compact_dirs()) {
+        *first_block = index / DE_COMPACT_PER_BLOCK;
+        *last_block = *first_block;
+        return;
     }
 
-    return 0;
+    *first_block = (index * size_DE) / BLOCK_SIZE;
+    *last_block = ((index + 1) * size_DE - 1) / BLOCK_SIZE;
 }
 
 /*
- * Helper function to load a directory to memory. Since the directory's data blocks may not be
- * contiguous, each block must be located and loaded individually
+ * Helper function to load a directory of entry_count entries to memory. Since the
+ * directory's data blocks may not be contiguous, each block must be located and loaded
+ * individually
  */
-int load_dir_helper(DirectoryEntry* dir, int start_block) {
-    // If class variables have not been set
-    if (actual_DE_num == 0)
-        // Initialize the directory information
-        init_space_block_needed(MAX_DIR_ENTRIES);
-
+int load_dir_helper(DirectoryEntry* dir, int start_block, int entry_count) {
     char buffer[BLOCK_SIZE];
-    int number_of_directory_entries = actual_DE_num;
+    int block_count = dir_block_count(entry_count);
     int volume_block = start_block;
-    int dir_index = 0;
-    int dir_offset = 0;
-    int buffer_offset = BLOCK_SIZE;
-    bool has_more_blocks = true;
-
-    // Iterate through all the directory entries
-    while (dir_index < number_of_directory_entries) {
-        // If buffer is empty and there are more blocks in the freespace for the directory
-        if (buffer_offset == BLOCK_SIZE && has_more_blocks) {
-            // Load a block from the volume
-            if (LBAread(buffer, 1, volume_block) != 1) {
-                fprintf(stderr, "Failed to read a directory buffer.\n");
-                free(dir);
-                return -1;
-            }
+    int block;
 
-            // If the FAT entry's value is its own index, this was the last block
-            if (fs_freespace[volume_block] == volume_block)
-                has_more_blocks = false;
-            else
-                // Move the volume block index to next block
-                volume_block = fs_freespace[volume_block];
+    for (block = 0; block < block_count; block++) {
+        // Whole blocks of an uncompacted directory are read straight into the array
+        bool in_place = !compact_dirs() && (block + 1) * BLOCK_SIZE <= entry_count * (int) size_DE;
+        char* data = in_place ? (char*) dir + block * BLOCK_SIZE : buffer;
 
-            // Reset buffer offset for new block
-            buffer_offset = 0;
+        // Load a block from the volume
+        if (cache_read(data, 1, volume_block) != 1) {
+            fprintf(stderr, "Failed to read a directory buffer.\n");
+            return -1;
         }
 
-        // Process each directory entry from the buffer
-        int bytes_in_buffer = BLOCK_SIZE - buffer_offset;
-        int dir_bytes_needed = size_DE - dir_offset;
-        int bytes_to_copy = bytes_in_buffer >= 
-        dir_bytes_needed ? dir_bytes_needed : bytes_in_buffer;
-
-        // Copy the directory from the buffer to the directory entry
-        memcpy(((char*) &dir[dir_index]) + dir_offset, buffer + buffer_offset, bytes_to_copy);
-
-        // Increment the buffer and directory entry offsets
-        buffer_offset += bytes_to_copy;
-        dir_offset += bytes_to_copy;
-
-        // Check if the current directory entry is completely loaded
-        if (dir_offset == size_DE) {
-            // Reset the directory entry offset
-            dir_offset = 0;
-            // If the entire directory has been copied, iterate the count of the directories
-            dir_index++;
-        }
+        if (!in_place)
+            decode_dir_block(dir, entry_count, block, data);
+
+        // If the FAT entry's value is its own index, this was the last block
+        if (fs_freespace[volume_block] == volume_block)
+            break;
+
+        // Move the volume block index to next block
+        volume_block = fs_freespace[volume_block];
     }
 
+    // Entries past a chain shorter than the directory are unused
+    int loaded_entries = block < block_count ? dir_entries_in_blocks(block + 1) : entry_count;
+    for (int i = loaded_entries; i < entry_count; i++)
+        memset(&dir[i], 0, size_DE);
+
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,456 @@
+/**************************************************************
+* Contains the functions for the extent map of a file's blocks
+**************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "../include/fsExtent.h"
+#include "../include/mfs.h"
+#include "../include/fsFreespaceHelper.h"
+
+/*
+ * The FAT links a file's blocks one by one, so finding block N of a file means following N
+ * links. The extent map describes the same chain as runs of consecutive volume blocks:
+ *
+ *   logical 0..19  -> volume 120..139
+ *   logical 20..24 -> volume 400..404
+ *
+ * Sequential access stays in the run of the previous lookup or moves to the next one. The first
+ * lookup that lands anywhere else builds block_extent, an array with the run of every file
+ * block, so random access (seeks to arbitrary offsets) finds its run with a single array
+ * access. Runs appended later, as the file grows, are added to the array as they are mapped.
+ * A whole run can be transferred with a single LBA call.
+ *
+ * The first DE_INLINE_EXTENTS runs are stored in the file's directory entry when it is closed,
+ * so opening a file doesn't have to walk the FAT. Entries written by older versions don't carry
+ * DE_EXTENT_MAGIC; for those the map is built from the FAT chain instead.
+ * The runs stored in the directory entry are only a prefix of the file when it has more runs
+ * than fit. Lookups past the end of the map continue along the FAT from the last mapped block,
+ * which also picks up blocks linked to the chain after the map was built.
+ *
+ * Sparse files: a run whose start_block is FILE_NO_BLOCKS is a hole, file blocks without volume
+ * blocks that read as zeros. The FAT chain holds the blocks of the other runs in file order, so
+ * filling a hole links its new blocks between the blocks around it, and punching one unlinks
+ * them. Past the last run the file is a hole up to its size. The FAT can't describe holes, only
+ * the runs stored in the directory entry can: holes must be among the runs the entry keeps
+ * (extent_map_unstored_hole() finds those that aren't).
+ */
+
+#define IS_HOLE(extent) ((extent)->start_block == FILE_NO_BLOCKS)
+
+// Record the run of file blocks first_block up to total_blocks in block_extent
+static int index_blocks(extent_map* map, int first_block, int extent) {
+    if (map->total_blocks > map->block_capacity) {
+        int new_capacity = map->block_capacity * 2;
+        if (new_capacity < map->total_blocks)
+            new_capacity = map->total_blocks;
+
+        int* new_block_extent = realloc(map->block_extent, new_capacity * sizeof(int));
+
+        // Without memory lookups fall back to the binary search
+        if (new_block_extent == NULL) {
+            free(map->block_extent);
+            map->block_extent = NULL;
+            map->block_capacity = 0;
+            return -1;
+        }
+
+        map->block_extent = new_block_extent;
+        map->block_capacity = new_capacity;
+    }
+
+    for (int block = first_block; block < map->total_blocks; block++)
+        map->block_extent[block] = extent;
+
+    return 0;
+}
+
+// Add a run of volume blocks after the last file block of the map
+static int append_run(extent_map* map, int start_block, int length) {
+    int first_block = map->total_blocks;
+
+    // Merge with the last run if the new one continues it on the volume, or both are holes
+    if (map->count > 0) {
+        file_extent* last = &map->extents[map->count - 1];
+
+        if (IS_HOLE(last) ? start_block == FILE_NO_BLOCKS :
+            start_block != FILE_NO_BLOCKS && last->start_block + last->length == start_block) {
+            last->length += length;
+            map->total_blocks += length;
+
+            if (map->block_extent != NULL)
+                index_blocks(map, first_block, map->count - 1);
+            return 0;
+        }
+    }
+
+    if (map->count == map->capacity) {
+        int new_capacity = map->capacity == 0 ? DE_INLINE_EXTENTS + 1 : map->capacity * 2;
+        file_extent* new_extents = realloc(map->extents, new_capacity * sizeof(file_extent));
+
+        if (new_extents == NULL) {
+            fprintf(stderr, "Memory allocation failed for the extent map.\n");
+            return -1;
+        }
+
+        map->extents = new_extents;
+        map->capacity = new_capacity;
+    }
+
+    map->extents[map->count].logical_block = map->total_blocks;
+    map->extents[map->count].start_block = start_block;
+    map->extents[map->count].length = length;
+    map->count++;
+    map->total_blocks += length;
+
+    if (map->block_extent != NULL)
+        index_blocks(map, first_block, map->count - 1);
+
+    return 0;
+}
+
+// Build block_extent for the blocks mapped so far
+static void build_block_index(extent_map* map) {
+    map->block_extent = malloc(map->total_blocks * sizeof(int));
+    if (map->block_extent == NULL)
+        return;
+
+    map->block_capacity = map->total_blocks;
+
+    for (int extent = 0; extent < map->count; extent++) {
+        file_extent* run = &map->extents[extent];
+
+        for (int block = run->logical_block; block < run->logical_block + run->length; block++)
+            map->block_extent[block] = extent;
+    }
+}
+
+// Find the run holding logical_block, which must be mapped
+static int find_extent(extent_map* map, int logical_block) {
+    file_extent* extents = map->extents;
+    int cursor = map->last_extent;
+
+    // Sequential access: the run of the previous lookup or the one after it
+    if (cursor < map->count && extents[cursor].logical_block <= logical_block) {
+        if (logical_block < extents[cursor].logical_block + extents[cursor].length)
+            return cursor;
+
+        if (cursor + 1 < map->count &&
+            logical_block < extents[cursor + 1].logical_block + extents[cursor + 1].length)
+            return cursor + 1;
+    }
+
+    // Random access: a single array access once block_extent is built
+    if (map->block_extent == NULL)
+        build_block_index(map);
+
+    if (map->block_extent != NULL)
+        return map->block_extent[logical_block];
+
+    // Binary search for the last run starting at or before logical_block
+    int low = 0;
+    int high = map->count - 1;
+
+    while (low < high) {
+        int middle = (low + high + 1) / 2;
+
+        if (extents[middle].logical_block <= logical_block)
+            low = middle;
+        else
+            high = middle - 1;
+    }
+
+    return low;
+}
+
+// Follow the FAT from the last mapped block to map more runs, stopping once logical_block is
+// mapped or the chain ends. Returns 0 if logical_block is mapped
+static int extend_from_FAT(extent_map* map, int logical_block) {
+    int block;
+
+    if (map->count == 0)
+        return -1;
+
+    while (map->total_blocks <= logical_block) {
+        int last_block = extent_map_last_block(map);
+
+        // The chain ends at the last mapped block
+        if (last_block == -1 || fs_freespace[last_block] == last_block ||
+            fs_freespace[last_block] == 0)
+            return -1;
+
+        block = fs_freespace[last_block];
+
+        if (append_run(map, block, get_contiguous_run(block, INT_MAX)) != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+// Build the map of a file from its directory entry, or from the FAT for older entries
+int extent_map_init(extent_map* map, DirectoryEntry* entry) {
+    map->extents = NULL;
+    map->count = 0;
+    map->capacity = 0;
+    map->total_blocks = 0;
+    map->last_extent = 0;
+    map->block_extent = NULL;
+    map->block_capacity = 0;
+
+    // A file that was never written has no runs
+    if (entry->start_block == FILE_NO_BLOCKS)
+        return 0;
+
+    // The first run that isn't a hole starts the chain
+    int first_run = 0;
+    while (first_run < entry->num_extents && first_run < DE_INLINE_EXTENTS &&
+           entry->extents[first_run].start_block == FILE_NO_BLOCKS)
+        first_run++;
+
+    // Use the runs stored in the directory entry when they belong to this chain
+    if (entry->extent_magic == DE_EXTENT_MAGIC && entry->num_extents > 0 &&
+        entry->num_extents <= DE_INLINE_EXTENTS && first_run < entry->num_extents &&
+        entry->extents[first_run].start_block == entry->start_block) {
+        for (int i = 0; i < entry->num_extents; i++) {
+            if (append_run(map, entry->extents[i].start_block, entry->extents[i].length) != 0)
+                return -1;
+        }
+
+        return 0;
+    }
+
+    // Compatibility path, map the first run from the FAT; the rest is mapped on demand
+    return append_run(map, entry->start_block, get_contiguous_run(entry->start_block, INT_MAX));
+}
+
+// Release the memory used by the map
+void extent_map_free(extent_map* map) {
+    free(map->extents);
+    map->extents = NULL;
+    map->count = 0;
+    map->capacity = 0;
+    map->total_blocks = 0;
+    map->last_extent = 0;
+    free(map->block_extent);
+    map->block_extent = NULL;
+    map->block_capacity = 0;
+}
+
+// Find the volume block holding logical_block of the file, -1 if it is in a hole or past the
+// end of the chain
+// If run_length isn't NULL, it is set to the number of blocks that follow consecutively on
+// the volume, starting with the one returned. For -1 it is the number of blocks left in the
+// hole, which has no end past the chain
+int extent_map_lookup(extent_map* map, int logical_block, int* run_length) {
+    if (run_length != NULL)
+        *run_length = INT_MAX - logical_block;
+
+    if (logical_block < 0)
+        return -1;
+
+    if (logical_block >= map->total_blocks && extend_from_FAT(map, logical_block) != 0)
+        return -1;
+
+    map->last_extent = find_extent(map, logical_block);
+
+    file_extent* extent = &map->extents[map->last_extent];
+    int offset = logical_block - extent->logical_block;
+
+    if (run_length != NULL)
+        *run_length = extent->length - offset;
+
+    if (IS_HOLE(extent))
+        return -1;
+
+    return extent->start_block + offset;
+}
+
+// Volume block holding the last mapped file block that isn't in a hole, -1 if there is none
+int extent_map_last_block(extent_map* map) {
+    for (int extent = map->count - 1; extent >= 0; extent--) {
+        file_extent* last = &map->extents[extent];
+
+        if (!IS_HOLE(last))
+            return last->start_block + last->length - 1;
+    }
+
+    return -1;
+}
+
+// Volume block holding the last block before logical_block that isn't in a hole, -1 if
+// there is none. The map must be complete
+int extent_map_prev_block(extent_map* map, int logical_block) {
+    for (int extent = map->count - 1; extent >= 0; extent--) {
+        file_extent* run = &map->extents[extent];
+
+        if (IS_HOLE(run) || run->logical_block >= logical_block)
+            continue;
+
+        int length = logical_block - run->logical_block;
+        if (length > run->length)
+            length = run->length;
+
+        return run->start_block + length - 1;
+    }
+
+    return -1;
+}
+
+// Volume block holding the first block at or after logical_block that isn't in a hole, -1 if
+// there is none. The map must be complete
+int extent_map_next_block(extent_map* map, int logical_block) {
+    for (int extent = 0; extent < map->count; extent++) {
+        file_extent* run = &map->extents[extent];
+
+        if (IS_HOLE(run) || run->logical_block + run->length <= logical_block)
+            continue;
+
+        int offset = logical_block - run->logical_block;
+        return run->start_block + (offset > 0 ? offset : 0);
+    }
+
+    return -1;
+}
+
+// Replace the runs of the map with those of new_map, dropping the holes it ends with
+static void replace_runs(extent_map* map, extent_map* new_map) {
+    while (new_map->count > 0 && IS_HOLE(&new_map->extents[new_map->count - 1])) {
+        new_map->total_blocks -= new_map->extents[new_map->count - 1].length;
+        new_map->count--;
+    }
+
+    extent_map_free(map);
+    *map = *new_map;
+}
+
+// Record that the file blocks from logical_block on, length of them, are held by the volume
+// blocks from start_block on. The blocks must be in a hole or past the end of the map, and
+// the map must be complete
+int extent_map_insert(extent_map* map, int logical_block, int start_block, int length) {
+    extent_map new_map = { 0 };
+    int end_block = logical_block + length;
+    int result = 0;
+
+    for (int extent = 0; extent < map->count && result == 0; extent++) {
+        file_extent* run = &map->extents[extent];
+        int run_end = run->logical_block + run->length;
+
+        // Copy the runs the blocks aren't part of
+        if (!IS_HOLE(run) || run_end <= logical_block || run->logical_block >= end_block) {
+            result = append_run(&new_map, run->start_block, run->length);
+            continue;
+        }
+
+        // Split the hole around the blocks
+        if (run->logical_block < logical_block)
+            result |= append_run(&new_map, FILE_NO_BLOCKS, logical_block - run->logical_block);
+        result |= append_run(&new_map, start_block, length);
+        if (end_block < run_end)
+            result |= append_run(&new_map, FILE_NO_BLOCKS, run_end - end_block);
+    }
+
+    // Past the end of the map, with a hole up to the blocks
+    if (result == 0 && logical_block >= map->total_blocks) {
+        if (logical_block > map->total_blocks)
+            result |= append_run(&new_map, FILE_NO_BLOCKS, logical_block - map->total_blocks);
+        result |= append_run(&new_map, start_block, length);
+    }
+
+    if (result != 0) {
+        extent_map_free(&new_map);
+        return -1;
+    }
+
+    replace_runs(map, &new_map);
+    return 0;
+}
+
+// Turn the file blocks from logical_block on, length of them, into a hole
+// The map must be complete, a hole at its end leaves the map
+int extent_map_punch(extent_map* map, int logical_block, int length) {
+    extent_map new_map = { 0 };
+    int end_block = logical_block + length;
+    int result = 0;
+
+    for (int extent = 0; extent < map->count && result == 0; extent++) {
+        file_extent* run = &map->extents[extent];
+        int run_end = run->logical_block + run->length;
+
+        if (IS_HOLE(run) || run_end <= logical_block || run->logical_block >= end_block) {
+            result = append_run(&new_map, run->start_block, run->length);
+            continue;
+        }
+
+        // Keep the parts of the run outside the blocks
+        int hole_start = run->logical_block > logical_block ? run->logical_block : logical_block;
+        int hole_end = run_end < end_block ? run_end : end_block;
+
+        if (run->logical_block < hole_start)
+            result |= append_run(&new_map, run->start_block, hole_start - run->logical_block);
+        result |= append_run(&new_map, FILE_NO_BLOCKS, hole_end - hole_start);
+        if (hole_end < run_end)
+            result |= append_run(&new_map, run->start_block + (hole_end - run->logical_block),
+                                 run_end - hole_end);
+    }
+
+    if (result != 0) {
+        extent_map_free(&new_map);
+        return -1;
+    }
+
+    replace_runs(map, &new_map);
+    return 0;
+}
+
+// Number of runs the directory entry keeps for the next open, on this volume
+static int stored_extent_count() {
+    if (fs_vcb != NULL && fs_vcb->format_version >= FS_FORMAT_COMPACT_DIRS)
+        return DE_COMPACT_EXTENTS;
+    return DE_INLINE_EXTENTS;
+}
+
+// First file block of a hole the directory entry has no room for, -1 if all holes fit
+// If length isn't NULL, it is set to the number of blocks in that hole
+int extent_map_unstored_hole(extent_map* map, int* length) {
+    for (int extent = stored_extent_count(); extent < map->count; extent++) {
+        if (IS_HOLE(&map->extents[extent])) {
+            if (length != NULL)
+                *length = map->extents[extent].length;
+            return map->extents[extent].logical_block;
+        }
+    }
+
+    return -1;
+}
+
+// Map the whole chain, up to the block that ends it in the FAT
+int extent_map_complete(extent_map* map) {
+    extend_from_FAT(map, INT_MAX - 1);
+    return map->total_blocks;
+}
+
+// Store the first runs of the map in the directory entry
+void extent_map_store(extent_map* map, DirectoryEntry* entry) {
+    int count = map->count < DE_INLINE_EXTENTS ? map->count : DE_INLINE_EXTENTS;
+
+    entry->extent_magic = DE_EXTENT_MAGIC;
+    entry->num_extents = count;
+    entry->extent_reserved = 0;
+
+    for (int i = 0; i < count; i++) {
+        entry->extents[i].start_block = map->extents[i].start_block;
+        entry->extents[i].length = map->extents[i].length;
+    }
+}
+
+// Mark a directory entry as not carrying extents, so its chain is read from the FAT
+void clear_inline_extents(DirectoryEntry* entry) {
+    entry->extent_magic = 0;
+    entry->num_extents = 0;
+    entry->extent_reserved = 0;
+    memset(entry->extents, 0, sizeof(entry->extents));
+}
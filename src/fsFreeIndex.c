@@ -0,0 +1,437 @@
+/**************************************************************
+* Contains the free space index kept next to the FAT
+**************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "../include/fsFreeIndex.h"
+#include "../include/mfs.h"
+
+/*
+ * The FAT answers "which block comes next in this file", but finding free space in it means
+ * walking it one entry at a time. The free space index answers the allocator's questions
+ * without walking the FAT:
+ *
+ * - A bitmap with one bit per block (1 = free), scanned a 64-bit word at a time with ctz
+ * - A summary bitmap with one bit per bitmap word (1 = the word has a free block), so the
+ *   first free block is found by skipping 4096 blocks per summary word
+ * - Extent buckets: the start blocks of free runs, grouped by the power of 2 of their length,
+ *   so a run of N blocks is found by looking in the bucket of N and above
+ *
+ * The buckets are maintained lazily: entries are added whenever a run is created (blocks
+ * freed, or the remainder of a run that was partly allocated) and are checked against the
+ * bitmap when they are looked at. Entries that no longer start a free run are dropped at that
+ * point, and entries whose run changed size are moved to the right bucket. When too many
+ * stale entries pile up the buckets are rebuilt from the bitmap.
+ *
+ * The volume is also split into allocation groups of FREE_GROUP_BLOCKS blocks, each with its
+ * own count of free blocks. Allocations that have a goal (the block before the new ones in a
+ * chain, or the directory a file is created in) look for a run in the goal's group first, so
+ * a file's blocks stay close to each other and to its directory. The counts let new
+ * directories be placed in groups with room for their files.
+ *
+ * The index is rebuilt from the FAT each time the freespace is loaded, so it is never stored
+ * on the volume.
+ */
+
+#define BITS_PER_WORD 64
+
+typedef struct {
+    int* starts;   // Start blocks of free runs in this size class
+    int count;     // Number of entries in use
+    int capacity;  // Number of entries allocated
+} extent_bucket;
+
+static uint64_t* free_bits;     // One bit per block, set when the block is free
+static uint64_t* summary_bits;  // One bit per free_bits word, set when the word has a free block
+static int number_of_words;     // Number of words in free_bits
+static int number_of_summary_words;
+static int index_blocks;        // Number of blocks tracked
+static int free_count;          // Number of free blocks
+static int* group_free;         // Number of free blocks in each allocation group
+static int number_of_groups;
+static int bucket_entries;      // Total entries in all buckets, including stale ones
+static int rebuild_threshold;   // Rebuild the buckets once bucket_entries passes this
+static extent_bucket buckets[FREE_INDEX_BUCKETS];
+
+static int is_free(int block) {
+    return (free_bits[block / BITS_PER_WORD] >> (block % BITS_PER_WORD)) & 1;
+}
+
+// Size class of a run: floor(log2(length))
+static int bucket_of(int length) {
+    int bucket = 63 - __builtin_clzll((uint64_t)length);
+    return bucket < FREE_INDEX_BUCKETS ? bucket : FREE_INDEX_BUCKETS - 1;
+}
+
+// Count the free blocks starting at block, stopping once limit is reached
+static int count_free_from(int block, int limit) {
+    int length = 0;
+
+    while (block < index_blocks && length < limit) {
+        int bit = block % BITS_PER_WORD;
+        uint64_t word = free_bits[block / BITS_PER_WORD] >> bit;
+        int span = BITS_PER_WORD - bit;
+
+        // Number of consecutive free blocks at the bottom of the shifted word
+        int ones = (~word == 0) ? BITS_PER_WORD : __builtin_ctzll(~word);
+        if (ones > span)
+            ones = span;
+
+        length += ones;
+        block += ones;
+
+        // The run ended inside this word
+        if (ones < span)
+            break;
+    }
+
+    return length < limit ? length : limit;
+}
+
+// Find the first block of the free run that contains block
+static int find_run_start(int block) {
+    while (1) {
+        int bit = block % BITS_PER_WORD;
+        uint64_t below_mask = (bit == 0) ? 0 : ((1ULL << bit) - 1);
+        uint64_t used_below = ~free_bits[block / BITS_PER_WORD] & below_mask;
+
+        // The run starts right after the highest used block below it in this word
+        if (used_below != 0)
+            return block - bit + (BITS_PER_WORD - __builtin_clzll(used_below));
+
+        // Everything from the start of the word is free, continue in the previous word
+        block -= bit;
+        if (block == 0 || !is_free(block - 1))
+            return block;
+        block--;
+    }
+}
+
+// Length of the free run starting at block, 0 if block doesn't start a free run
+static int extent_length(int block) {
+    if (block < 0 || block >= index_blocks || !is_free(block))
+        return 0;
+
+    if (block > 0 && is_free(block - 1))
+        return 0;
+
+    return count_free_from(block, index_blocks);
+}
+
+static void bucket_push(int bucket, int start_block) {
+    extent_bucket* b = &buckets[bucket];
+
+    if (b->count == b->capacity) {
+        int new_capacity = b->capacity == 0 ? 16 : b->capacity * 2;
+        int* new_starts = realloc(b->starts, new_capacity * sizeof(int));
+
+        // Without memory the entry is simply not recorded, the index stays correct but the
+        // run can only be found by a first fit search until the next rebuild
+        if (new_starts == NULL)
+            return;
+
+        b->starts = new_starts;
+        b->capacity = new_capacity;
+    }
+
+    b->starts[b->count++] = start_block;
+    bucket_entries++;
+}
+
+// Remove an entry by moving the last entry of the bucket into its place
+static void bucket_remove(int bucket, int position) {
+    extent_bucket* b = &buckets[bucket];
+
+    b->starts[position] = b->starts[--b->count];
+    bucket_entries--;
+}
+
+// Record every free run of the bitmap in the buckets
+static void rebuild_buckets() {
+    for (int i = 0; i < FREE_INDEX_BUCKETS; i++)
+        buckets[i].count = 0;
+    bucket_entries = 0;
+
+    int block = free_index_first_free(0);
+    while (block != -1) {
+        int length = count_free_from(block, index_blocks);
+        bucket_push(bucket_of(length), block);
+        block = free_index_first_free(block + length);
+    }
+
+    // Allow the stale entries to grow to as many again before the next rebuild
+    rebuild_threshold = bucket_entries * 2 + 256;
+}
+
+// Build the index from the FAT
+int free_index_build(int number_of_blocks) {
+    free_index_release();
+
+    index_blocks = number_of_blocks;
+    number_of_words = (number_of_blocks + BITS_PER_WORD - 1) / BITS_PER_WORD;
+    number_of_summary_words = (number_of_words + BITS_PER_WORD - 1) / BITS_PER_WORD;
+
+    number_of_groups = (number_of_blocks + FREE_GROUP_BLOCKS - 1) / FREE_GROUP_BLOCKS;
+
+    free_bits = calloc(number_of_words, sizeof(uint64_t));
+    summary_bits = calloc(number_of_summary_words, sizeof(uint64_t));
+    group_free = calloc(number_of_groups, sizeof(int));
+
+    if (free_bits == NULL || summary_bits == NULL || group_free == NULL) {
+        fprintf(stderr, "Memory allocation failed for the free space index.\n");
+        free_index_release();
+        return -1;
+    }
+
+    free_count = 0;
+
+    // A FAT entry of 0 means the block is free
+    for (int block = 0; block < number_of_blocks; block++) {
+        if (fs_freespace[block] == 0) {
+            free_bits[block / BITS_PER_WORD] |= 1ULL << (block % BITS_PER_WORD);
+            free_count++;
+            group_free[block / FREE_GROUP_BLOCKS]++;
+        }
+    }
+
+    for (int word = 0; word < number_of_words; word++) {
+        if (free_bits[word] != 0)
+            summary_bits[word / BITS_PER_WORD] |= 1ULL << (word % BITS_PER_WORD);
+    }
+
+    rebuild_buckets();
+
+    return 0;
+}
+
+// Release the memory used by the index
+void free_index_release() {
+    free(free_bits);
+    free(summary_bits);
+    free(group_free);
+    free_bits = NULL;
+    summary_bits = NULL;
+    group_free = NULL;
+    number_of_groups = 0;
+
+    for (int i = 0; i < FREE_INDEX_BUCKETS; i++) {
+        free(buckets[i].starts);
+        buckets[i].starts = NULL;
+        buckets[i].count = 0;
+        buckets[i].capacity = 0;
+    }
+
+    bucket_entries = 0;
+    free_count = 0;
+}
+
+// Record that a block was allocated
+void free_index_mark_used(int block) {
+    int word = block / BITS_PER_WORD;
+
+    if (!is_free(block))
+        return;
+
+    free_bits[word] &= ~(1ULL << (block % BITS_PER_WORD));
+    free_count--;
+    group_free[block / FREE_GROUP_BLOCKS]--;
+
+    // The word has no free block left
+    if (free_bits[word] == 0)
+        summary_bits[word / BITS_PER_WORD] &= ~(1ULL << (word % BITS_PER_WORD));
+}
+
+// Record that a block was released
+void free_index_mark_free(int block) {
+    int word = block / BITS_PER_WORD;
+
+    if (is_free(block))
+        return;
+
+    free_bits[word] |= 1ULL << (block % BITS_PER_WORD);
+    summary_bits[word / BITS_PER_WORD] |= 1ULL << (word % BITS_PER_WORD);
+    free_count++;
+    group_free[block / FREE_GROUP_BLOCKS]++;
+}
+
+// Record the free run that contains block
+// Call after a group of blocks has been released, or with the block following a group of
+// allocated blocks, since what remains of the run it was taken from is a new run
+void free_index_add_extent(int block) {
+    if (block < 0 || block >= index_blocks || !is_free(block))
+        return;
+
+    int start_block = find_run_start(block);
+    bucket_push(bucket_of(count_free_from(start_block, index_blocks)), start_block);
+
+    if (bucket_entries > rebuild_threshold)
+        rebuild_buckets();
+}
+
+// Find the lowest free block at or after from_block, -1 if there is none
+int free_index_first_free(int from_block) {
+    if (from_block < 0)
+        from_block = 0;
+    if (from_block >= index_blocks)
+        return -1;
+
+    // Look in the rest of the word holding from_block
+    int word = from_block / BITS_PER_WORD;
+    uint64_t bits = free_bits[word] & (~0ULL << (from_block % BITS_PER_WORD));
+    if (bits != 0)
+        return word * BITS_PER_WORD + __builtin_ctzll(bits);
+
+    // Use the summary to find the next word with a free block
+    word++;
+    if (word >= number_of_words)
+        return -1;
+
+    int summary_word = word / BITS_PER_WORD;
+    uint64_t summary = summary_bits[summary_word] & (~0ULL << (word % BITS_PER_WORD));
+
+    while (summary == 0) {
+        summary_word++;
+        if (summary_word >= number_of_summary_words)
+            return -1;
+        summary = summary_bits[summary_word];
+    }
+
+    word = summary_word * BITS_PER_WORD + __builtin_ctzll(summary);
+    return word * BITS_PER_WORD + __builtin_ctzll(free_bits[word]);
+}
+
+// Number of free blocks, up to max_blocks, starting at start_block
+int free_index_run_length(int start_block, int max_blocks) {
+    if (start_block < 0 || start_block >= index_blocks)
+        return 0;
+
+    return count_free_from(start_block, max_blocks);
+}
+
+// Find a run of at least block_count free blocks, returns its start block or -1
+int free_index_find_run(int block_count, int policy) {
+    if (block_count < 1 || block_count > free_count)
+        return -1;
+
+    // First fit: walk the free runs from the start of the volume
+    if (policy == FREE_FIT_FIRST) {
+        int block = free_index_first_free(0);
+
+        while (block != -1) {
+            int length = count_free_from(block, block_count);
+            if (length >= block_count)
+                return block;
+            block = free_index_first_free(block + length);
+        }
+
+        return -1;
+    }
+
+    // Best fit: every run in the bucket of block_count and above may be long enough
+    for (int bucket = bucket_of(block_count); bucket < FREE_INDEX_BUCKETS; bucket++) {
+        extent_bucket* b = &buckets[bucket];
+        int best_block = -1;
+        int best_length = 0;
+
+        for (int i = 0; i < b->count; i++) {
+            int start_block = b->starts[i];
+            int length = extent_length(start_block);
+
+            // Drop entries that no longer start a free run
+            if (length == 0) {
+                bucket_remove(bucket, i--);
+                continue;
+            }
+
+            // Move entries whose run changed size to the right bucket
+            if (bucket_of(length) != bucket) {
+                bucket_remove(bucket, i--);
+                bucket_push(bucket_of(length), start_block);
+                continue;
+            }
+
+            if (length >= block_count && (best_block == -1 || length < best_length)) {
+                best_block = start_block;
+                best_length = length;
+
+                if (length == block_count)
+                    break;
+            }
+        }
+
+        if (best_block != -1)
+            return best_block;
+    }
+
+    return -1;
+}
+
+// Number of free blocks on the volume
+int free_index_free_count() {
+    return free_count;
+}
+
+// First run of at least block_count free blocks starting from from_block up to before to_block
+static int first_run_between(int from_block, int to_block, int block_count) {
+    int block = free_index_first_free(from_block);
+
+    while (block != -1 && block < to_block) {
+        int length = count_free_from(block, block_count);
+        if (length >= block_count)
+            return block;
+        block = free_index_first_free(block + length);
+    }
+
+    return -1;
+}
+
+// Find a run of at least block_count free blocks in the allocation group of goal_block: the
+// first one at or after goal_block, or else the first one before it. Returns -1 if the group
+// has none, the caller then looks in the rest of the volume
+int free_index_find_run_near(int goal_block, int block_count) {
+    if (goal_block < 0 || goal_block >= index_blocks || block_count < 1)
+        return -1;
+
+    int group = goal_block / FREE_GROUP_BLOCKS;
+    if (group_free[group] == 0)
+        return -1;
+
+    int group_start = group * FREE_GROUP_BLOCKS;
+    int group_end = group_start + FREE_GROUP_BLOCKS < index_blocks ?
+                    group_start + FREE_GROUP_BLOCKS : index_blocks;
+
+    int block = first_run_between(goal_block, group_end, block_count);
+    if (block == -1)
+        block = first_run_between(group_start, goal_block, block_count);
+
+    return block;
+}
+
+// Number of allocation groups on the volume
+int free_index_group_count() {
+    return number_of_groups;
+}
+
+// Number of free blocks in an allocation group
+int free_index_group_free(int group) {
+    if (group < 0 || group >= number_of_groups)
+        return 0;
+
+    return group_free[group];
+}
+
+// The allocation group with the most free blocks, the lowest one on ties
+int free_index_emptiest_group() {
+    int emptiest = 0;
+
+    for (int group = 1; group < number_of_groups; group++) {
+        if (group_free[group] > group_free[emptiest])
+            emptiest = group;
+    }
+
+    return emptiest;
+}
@@ -5,12 +5,18 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
 
 #include "../include/fsFreespace.h"
 #include "../include/mfs.h"
 #include "../include/fsLow.h"
+#include "../include/fsCache.h"
 #include "../include/fsHelperFuncs.h"
 #include "../include/fsFreespaceHelper.h"
+#include "../include/fsFreeIndex.h"
+#include "../include/fsJournal.h"
+#include "../include/fsAllocCache.h"
 
 #define C_TITLE   "\x1b[35m"
 #define C_VALUE   "\x1b[36m"
@@ -34,29 +40,104 @@
  * [5]: 5
  *
  * Assuming a maximum volume size of 10,000,000 bytes and a block size of 512 bytes = 19,531 blocks
- * fs_freespace can track up to 65,535 blocks (the maximum value of an unsigned short (2 bytes))
- * If the maximum volume size becomes greater or the block size becomes smaller, the
- * data type used to initialize fs_freespace may need to be changed to an unsigned int (4 bytes)
+ * In memory every FAT entry is an unsigned int (4 bytes). On the volume the size of an entry
+ * depends on the format version stored in the VCB:
+ * - FS_FORMAT_FAT32 and later: 4 bytes, the FAT blocks are read and written as they are in memory
+ * - FS_FORMAT_FAT16: 2 bytes, the layout of volumes created before the VCB had a format version.
+ *   These can track up to 65,535 blocks (the maximum value of an unsigned short), the entries
+ *   are widened when the FAT is loaded and narrowed again when FAT blocks are written
+ * New volumes are always created with FS_FORMAT_CURRENT
  *
  * Convert hex to decimal to read hexdump values
  *
  * Memory for the freespace is allocated each time initialize_freespace() is called
  * If the file system has previously been initialized, freespace is loaded from the volume
  * Otherwise the freespace is initialized
+ *
+ * Every change to a FAT entry goes through set_FAT_entry(), which marks the FAT block holding
+ * that entry as dirty. flush_freespace() then writes only the dirty FAT blocks, one call per
+ * run of neighbouring dirty blocks, so the cost of a FAT update depends on how many entries
+ * changed and not on the size of the volume.
+ * In FAT_FLUSH_DEFERRED mode allocate_freespace() and clear_freespace() leave the dirty blocks
+ * in memory, so several operations share a single flush_freespace() call. The mode belongs to
+ * the thread that set it, the operations of other threads keep flushing their changes
+ *
+ * Free blocks are located through the free space index (fsFreeIndex.c), which is rebuilt from
+ * the FAT when it is loaded and kept in sync by allocate_freespace() and clear_freespace()
+ *
+ * Allocations with a goal (insert_freespace(), allocate_freespace_near()) look for free blocks
+ * in the goal's allocation group before the rest of the volume. Files are allocated near their
+ * directory and their previous blocks, directories are placed by directory_goal_block()
+ *
+ * Files written with delayed allocation (b_io.c) only reserve blocks while their data sits in
+ * a buffer: reserve_freespace() counts the blocks as taken without choosing them. The blocks
+ * are picked by insert_freespace() when the data is written out, next to the blocks around
+ * them in the file's chain when they are free. Reserved blocks are only held in memory, so an unclean
+ * shutdown can't leak them
+ *
+ * Freed blocks the journal logged since its last checkpoint (fsJournal.c) are held by the
+ * journal instead of being returned: they are free in the FAT but stay used in the free space
+ * index until the journal gives them back
+ *
+ * The free space index and the free block counters of the VCB are guarded by one lock, taken
+ * by every function of this file that changes them (the lock is recursive, they call each
+ * other). A caller may read the FAT entries of a chain it owns without the lock, nobody else
+ * changes them
+ *
+ * Each thread first allocates from and frees to its own allocation cache (fsAllocCache.c),
+ * a few runs of blocks taken out of the free space index, without the lock. The FAT entries of
+ * those blocks are still changed with the lock held, like every other FAT change, so whoever
+ * holds it sees no chain change while it walks one. The flush that follows in
+ * FAT_FLUSH_IMMEDIATE mode (flush_after_operation()) is made after letting go of it.
+ * set_FAT_entry() stores the entry and the dirty flag atomically, for the owners of chains
+ * that read them without the lock
  */
 
+unsigned char* fs_freespace_dirty; // One flag per FAT block, set when the block must be written
+int fat_entries_per_block;         // Number of FAT entries that fit in one block
+int fat_entry_size;                // Number of bytes a FAT entry takes on the volume
+static __thread int fat_flush_mode = FAT_FLUSH_IMMEDIATE; // Whether this thread's FAT changes
+                                                          // are flushed after each operation
+int reserved_freespace_blocks = 0; // Free blocks promised to writes whose blocks aren't picked yet
+static pthread_mutex_t freespace_lock; // Guards the FAT, the free space index and the counters
+
 int initialize_freespace(uint64_t numberOfBlocks, uint64_t blockSize) {
     extern long MAGIC_NUMBER;
+
+    // An initialized volume keeps the format it was created with, a new volume gets the current one
+    if (fs_vcb->signature == MAGIC_NUMBER) {
+        if (fs_vcb->format_magic == VCB_FORMAT_MAGIC && fs_vcb->format_version > FS_FORMAT_CURRENT) {
+            fprintf(stderr, "Unsupported volume format: %u.\n", fs_vcb->format_version);
+            return -1;
+        }
+    } else {
+        fs_vcb->format_magic = VCB_FORMAT_MAGIC;
+        fs_vcb->format_version = FS_FORMAT_CURRENT;
+    }
+    fat_entry_size = get_FAT_entry_size();
+
+    // Allocations call each other, the same thread may take the lock again
+    pthread_mutexattr_t lock_attributes;
+    pthread_mutexattr_init(&lock_attributes);
+    pthread_mutexattr_settype(&lock_attributes, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&freespace_lock, &lock_attributes);
+    pthread_mutexattr_destroy(&lock_attributes);
+
     // Get number of FAT blocks required to track freespace
-    int number_of_FAT_blocks = calculate_number_of_FAT_blocks(numberOfBlocks, blockSize);
-    int number_of_FAT_entries_per_block = fs_vcb->size_of_blocks / 2;
+    int number_of_FAT_blocks = calculate_number_of_FAT_blocks(numberOfBlocks, blockSize, fat_entry_size);
+    int number_of_FAT_entries_per_block = blockSize / fat_entry_size;
+    fat_entries_per_block = number_of_FAT_entries_per_block;
 
     // Allocate memory for the freespace array
-    fs_freespace = (unsigned short*)malloc(number_of_FAT_blocks * blockSize / 2 * sizeof(unsigned short));
+    fs_freespace = malloc(number_of_FAT_blocks * number_of_FAT_entries_per_block * sizeof(unsigned int));
+
+    // Allocate memory for the dirty flag of each FAT block, all blocks start clean
+    fs_freespace_dirty = calloc(number_of_FAT_blocks, sizeof(unsigned char));
 
     // Check that memory was successfully allocated for the freespace
-    if (fs_freespace == NULL) {
+    if (fs_freespace == NULL || fs_freespace_dirty == NULL) {
         fprintf(stderr, "Memory allocation failed for freespace.\n");
+        free_freespace();
         return -1;
     }
 
@@ -75,32 +156,49 @@ int initialize_freespace(uint64_t numberOfBlocks, uint64_t blockSize) {
     // Else initialize the freespace
     else {
         // Set all freespace blocks to 0
-        memset(fs_freespace, 0, number_of_FAT_blocks * number_of_FAT_entries_per_block * sizeof(unsigned short));
+        memset(fs_freespace, 0, number_of_FAT_blocks * number_of_FAT_entries_per_block * sizeof(unsigned int));
 
-        // Reserve space for the VCB and the FAT in the freespace
-        for (int i = 0; i <= number_of_FAT_blocks; i++) {
+        // The journal follows the FAT, volumes too small to spare it go without
+        int journal_blocks = JOURNAL_DEFAULT_BLOCKS;
+        if (journal_blocks > (int) numberOfBlocks / 16)
+            journal_blocks = 0;
+
+        // Reserve space for the VCB, the FAT and the journal in the freespace
+        for (int i = 0; i <= number_of_FAT_blocks + journal_blocks; i++) {
             fs_freespace[i] = 1;
         }
 
         fs_vcb->num_of_freespace_blocks = number_of_FAT_blocks;
-        // 77 blocks for the FAT + 1 block for the VCB = 78
-        fs_vcb->first_free_block_in_freespace_map = number_of_FAT_blocks + 1;
-        // Total blocks in volume - 77 blocks reserved for the FAT - 1 block reserved for the VCB
-        fs_vcb->num_of_available_freespace_blocks = numberOfBlocks - number_of_FAT_blocks - 1;
+        // 153 blocks for the FAT + 1 block for the VCB + 256 blocks for the journal = 410
+        fs_vcb->first_free_block_in_freespace_map = number_of_FAT_blocks + journal_blocks + 1;
+        // Total blocks in volume - the blocks reserved for the FAT, the VCB and the journal
+        fs_vcb->num_of_available_freespace_blocks = numberOfBlocks - number_of_FAT_blocks - journal_blocks - 1;
         // 1 is the starting block number of the FAT
         fs_vcb->freespace_start = 1;
+        fs_vcb->journal_start = number_of_FAT_blocks + 1;
+        fs_vcb->journal_blocks = journal_blocks;
+        if (journal_blocks == 0)
+            fs_vcb->format_version = FS_FORMAT_COMPACT_DIRS;
+
+        // Index the free blocks so allocations don't have to scan the FAT
+        if (free_index_build(numberOfBlocks) != 0) {
+            free_freespace();
+            return -1;
+        }
 
         // Write freespace to disk
-        if (LBAwrite(fs_freespace, number_of_FAT_blocks, 1) != number_of_FAT_blocks) {
+        memset(fs_freespace_dirty, 1, number_of_FAT_blocks);
+        if (flush_freespace() != 0) {
             fprintf(stderr, "LBAwrite failed to execute.\n");
-            free(fs_freespace);
-            fs_freespace = NULL;
+            free_freespace();
             return -1;
         }
 
         printf(C_TITLE "+ Volume Info\n" C_RESET);
         printf("  Blocks            : " C_VALUE "%ld\n" C_RESET, numberOfBlocks);
         printf("  FAT Blocks        : " C_VALUE "%d\n"  C_RESET, fs_vcb->num_of_freespace_blocks);
+        printf("  FAT Entry Size    : " C_VALUE "%d bytes\n"  C_RESET, fat_entry_size);
+        printf("  Journal Blocks    : " C_VALUE "%d\n"  C_RESET, fs_vcb->journal_blocks);
         printf("  Free Blocks       : " C_VALUE "%d\n"  C_RESET, fs_vcb->num_of_available_freespace_blocks);
         printf("  First Free Block  : " C_VALUE "%d\n\n" C_RESET, fs_vcb->first_free_block_in_freespace_map);
     }
@@ -108,158 +206,626 @@ int initialize_freespace(uint64_t numberOfBlocks, uint64_t blockSize) {
     return 0;
 }
 
-// Allocate entries in the FAT, linking a sequence of entries similar to a linked list
-int allocate_freespace(int requested_block_count) {
+// Link requested_block_count free blocks from start_block into a chain in the FAT, similar to
+// a linked list. Returns the last block of the chain
+static int link_free_blocks(int start_block, int requested_block_count) {
+    // Block being allocated
+    int fs_index = start_block;
+
+    // Track previous block index for linking next block in the FAT
+    int prev_entry_index = -1;
+
+    // Link each allocated block to the next, similar to a linked list
+    while (requested_block_count > 0) {
+        if (prev_entry_index != -1) {
+            set_FAT_entry(prev_entry_index, fs_index);
+
+            // What's left of the run the previous block was taken from is a run of its own
+            if (fs_index != prev_entry_index + 1)
+                free_index_add_extent(prev_entry_index + 1);
+        }
+
+        free_index_mark_used(fs_index);
+        prev_entry_index = fs_index;
+
+        // Decrement the number of blocks remaining to be allocated for this file/directory
+        requested_block_count--;
+
+        // Inside a run this is simply the following block
+        if (requested_block_count > 0)
+            fs_index = free_index_first_free(fs_index + 1);
+    }
+
+    // Set the value of the last FAT entry in the sequence to itself to indicate end of the sequence
+    set_FAT_entry(prev_entry_index, prev_entry_index);
+    free_index_add_extent(prev_entry_index + 1);
+
+    return prev_entry_index;
+}
+
+// Write the changed FAT blocks to the volume at the end of an operation, in FAT_FLUSH_IMMEDIATE
+// mode. operation names what was done, for the error message
+static int flush_after_operation(const char* operation) {
+    if (fat_flush_mode == FAT_FLUSH_IMMEDIATE && flush_freespace() != 0) {
+        fprintf(stderr, "LBAwrite failed to write the FAT correctly after %s.\n", operation);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Take back the blocks held by the threads' allocation caches when fewer than block_count
+// blocks are left for others, the free space lock is held by the caller
+static void reclaim_cached_blocks(int block_count) {
+    if (fs_vcb != NULL &&
+        fs_vcb->num_of_available_freespace_blocks - reserved_freespace_blocks < block_count)
+        alloc_cache_reclaim();
+}
+
+// Check that requested_block_count blocks can be taken without using reserved blocks
+static int check_available_blocks(int requested_block_count) {
+    reclaim_cached_blocks(requested_block_count);
+
     // Confirm structures and parameters are valid
-    allocation_validity_checks(requested_block_count);
+    if (allocation_validity_checks(requested_block_count) != 0)
+        return -1;
 
-    // Check that there are enough free blocks available
-    if (fs_vcb->num_of_available_freespace_blocks < requested_block_count) {
+    // Check that there are enough free blocks available, the reserved ones are spoken for
+    if (fs_vcb->num_of_available_freespace_blocks - reserved_freespace_blocks <
+            requested_block_count) {
         fprintf(stderr, "Not enough free space remaining.\n");
         return -1;
     }
 
+    return 0;
+}
+
+// Take the free space lock, for callers changing the VCB along with the free space map
+void lock_freespace() {
+    pthread_mutex_lock(&freespace_lock);
+}
+
+void unlock_freespace() {
+    pthread_mutex_unlock(&freespace_lock);
+}
+
+// Allocate a new chain, the free space lock is held by the caller
+static int allocate_blocks(int requested_block_count) {
+    // Confirm structures and parameters are valid, and that there are enough free blocks
+    if (check_available_blocks(requested_block_count) != 0)
+        return -1;
+
     // Check that the size requested is less than the maximum file size
     if (requested_block_count * BLOCK_SIZE > MAX_FILE_SIZE) {
         fprintf(stderr, "Unable to allocate blocks, greater than size allowed: %d.\n", MAX_FILE_SIZE);
         return -1;
     }
 
-    // Index to iterate through the FAT entries
-    int fs_index = fs_vcb->first_free_block_in_freespace_map;
+    // Prefer a single run of free blocks, the smallest one that is long enough
+    int start_block = free_index_find_run(requested_block_count, FREE_FIT_BEST);
 
-    // Track previous block index for linking next block in the FAT
-    int prev_entry_index = -1;
+    // If no run is long enough, take the lowest free blocks wherever they are
+    if (start_block == -1)
+        start_block = free_index_first_free(fs_vcb->first_free_block_in_freespace_map);
+
+    link_free_blocks(start_block, requested_block_count);
+
+    // Update the number of available blocks and the first free block in the freespace
+    update_freespace_counters();
+
+    // Write the changed FAT blocks to the volume
+    if (flush_after_operation("allocating") != 0)
+        return -1;
+
+    // Return the starting block of the allocated space
+    return start_block;
+}
+
+// Take block_count blocks from this thread's allocation cache and link them into a chain
+// after prev_block (-1 for a new chain, near goal_block)
+// The cache hands them out without the free space lock, they are linked with it held
+// Returns the first of the blocks, -1 when the cache can't provide them
+static int insert_cached_blocks(int prev_block, int goal_block, int block_count) {
+    if (fs_freespace == NULL)
+        return -1;
+
+    int start_block = alloc_cache_allocate(prev_block, goal_block, block_count);
+    if (start_block == -1)
+        return -1;
+
+    lock_freespace();
+
+    int last_block = start_block + block_count - 1;
+    for (int block = start_block; block < last_block; block++)
+        set_FAT_entry(block, block + 1);
+    set_FAT_entry(last_block, last_block);
+
+    if (prev_block >= 0)
+        set_FAT_entry(prev_block, start_block);
+
+    unlock_freespace();
+    return start_block;
+}
+
+// Allocate entries in the FAT, linking a sequence of entries similar to a linked list
+int allocate_freespace(int requested_block_count) {
+    int start_block = insert_cached_blocks(-1, -1, requested_block_count);
+    if (start_block != -1)
+        return flush_after_operation("allocating") == 0 ? start_block : -1;
+
+    lock_freespace();
+    start_block = allocate_blocks(requested_block_count);
+    unlock_freespace();
+
+    return start_block;
+}
+
+// Link new blocks into a chain, the free space lock is held by the caller
+static int insert_blocks(int prev_block, int next_block, int goal_block, int requested_block_count) {
+    // Confirm structures and parameters are valid, and that there are enough free blocks
+    if (check_available_blocks(requested_block_count) != 0)
+        return -1;
 
-    // Track first block allocated for the current file/directory
     int start_block = -1;
 
-    // Update the number of available blocks in the freespace
-    fs_vcb->num_of_available_freespace_blocks -= requested_block_count;
-
-    // Iterate through the FAT while requested_block_count > 0
-    while (fs_index < fs_vcb->num_blocks && requested_block_count > 0) {
-        // If the current block is free
-        if (fs_freespace[fs_index] == 0) {
-            // If this is the first block in the sequence of blocks
-            if (prev_entry_index == -1) {
-                // Track the first block allocated for this file/directory
-                start_block = fs_index;
-                // Track the current block index to link in the next iteration
-                prev_entry_index = fs_index;
-            }
-
-            // Link previous block to the current block
-            fs_freespace[prev_entry_index] = fs_index;
-            prev_entry_index = fs_index;
-
-            // Decrement the number of blocks remaining to be allocated for this file/directory
-            requested_block_count--;
-        }
+    // Continue the run before the new blocks, or lead into the run after them
+    if (prev_block >= 0 &&
+        free_index_run_length(prev_block + 1, requested_block_count) == requested_block_count)
+        start_block = prev_block + 1;
+    else if (next_block >= requested_block_count &&
+             free_index_run_length(next_block - requested_block_count, requested_block_count) ==
+                 requested_block_count)
+        start_block = next_block - requested_block_count;
+
+    // Otherwise a run close to the goal, the smallest run that is long enough, or the lowest
+    // free blocks
+    if (start_block == -1)
+        start_block = free_index_find_run_near(goal_block, requested_block_count);
+    if (start_block == -1)
+        start_block = free_index_find_run(requested_block_count, FREE_FIT_BEST);
+    if (start_block == -1)
+        start_block = free_index_first_free(fs_vcb->first_free_block_in_freespace_map);
+
+    int last_block = link_free_blocks(start_block, requested_block_count);
+
+    // Link the new blocks to the blocks around them
+    if (prev_block >= 0)
+        set_FAT_entry(prev_block, start_block);
+    if (next_block >= 0)
+        set_FAT_entry(last_block, next_block);
+
+    // Update the number of available blocks and the first free block in the freespace
+    update_freespace_counters();
+
+    // Write the changed FAT blocks to the volume
+    if (flush_after_operation("extending") != 0)
+        return -1;
+
+    return start_block;
+}
+
+// Allocate requested_block_count blocks and link them into a chain between prev_block and
+// next_block. A prev_block of -1 puts them at the start of the chain, a next_block of -1 at
+// its end. The blocks right after prev_block, or else right before next_block, are taken when
+// they are free, so the chain stays a single run. Otherwise a run in the allocation group of
+// goal_block is preferred, -1 for no goal. Returns the first of the new blocks
+// Blocks going in front of next_block are always placed by the free space map
+int insert_freespace(int prev_block, int next_block, int goal_block, int requested_block_count) {
+    int start_block = -1;
+    if (next_block < 0)
+        start_block = insert_cached_blocks(prev_block, goal_block, requested_block_count);
+    if (start_block != -1)
+        return flush_after_operation("extending") == 0 ? start_block : -1;
+
+    lock_freespace();
+    start_block = insert_blocks(prev_block, next_block, goal_block, requested_block_count);
+    unlock_freespace();
 
-        fs_index++;
+    return start_block;
+}
+
+// insert_freespace() for blocks of which reserved_count were reserved with reserve_freespace()
+// The reservation is given up only once the blocks are linked, a failed allocation keeps it
+int insert_reserved_freespace(int prev_block, int next_block, int goal_block,
+                              int requested_block_count, int reserved_count) {
+    lock_freespace();
+
+    // The reserved blocks may be the last free ones, the allocation has to be able to use them
+    reserved_freespace_blocks -= reserved_count;
+    int start_block = insert_freespace(prev_block, next_block, goal_block, requested_block_count);
+    if (start_block == -1)
+        reserved_freespace_blocks += reserved_count;
+
+    unlock_freespace();
+    return start_block;
+}
+
+// Allocate requested_block_count blocks as a new chain, in the allocation group of goal_block
+// when it has a long enough run
+int allocate_freespace_near(int goal_block, int requested_block_count) {
+    return insert_freespace(-1, -1, goal_block, requested_block_count);
+}
+
+// Where the blocks of a new directory should go, given the start block of its parent
+// Directories created in the root are spread over the groups with the most free blocks, so
+// the files of different trees don't interleave. Others stay in their parent's group while it
+// has at least its share of the free blocks
+int directory_goal_block(int parent_block) {
+    int goal_block = -1;
+    lock_freespace();
+
+    int group_count = free_index_group_count();
+    if (group_count > 0) {
+        int parent_group = parent_block / FREE_GROUP_BLOCKS;
+        int average_free = free_index_free_count() / group_count;
+
+        if (parent_block != fs_vcb->location_of_rootdir &&
+            free_index_group_free(parent_group) >= average_free)
+            goal_block = parent_block;
+        else
+            goal_block = free_index_emptiest_group() * FREE_GROUP_BLOCKS;
     }
 
-    // Set the value of the last FAT entry in the sequence to itself to indicate end of the sequence
-    fs_freespace[fs_index - 1] = fs_index - 1;
+    unlock_freespace();
+    return goal_block;
+}
+
+// Take the blocks of a chain from first_block up to last_block out of it and free them
+// prev_block, the block before them (-1 at the start of the chain), is linked to next_block,
+// the block after them (-1 at the end of the chain)
+int unlink_freespace(int prev_block, int first_block, int last_block, int next_block) {
+    lock_freespace();
 
-    // Write the FAT to the volume
-    if (LBAwrite(fs_freespace, fs_vcb->num_of_freespace_blocks, 1) !=
-        fs_vcb->num_of_freespace_blocks) {
-        fprintf(stderr, "LBAwrite failed to write the FAT correctly after allocating.\n");
+    if (prev_block >= 0)
+        set_FAT_entry(prev_block, next_block >= 0 ? next_block : prev_block);
+
+    // End the blocks being freed, clear_freespace() follows them up to the end of a chain
+    set_FAT_entry(last_block, last_block);
+
+    unlock_freespace();
+    return clear_freespace(first_block);
+}
+
+// Promise block_count free blocks to a write whose blocks are picked later
+// Reserved blocks stay free in the FAT, but other allocations can't take them
+int reserve_freespace(int block_count) {
+    lock_freespace();
+    reclaim_cached_blocks(block_count);
+
+    if (fs_vcb->num_of_available_freespace_blocks - reserved_freespace_blocks < block_count) {
+        unlock_freespace();
+        fprintf(stderr, "Not enough free space remaining.\n");
         return -1;
     }
 
-    // Find the next free block by iterating through the rest of the FAT
-    while (fs_index < fs_vcb->num_blocks) {
-        // If the block is free
-        if (fs_freespace[fs_index] == 0) {
-            // Update the freespace struct
-            fs_vcb->first_free_block_in_freespace_map = fs_index;
-            break;
-        }
+    reserved_freespace_blocks += block_count;
+    unlock_freespace();
+    return 0;
+}
+
+// Return block_count reserved blocks, once they are allocated or no longer needed
+void release_reserved_freespace(int block_count) {
+    lock_freespace();
+    reserved_freespace_blocks -= block_count;
+
+    if (reserved_freespace_blocks < 0)
+        reserved_freespace_blocks = 0;
+    unlock_freespace();
+}
 
-        fs_index++;
+// Give a run of freed blocks to this thread's allocation cache, or to the free space map
+// when the cache has no room
+static void give_back_run(int start_block, int block_count) {
+    if (alloc_cache_free(start_block, block_count) != 0)
+        return_freespace_run(start_block, block_count);
+}
+
+// Free a run of blocks, except those the journal holds until they can't be replayed over
+static void free_run(int start_block, int block_count) {
+    int run_start = start_block;
+
+    for (int block = start_block; block < start_block + block_count; block++) {
+        if (!journal_hold_block(block))
+            continue;
+
+        if (block > run_start)
+            give_back_run(run_start, block - run_start);
+        run_start = block + 1;
     }
 
-    // Return the starting block of the allocated space
-    return start_block;
+    if (run_start < start_block + block_count)
+        give_back_run(run_start, start_block + block_count - run_start);
 }
 
 // Clear the freespace FAT entries for the data beginning at start_block
+// Each run of neighbouring blocks in the chain is freed at once
 int clear_freespace(int start_block) {
+    // A file that was never written has no blocks to free
+    if (start_block == FILE_NO_BLOCKS)
+        return 0;
+
     // Confirm structures and parameters are valid
-    clear_validity_checks(start_block);
+    if (clear_validity_checks(start_block) != 0)
+        return -1;
 
-    int current_block = start_block;
+    lock_freespace();
 
-    // Reassign the first free block variable if the start block of the data being removed is
-    // located at an earlier point
-    if (start_block < fs_vcb->first_free_block_in_freespace_map)
-        fs_vcb->first_free_block_in_freespace_map = start_block;
+    int current_block = start_block;
+    int run_start = start_block;
 
     // Iterate through the connected FAT entries, setting each entry to 0, indicating that it's free
     while (fs_freespace[current_block] != 0)  {
-        // If the last FAT entry in this sequence is found, clear it and break out of the while loop
-        if (fs_freespace[current_block] == current_block) {
-            fs_freespace[current_block] = 0;
-            break;
-        }
-
         // Temporarily store the next block
         int next_block = fs_freespace[current_block];
 
         // Clear the current FAT entry
-        fs_freespace[current_block] = 0;
+        set_FAT_entry(current_block, 0);
+
+        // Free the run each time the chain jumps elsewhere on the volume or ends
+        if (next_block != current_block + 1) {
+            free_run(run_start, current_block - run_start + 1);
+            run_start = next_block;
+        }
+
+        // If the last FAT entry in this sequence is found, stop
+        if (next_block == current_block) {
+            run_start = -1;
+            break;
+        }
 
         // Assign the curren_block for the next iteration
         current_block = next_block;
     }
 
-    // Write the FAT to the volume
-    if (LBAwrite(fs_freespace, fs_vcb->num_of_freespace_blocks, 1) !=
-        fs_vcb->num_of_freespace_blocks) {
-        fprintf(stderr, "LBAwrite failed to write the FAT correctly after clearing.\n");
+    // A chain cut short by a free entry still frees the blocks before it
+    if (run_start != -1 && run_start < current_block)
+        free_run(run_start, current_block - run_start);
+
+    unlock_freespace();
+
+    // Write the changed FAT blocks to the volume
+    if (flush_after_operation("clearing") != 0)
         return -1;
-    }
 
     return 0;
 }
 
+// Take a run of block_count free blocks for an allocation cache, in the allocation group of
+// goal_block when it has one (-1 for no goal). The blocks are marked used in the free space
+// index but stay free in the FAT. Returns the first block, -1 if no run is long enough
+int take_freespace_run(int goal_block, int block_count) {
+    int start_block = -1;
+    lock_freespace();
+
+    if (fs_freespace != NULL &&
+        fs_vcb->num_of_available_freespace_blocks - reserved_freespace_blocks >= block_count) {
+        if (goal_block >= 0)
+            start_block = free_index_find_run_near(goal_block, block_count);
+        if (start_block == -1)
+            start_block = free_index_find_run(block_count, FREE_FIT_BEST);
+    }
+
+    if (start_block != -1) {
+        for (int block = start_block; block < start_block + block_count; block++)
+            free_index_mark_used(block);
+
+        // What remains of the run the blocks were taken from is a run of its own
+        free_index_add_extent(start_block + block_count);
+        update_freespace_counters();
+    }
+
+    unlock_freespace();
+    return start_block;
+}
+
+// Give a run of blocks held by an allocation cache back to the free space map
+// Their FAT entries are already free
+void return_freespace_run(int start_block, int block_count) {
+    lock_freespace();
+
+    for (int block = start_block; block < start_block + block_count; block++)
+        free_index_mark_free(block);
+
+    free_index_add_extent(start_block);
+    update_freespace_counters();
+
+    unlock_freespace();
+}
+
 // Loads the freespace map from the volume into memory
 int load_freespace() {
-    // Read the FAT from the volume
-    if (LBAread(fs_freespace, fs_vcb->num_of_freespace_blocks, 1) !=
-            fs_vcb->num_of_freespace_blocks) {
-        fprintf(stderr, "Freespace failed to load from the volume.\n");
-        return -1;
+    int number_of_FAT_blocks = fs_vcb->num_of_freespace_blocks;
+
+    // Read the FAT from the volume, 4-byte entries are read as they are
+    if (fat_entry_size == sizeof(unsigned int)) {
+        if (cache_read(fs_freespace, number_of_FAT_blocks, fs_vcb->freespace_start) !=
+                number_of_FAT_blocks) {
+            fprintf(stderr, "Freespace failed to load from the volume.\n");
+            return -1;
+        }
     }
+    // 2-byte entries are widened after reading
+    else {
+        unsigned short* disk_FAT = malloc(number_of_FAT_blocks * fat_entries_per_block * sizeof(unsigned short));
+        if (disk_FAT == NULL) {
+            fprintf(stderr, "Memory allocation failed for freespace.\n");
+            return -1;
+        }
+
+        if (cache_read(disk_FAT, number_of_FAT_blocks, fs_vcb->freespace_start) !=
+                number_of_FAT_blocks) {
+            fprintf(stderr, "Freespace failed to load from the volume.\n");
+            free(disk_FAT);
+            return -1;
+        }
+
+        for (int i = 0; i < number_of_FAT_blocks * fat_entries_per_block; i++)
+            fs_freespace[i] = disk_FAT[i];
+
+        free(disk_FAT);
+    }
+
+    // Index the free blocks so allocations don't have to scan the FAT
+    if (free_index_build(fs_vcb->num_blocks) != 0)
+        return -1;
+
+    // The index counts the free blocks exactly, correct the counters stored in the VCB
+    update_freespace_counters();
 
     return 0;
 }
 
-// Allocate additional memory and extend the current chain in the FAT
-int allocate_more_blocks(int current_block, int current_size) {
+// Refresh the VCB's free block count and first free block from the free space index
+void update_freespace_counters() {
+    int first_free_block = free_index_first_free(0);
+
+    fs_vcb->num_of_available_freespace_blocks = free_index_free_count();
+    fs_vcb->first_free_block_in_freespace_map =
+        first_free_block == -1 ? fs_vcb->num_blocks : first_free_block;
+}
+
+// Extend a chain in the FAT by up to block_count blocks, linked after last_block
+// last_block must be the end of the chain, callers track it so the chain isn't walked
+// Fewer blocks are linked when the volume has less free. Returns the new end of the chain
+int allocate_more_blocks(int last_block, int current_size, int block_count) {
     if (current_size >= MAX_FILE_SIZE) {
         fprintf(stderr, "Unable to allocate more blocks, at maximum size: %d\n", MAX_FILE_SIZE);
         return -1;
     }
 
-    // If the current_block isn't at the end of the chain, iterate to find the end
-    while (current_block != fs_freespace[current_block]) {
-        current_block = fs_freespace[current_block];
+    if (fs_freespace[last_block] != (unsigned int)last_block) {
+        fprintf(stderr, "Block %d doesn't end a chain.\n", last_block);
+        return -1;
     }
 
-    // Allocate 10 blocks
-    int next_start_block = allocate_freespace(5);
+    // Link the new blocks after the end of the chain, continuing its run when they are free
+    int next_start_block = insert_cached_blocks(last_block, last_block, block_count);
+    if (next_start_block != -1 && flush_after_operation("extending") != 0)
+        return -1;
+
+    if (next_start_block == -1) {
+        lock_freespace();
+        reclaim_cached_blocks(block_count);
+
+        int free_blocks = fs_vcb->num_of_available_freespace_blocks - reserved_freespace_blocks;
+        if (block_count > free_blocks && free_blocks > 0)
+            block_count = free_blocks;
+
+        next_start_block = insert_blocks(last_block, -1, last_block, block_count);
+        unlock_freespace();
+    }
 
     // Check if additional blocks were allocated
     if (next_start_block == -1)
         // If not, return an error indicator
         return -1;
 
-    // Link the current chain with the newly allocated chain
-    fs_freespace[current_block] = next_start_block;
+    // The new blocks end the chain
+    last_block = next_start_block;
+    while (fs_freespace[last_block] != (unsigned int)last_block)
+        last_block = fs_freespace[last_block];
 
-    return 0;
+    return last_block;
+}
+
+// Change a FAT entry and mark the FAT block holding it as needing to be written
+// The free space lock is held by the caller, the owner of a chain may read it without the lock
+void set_FAT_entry(int index, int value) {
+    __atomic_store_n(&fs_freespace[index], value, __ATOMIC_RELAXED);
+    __atomic_store_n(&fs_freespace_dirty[index / fat_entries_per_block], 1, __ATOMIC_RELEASE);
+}
+
+// Write run_length FAT blocks, starting with FAT block run_start, in the volume's entry size
+static int write_FAT_blocks(int run_start, int run_length) {
+    unsigned int* entries = fs_freespace + run_start * fat_entries_per_block;
+    int volume_block = fs_vcb->freespace_start + run_start;
+    int entry_count = run_length * fat_entries_per_block;
+
+    void* disk_FAT = malloc(entry_count * fat_entry_size);
+    if (disk_FAT == NULL) {
+        fprintf(stderr, "Memory allocation failed for freespace.\n");
+        return -1;
+    }
+
+    // 4-byte entries are written as they are in memory, 2-byte entries are narrowed
+    for (int i = 0; i < entry_count; i++) {
+        unsigned int entry = __atomic_load_n(&entries[i], __ATOMIC_RELAXED);
+
+        if (fat_entry_size == sizeof(unsigned int))
+            ((unsigned int*)disk_FAT)[i] = entry;
+        else
+            ((unsigned short*)disk_FAT)[i] = entry;
+    }
+
+    int result = journal_write(disk_FAT, run_length, volume_block) == run_length ? 0 : -1;
+    free(disk_FAT);
+
+    return result;
+}
+
+// Write the dirty FAT blocks to the volume, one call for each run of neighbouring dirty blocks
+int flush_freespace() {
+    lock_freespace();
+
+    int number_of_FAT_blocks = fs_vcb->num_of_freespace_blocks;
+    int result = 0;
+    int fat_block = 0;
+    bool written = false;
+
+    while (fat_block < number_of_FAT_blocks) {
+        // Skip clean blocks
+        if (!__atomic_load_n(&fs_freespace_dirty[fat_block], __ATOMIC_ACQUIRE)) {
+            fat_block++;
+            continue;
+        }
+
+        // Find the end of this run of dirty blocks, and mark it clean before it is copied
+        // An entry changed after the copy marks its block dirty again
+        int run_start = fat_block;
+        while (fat_block < number_of_FAT_blocks &&
+               __atomic_exchange_n(&fs_freespace_dirty[fat_block], 0, __ATOMIC_ACQ_REL))
+            fat_block++;
+        int run_length = fat_block - run_start;
+
+        // The FAT begins at freespace_start on the volume
+        // A run that couldn't be written stays dirty
+        if (write_FAT_blocks(run_start, run_length) != 0) {
+            for (int block = run_start; block < fat_block; block++)
+                __atomic_store_n(&fs_freespace_dirty[block], 1, __ATOMIC_RELEASE);
+            result = -1;
+            continue;
+        }
+
+        // The run is now on the volume
+        written = true;
+    }
+
+    // The free block counters in the VCB go with the FAT
+    if (written && journal_write(fs_vcb, 1, 0) != 1)
+        result = -1;
+
+    unlock_freespace();
+    return result;
+}
+
+// Select whether the FAT changes of the calling thread are flushed after every operation or
+// only by flush_freespace(). Returns the mode it replaces
+int set_freespace_flush_mode(int mode) {
+    int previous_mode = fat_flush_mode;
+    fat_flush_mode = mode;
+
+    // Leaving deferred mode writes everything that was held back
+    if (mode == FAT_FLUSH_IMMEDIATE && previous_mode == FAT_FLUSH_DEFERRED)
+        flush_freespace();
+
+    return previous_mode;
+}
+
+// Release the memory used by the freespace map
+void free_freespace() {
+    free(fs_freespace);
+    fs_freespace = NULL;
+    free(fs_freespace_dirty);
+    fs_freespace_dirty = NULL;
+    free_index_release();
 }
\ No newline at end of file
@@ -8,9 +8,10 @@
 #include "../include/fsFreespaceHelper.h"
 #include "../include/fsFreespace.h"
 
-int calculate_number_of_FAT_blocks(uint64_t number_of_blocks, uint64_t block_size) {
-    // Each block can hold 256 FAT entries (512 bytes in a block / 2 bytes for an unsigned short)
-    int number_of_FAT_entries_per_block = block_size / sizeof(unsigned short);
+int calculate_number_of_FAT_blocks(uint64_t number_of_blocks, uint64_t block_size, int entry_size) {
+    // Each block can hold 128 FAT entries (512 bytes in a block / 4 bytes for an unsigned int),
+    // or 256 on volumes with 2-byte entries
+    int number_of_FAT_entries_per_block = block_size / entry_size;
 
     // Block size check to avoid division by 0
     if (number_of_FAT_entries_per_block == 0) {
@@ -18,8 +19,8 @@ int calculate_number_of_FAT_blocks(uint64_t number_of_blocks, uint64_t block_siz
         return -1;
     }
 
-    // In order to track 19,531 blocks, 77 blocks are required for the FAT (19,531 / 256 = 77)
-    int number_of_FAT_blocks = (int)number_of_blocks / number_of_FAT_entries_per_block;
+    // In order to track 19,531 blocks, 153 blocks are required for the FAT (19,531 / 128 = 153)
+    int number_of_FAT_blocks = (int)(number_of_blocks / number_of_FAT_entries_per_block);
 
     // If there is a remainder in the reserve calculation, reserve an additional block for the FAT
     if (number_of_blocks % number_of_FAT_entries_per_block != 0)
@@ -28,6 +29,15 @@ int calculate_number_of_FAT_blocks(uint64_t number_of_blocks, uint64_t block_siz
     return number_of_FAT_blocks;
 }
 
+// Number of bytes a FAT entry takes on the volume, selected by the format version in the VCB
+int get_FAT_entry_size() {
+    // Volumes created before the VCB had a format version use 2-byte entries
+    if (fs_vcb->format_magic != VCB_FORMAT_MAGIC || fs_vcb->format_version == FS_FORMAT_FAT16)
+        return sizeof(unsigned short);
+
+    return sizeof(unsigned int);
+}
+
 int allocation_validity_checks(int requested_block_count) {
     // Confirm the freespace structure is valid
     if (fs_vcb == NULL) {
@@ -86,7 +96,7 @@ int get_next_block(int current_block, int current_size) {
     // Check if more blocks need to be allocated
     if (current_block == next_block) {
         // Allocate more blocks and check if it was successful
-        if (allocate_more_blocks(current_block, current_size) != 0)
+        if (allocate_more_blocks(current_block, current_size, MORE_BLOCKS_DEFAULT) == -1)
             // If not, return an error indicator
             return -1;
 
@@ -95,4 +105,41 @@ int get_next_block(int current_block, int current_size) {
     }
 
   return next_block;
-}
\ No newline at end of file
+}
+
+// Count how many blocks, up to max_blocks, follow start_block consecutively on the volume
+// Those blocks can be transferred with a single LBAread/LBAwrite
+int get_contiguous_run(int start_block, int max_blocks) {
+    int run_length = 1;
+    int current_block = start_block;
+
+    // Follow the chain while each block links to the block right after it
+    while (run_length < max_blocks && fs_freespace[current_block] == current_block + 1) {
+        current_block++;
+        run_length++;
+    }
+
+    return run_length;
+}
+
+// Count the volume blocks in the chain that starts at start_block
+// The chain of a sparse file holds no blocks for its holes, so this is what the file takes on
+// the volume. The count stops at a link that leaves the volume and never exceeds its size,
+// the chain of a file being written by another thread may change while it is followed
+int get_chain_length(int start_block) {
+    int block_count = 0;
+    int current_block = start_block;
+
+    while (current_block > 0 && current_block < (int) fs_vcb->num_blocks &&
+           block_count < (int) fs_vcb->num_blocks) {
+        block_count++;
+
+        int next_block = __atomic_load_n(&fs_freespace[current_block], __ATOMIC_RELAXED);
+        if (next_block == current_block)
+            break;
+        current_block = next_block;
+    }
+
+    return block_count;
+}
+
@@ -5,11 +5,34 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
 
 #include "../include/fsHelperFuncs.h"
 #include "../include/fsLow.h"
 #include "../include/mfs.h"
 #include "../include/fsDirectory.h"
+#include "../include/fsFreespace.h"
+#include "../include/fsFreespaceHelper.h"
+#include "../include/fsPathCache.h"
+#include "../include/fsDirCache.h"
+
+/*
+ * Paths are resolved under the tree lock, shared. Removing a directory and moving an entry
+ * take it exclusive (lock_tree()), so no path is resolved through a directory while it is
+ * removed or moved, and a parent handed out by parse_path() is either still in the tree or
+ * marked removed in the directory table. Each directory of the path is locked shared while its
+ * name is looked up, and unlocked before the next one is loaded.
+ *
+ * The caller locks the parent it gets with lock_parent(), which looks the last element up
+ * again: the parent may have changed between parse_path() and the lock.
+ *
+ * fs_dir_curr and the current path string are shared by every thread, under the cwd lock.
+ */
+
+static pthread_rwlock_t tree_lock = PTHREAD_RWLOCK_INITIALIZER;
+static __thread bool tree_locked; // Whether this thread holds the tree lock exclusive
+static pthread_mutex_t cwd_lock = PTHREAD_MUTEX_INITIALIZER;
 
 // Calculate number of blocks
 int retrieve_num_of_blocks(int bytes, int block_size) {
@@ -26,31 +49,101 @@ void free_memory() {
 	fs_vcb = NULL;
 
     // Free freespace
-	free(fs_freespace);
-	fs_freespace = NULL;
+	free_freespace();
 
-    // Free root directory
-    free(fs_dir_root);
+    // The root and current directories were freed with the directory table
     fs_dir_root = NULL;
+    fs_dir_curr = NULL;
 }
 
-// Returns 0 if valid and -1 otherwise
-int parse_path(char* path_name, struct parse_path_return_data* parse_path_info) {
+// Find a name in a directory through the path cache, searching the directory on a miss
+// *dir is loaded from dir_block when it is needed and not loaded yet
+// Returns the index of the name in the directory or -1, and fills in found when it exists
+static int lookup_name(DirectoryEntry** dir, int dir_block, size_t dir_size, char* name,
+                       struct path_cache_result* found) {
+    int cached = path_cache_lookup(dir_block, name, found);
+
+    if (cached == PATH_CACHE_FOUND)
+        return found->index;
+    if (cached == PATH_CACHE_NOT_FOUND)
+        return -1;
+
+    if (*dir == NULL)
+        *dir = dir_cache_get(dir_block, dir_size);
+
+    // The directory couldn't be loaded
+    if (*dir == NULL)
+        return -1;
+
+    // The lookup is cached while the directory can't change
+    lock_dir(*dir, DIR_LOCK_SHARED);
+    int index = get_DE_index(*dir, name);
+    path_cache_insert(dir_block, name, index, index == -1 ? NULL : &(*dir)[index]);
+
+    if (index != -1)
+        path_cache_lookup(dir_block, name, found);
+    unlock_dir(*dir);
+
+    return index;
+}
+
+// Take the tree lock exclusive, to remove or move entries
+// parse_path() called by the same thread meanwhile doesn't take it again
+void lock_tree() {
+    pthread_rwlock_wrlock(&tree_lock);
+    tree_locked = true;
+}
+
+void unlock_tree() {
+    tree_locked = false;
+    pthread_rwlock_unlock(&tree_lock);
+}
+
+// Take the lock guarding fs_dir_curr and the current path
+void lock_cwd() {
+    pthread_mutex_lock(&cwd_lock);
+}
+
+void unlock_cwd() {
+    pthread_mutex_unlock(&cwd_lock);
+}
+
+// Lock the parent returned by parse_path(), DIR_LOCK_SHARED or DIR_LOCK_EXCLUSIVE
+// The last element is looked up again, under the lock
+// Returns -1, with the parent unlocked, if the parent was removed since it was found
+int lock_parent(struct parse_path_return_data* parse_path_info, int mode) {
+    lock_dir(parse_path_info->parent, mode);
+
+    if (dir_cache_removed(parse_path_info->parent)) {
+        unlock_dir(parse_path_info->parent);
+        return -1;
+    }
+
+    if (parse_path_info->last_element_name != NULL)
+        parse_path_info->last_element_index =
+            get_DE_index(parse_path_info->parent, parse_path_info->last_element_name);
+
+    return 0;
+}
+
+// Resolve a path, the tree lock is held by the caller
+static int resolve_path(char* path_name, struct parse_path_return_data* parse_path_info) {
     DirectoryEntry* start_parent;
     DirectoryEntry* parent;
 
-    // Safety first
-	if (path_name == NULL || parse_path_info == NULL) {
-		return -1; 
-	}
-
     if (path_name[0] == '/') { // Absolute path
-        start_parent = fs_dir_root; // Start at the root
+        start_parent = dir_cache_hold(fs_dir_root); // Start at the root
     } else {  // Relative path
-        start_parent = fs_dir_curr; // Start at current directory
+        lock_cwd();
+        start_parent = dir_cache_hold(fs_dir_curr); // Start at current directory
+        unlock_cwd();
     }
 
     parent = start_parent;
+    // The directory being searched, parent is NULL until it has to be loaded
+    int parent_block = start_parent[0].start_block;
+    size_t parent_size = start_parent[0].size;
+    struct path_cache_result found;
     // Tokenize the path 
     char* saveptr;
     char* token;
@@ -70,6 +163,7 @@ int parse_path(char* path_name, struct parse_path_return_data* parse_path_info)
             //free(temp_path_name);
 			return 0; // Valid path
         } else {
+            free_directory(parent);
             //free(temp_path_name);
             return -1; // Invalid path
         }
@@ -79,7 +173,16 @@ int parse_path(char* path_name, struct parse_path_return_data* parse_path_info)
         token2 = strtok_r(NULL, "/", &saveptr);
 
         // Get the index token in the parent directory
-        index_of_DE = get_DE_index(parent, token);
+        index_of_DE = lookup_name(&parent, parent_block, parent_size, token, &found);
+
+        // The last element is looked up in the parent that is returned, so it must be loaded
+        if (token2 == NULL && parent == NULL) {
+            parent = dir_cache_get(parent_block, parent_size);
+
+            if (parent == NULL)
+                return -1; // The parent couldn't be loaded
+        }
+
         if (index_of_DE == -1) { // Token doesn't exist
             if (token2 == NULL) { // Token is the last token in the path name
                 parse_path_info->parent = parent;
@@ -88,6 +191,7 @@ int parse_path(char* path_name, struct parse_path_return_data* parse_path_info)
                 //free(temp_path_name);
                 return 0; // Valid path
             } else {
+                free_directory(parent);
                 //free(temp_path_name);
                 return -1; // Invalid path
             }
@@ -103,25 +207,52 @@ int parse_path(char* path_name, struct parse_path_return_data* parse_path_info)
         // Token exists, and it is not the last element
         // Still in the middle of the path
 
-        if (is_DE_a_directory(&parent[index_of_DE])) {
-		    DirectoryEntry* temp_parent = load_dir(&parent[index_of_DE]);
-            if (parent != start_parent) {
-	            free(parent);
-                parent = NULL;
-            } 
-            parent = temp_parent;
+        if (found.is_dir == FILE_TYPE_DIRECTORY) {
+            // Move to the directory, it is loaded later only if the cache can't resolve the
+            // next element
+            free_directory(parent);
+            parent = NULL;
+            parent_block = found.start_block;
+            parent_size = found.size;
             token = token2;
 	    } else { 
             // A regular file in a middle of a path
+            free_directory(parent);
             //free(temp_path_name);
 		    return -1; // Invalid path
 	    }
 
     }
-} 
+}
+
+// Returns 0 if valid and -1 otherwise
+// Directories in the middle of the path are only loaded when the path cache can't resolve
+// their part of the path, the parent returned is always loaded
+// The caller releases the parent returned with free_directory(), and locks it with
+// lock_parent() before using its entries
+int parse_path(char* path_name, struct parse_path_return_data* parse_path_info) {
+    // Safety first
+	if (path_name == NULL || parse_path_info == NULL) {
+		return -1; 
+	}
+
+    if (tree_locked)
+        return resolve_path(path_name, parse_path_info);
+
+    pthread_rwlock_rdlock(&tree_lock);
+    int result = resolve_path(path_name, parse_path_info);
+    pthread_rwlock_unlock(&tree_lock);
+
+    return result;
+}
 
 // Retrieve the index of a directory based on the token
 int get_DE_index(DirectoryEntry* dir_array, char* token) {
+    // Directories in the directory table have their names indexed
+    dir_name_index* names = dir_cache_name_index(dir_array);
+    if (names != NULL)
+        return dir_index_find(names, dir_array, token);
+
     int num_DE = dir_array[0].size / sizeof(DirectoryEntry);
 
     for (int i = 0; i < num_DE; i++) {
@@ -131,8 +262,12 @@ int get_DE_index(DirectoryEntry* dir_array, char* token) {
     return -1;
 }
 
-// Retrieve the first available DE
-int get_available_DE_index(DirectoryEntry* dir_array) {
+// An unused slot of the directory as it is, -1 if every slot is used
+static int find_free_DE_index(DirectoryEntry* dir_array) {
+    dir_name_index* names = dir_cache_name_index(dir_array);
+    if (names != NULL)
+        return dir_index_free_slot(names, dir_array);
+
     int num_DE = dir_array[0].size / sizeof(DirectoryEntry);
 
     for (int i = 2; i < num_DE; i++) {
@@ -142,12 +277,27 @@ int get_available_DE_index(DirectoryEntry* dir_array) {
     return -1;
 }
 
+// Retrieve the first available DE, growing the directory if it is full
+int get_available_DE_index(DirectoryEntry* dir_array) {
+    int index = find_free_DE_index(dir_array);
+
+    // Every slot is used, grow the directory
+    if (index == -1 && grow_directory(dir_array) == 0)
+        index = find_free_DE_index(dir_array);
+
+    return index;
+}
+
 // Check if it is a directory
 int is_DE_a_directory(DirectoryEntry* dir){
     return (dir->is_dir == FILE_TYPE_DIRECTORY);
 }
 
 int is_DE_exist(DirectoryEntry* parent, char *name){
+    dir_name_index* names = dir_cache_name_index(parent);
+    if (names != NULL)
+        return dir_index_find(names, parent, name) >= 2 ? 0 : -1;
+
     int num_DE = parent[0].size / sizeof(DirectoryEntry);
 
 	for (int i = 2; i < num_DE; i++) {
@@ -157,10 +307,26 @@ int is_DE_exist(DirectoryEntry* parent, char *name){
     return -1; // DE doesn't exist
 }
 
-void free_directory(DirectoryEntry* dir){
-    // Don't free the directory if it is the root or the current directory
-    if(dir != NULL && dir != fs_dir_root && dir != fs_dir_curr){
-        free(dir);
-        dir = NULL;
+// Fill fs_stat buffer with the data held by a directory entry
+void fill_stat_from_DE(DirectoryEntry* entry, struct fs_stat* buf) {
+    buf->st_size = dir_stored_size(entry);
+    buf->st_blksize = fs_vcb->size_of_blocks;
+    if (is_DE_a_directory(entry)) {
+        // The size of a directory in the entry is the size of its entries in memory
+        buf->st_blocks = dir_block_count(entry->size / sizeof(DirectoryEntry));
+    } else if (entry->start_block == FILE_NO_BLOCKS) {
+        buf->st_blocks = 0;
+    } else {
+        // Holes in a sparse file have no blocks, only the blocks of the chain are counted
+        buf->st_blocks = get_chain_length(entry->start_block);
     }
+    buf->st_accesstime = entry->access_time;
+    buf->st_modtime = entry->modification_time;
+    buf->st_createtime = entry->creation_time;
+}
+
+// Release a directory obtained from load_dir() or parse_path()
+// The directory table frees it once nobody uses it and memory is needed
+void free_directory(DirectoryEntry* dir){
+    dir_cache_release(dir);
 }
@@ -10,11 +10,16 @@
 #include <string.h>
 
 #include "../include/fsLow.h"
+#include "../include/fsCache.h"
 #include "../include/fsFreespace.h"
 #include "../include/mfs.h"
 #include "../include/fsHelperFuncs.h"
 #include "../include/fsDirectory.h"
 #include "../include/fsFreespaceHelper.h"
+#include "../include/fsPathCache.h"
+#include "../include/fsDirCache.h"
+#include "../include/fsJournal.h"
+#include "../include/fsAllocCache.h"
 
 #define C_PROMPT  "\x1b[95m"
 #define C_TITLE   "\x1b[35m"
@@ -25,17 +30,33 @@
 long MAGIC_NUMBER = 742891252;
 
 VCB *fs_vcb; // Volume control block
-unsigned short *fs_freespace; // Freespace array (FAT)
+unsigned int *fs_freespace; // Freespace array (FAT)
 DirectoryEntry* fs_dir_root; // Root directory
 DirectoryEntry* fs_dir_curr; // Current directory
 
 int initFileSystem (uint64_t numberOfBlocks, uint64_t blockSize) {
+    // Start the block cache before anything is read from the volume
+    if (cache_init(CACHE_DEFAULT_BUDGET, blockSize) != 0)
+        return -1;
+
+    // Lookups cached for a previously mounted volume don't apply to this one
+    path_cache_clear();
+
+    // Start with no directory in memory
+    if (dir_cache_init(DIR_CACHE_DEFAULT_BUDGET) != 0)
+        return -1;
+
     fs_vcb = malloc(blockSize); // Allocate memory for the VCB
     LBAread(fs_vcb, 1, 0); // Read the first block into the VCB
 
+    // Bring the metadata up to date with the transactions committed to the journal
+    if (journal_mount() != 0)
+        return -1;
+
     // If the file system has been previously initialized, the freespace is loaded from the
     // volume, otherwise the freespace is initialized
-    initialize_freespace(numberOfBlocks, blockSize);
+    if (initialize_freespace(numberOfBlocks, blockSize) != 0)
+        return -1;
 
 	/*
 		Check if the VCB signature matches the magic number.
@@ -47,18 +68,13 @@ int initFileSystem (uint64_t numberOfBlocks, uint64_t blockSize) {
     if (fs_vcb->signature == MAGIC_NUMBER) {
         // Load root directory to memory
 
-        // Allocate memory for root directory
-        fs_dir_root = malloc(fs_vcb->root_blocks * blockSize);
-
+        // Load the root directory into the directory table
         if (load_root_directory() != fs_vcb->root_blocks) {
             perror("Root directory failed to load.\n");
             return -1;
         }
 
         //printf(C_LABEL "Root directory loaded.\n\n" C_RESET);
-
-        // At the beginning,current dir is root dir
-        fs_dir_curr = fs_dir_root;
     } else {
         printf(C_TITLE "+ Initializing File System\n" C_RESET);
         printf("  " C_VALUE "%ld blocks × %ld bytes\n\n" C_RESET, numberOfBlocks, blockSize);
@@ -70,22 +86,38 @@ int initFileSystem (uint64_t numberOfBlocks, uint64_t blockSize) {
 
         // Initialize root directory. NULL means root doesn't have parent
         fs_dir_root = create_directory(NULL, MAX_DIR_ENTRIES);
+        if (fs_dir_root == NULL)
+            return -1;
+
         // Start block of the root in the volume
         fs_vcb->location_of_rootdir = fs_dir_root->start_block;
         // Number of blocks allocated for the root in the volume
-        fs_vcb->root_blocks = retrieve_num_of_blocks(fs_dir_root[0].size, BLOCK_SIZE);
+        fs_vcb->root_blocks = dir_block_count(fs_dir_root[0].size / sizeof(DirectoryEntry));
 
         //printf("root blocks %d\n", fs_vcb->root_blocks);
 
         // LBAWrite() the VCB to block 0
-        if (LBAwrite(fs_vcb, 1, 0) != 1) {
+        if (journal_write(fs_vcb, 1, 0) != 1) {
             perror("LBAwrite the VCB to block 0 failed.\n");
             exit (EXIT_FAILURE);
         }
+
+        // The new volume is written in place before its journal starts. Once the journal
+        // is on, the VCB's copy on the volume is only updated at checkpoints, and it must
+        // already locate the journal if the system stops before the first one
+        if (dir_cache_flush() != 0 || flush_freespace() != 0 || cache_flush() != 0) {
+            fprintf(stderr, "Failed to write the new volume.\n");
+            return -1;
+        }
+
+        // Everything written from now on goes through the journal
+        if (fs_vcb->journal_blocks > 0 &&
+            journal_format(fs_vcb->journal_start, fs_vcb->journal_blocks) != 0)
+            return -1;
     }
 
     // At the beginning,current dir is root dir
-    fs_dir_curr = fs_dir_root;
+    fs_dir_curr = dir_cache_hold(fs_dir_root);
 
     return 0;
 }
@@ -93,15 +125,30 @@ int initFileSystem (uint64_t numberOfBlocks, uint64_t blockSize) {
 void exitFileSystem () {
 	printf (C_PROMPT "\nSystem exiting\n" C_RESET);
 
+	// Give the blocks held by the threads' allocation caches back, so the free block count
+	// written with the VCB is exact
+	alloc_cache_shutdown();
+
 	// Ensure that the Volume Control Block (VCB) is written to disk.
-	if (LBAwrite(fs_vcb, 1, 0) != 1) {
+	if (journal_write(fs_vcb, 1, 0) != 1) {
 		perror("LBAwrite failed when trying to write the VCB.\n");
 	}
 
-	// Ensure that the free space information is written to disk.
-	if (LBAwrite(fs_freespace,fs_vcb->num_of_freespace_blocks,1) != fs_vcb->num_of_freespace_blocks) {
+	// Ensure that any free space changes still held in memory are written to disk.
+	if (flush_freespace() != 0) {
 		perror("LBAwrite failed to write the freespace.");
 	}
 
+	// Write the directories still held in memory, then release them
+	dir_cache_shutdown();
+
+	// Commit the last transaction and write everything it logged in place
+	if (journal_shutdown() != 0) {
+		perror("Failed to commit the journal.");
+	}
+
+	// Write back everything still held in the block cache
+	cache_shutdown();
+
 	free_memory();
 }
\ No newline at end of file
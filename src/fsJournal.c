@@ -0,0 +1,718 @@
+/**************************************************************
+* Contains the write-ahead journal for the metadata blocks
+**************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "../include/fsJournal.h"
+#include "../include/mfs.h"
+#include "../include/fsLow.h"
+#include "../include/fsCache.h"
+#include "../include/fsFreespace.h"
+#include "../include/fsDirCache.h"
+
+/*
+ * Volumes of format FS_FORMAT_JOURNAL reserve a region after the FAT where every change to
+ * the FAT, the directories and the VCB is logged before it reaches its place on the volume.
+ *
+ * Metadata is written with journal_write() instead of cache_write(). The blocks go to the
+ * block cache as before, but they are pinned there and join the running transaction. When
+ * the transaction commits, one LBAwrite appends it to the journal:
+ *
+ *   descriptor (the volume block of each logged block) | the logged blocks | commit
+ *
+ * and its blocks are unpinned. From then on the cache writes them in place whenever it
+ * likes (the lazy checkpoint). Until then nothing of the transaction is on the volume.
+ * Everything else the cache holds, file data included, is written before the transaction,
+ * so a committed file never points at blocks whose data was lost.
+ *
+ * Operations that change metadata are bracketed by journal_begin() and journal_end(). A
+ * transaction commits at the end of an operation once JOURNAL_GROUP_OPS operations joined
+ * it (group commit), so several creates or deletes share a single journal write. Before it
+ * commits, the directories and FAT blocks still held in memory are written into it. A
+ * transaction that grows past the blocks the journal or the cache can hold commits early,
+ * in the middle of an operation. Writes to file data aren't bracketed, the blocks they
+ * allocate join the running transaction and commit with the next operation.
+ *
+ * The journal is circular. Once more than half of it is used, the cache is flushed, which
+ * writes every committed block in place, and the superblock is moved past the transactions
+ * it held. A transaction never holds more than a quarter of the journal, so there is always
+ * room for the next one. A checkpoint made while the running transaction holds pinned blocks
+ * (when the next transaction doesn't fit) first writes in place, from the journal, the
+ * committed contents of those blocks, which the cache couldn't write.
+ *
+ * Replay writes back every block the journal holds, and the journal has no record of blocks
+ * freed since. A block logged since the last checkpoint that is freed (the blocks of a removed
+ * directory) is therefore held back from the allocator (journal_hold_block()): it would be
+ * overwritten by a replay, and while its free isn't committed the volume still uses it. Held
+ * blocks go back to the free space map after the first checkpoint following the commit of
+ * their free, outside the journal lock since the free space lock comes first.
+ *
+ * At mount the transactions after the superblock are replayed in order, as long as their
+ * sequence number follows and their commit block and checksum are valid. A transaction that
+ * didn't reach the end of its commit is dropped. Replay reads only the journal, not the
+ * whole volume.
+ *
+ * Several threads may run operations at once. The nesting of journal_begin() is kept per
+ * thread, and a group commit waits until no operation is running, so a transaction never
+ * holds half of an operation: once JOURNAL_GROUP_OPS operations joined the transaction, new
+ * operations wait in journal_begin() and the last one to end commits. An operation must call
+ * journal_begin() before it locks any directory, since the commit writes every directory back.
+ * The journal's own writes go through cache_volume_write(), the cache serializes every
+ * transfer with the volume.
+ */
+
+static bool active;              // Whether the volume has a journal
+static int journal_start;        // Volume block of the superblock
+static int journal_blocks;       // Blocks in the journal, the superblock included
+static int head;                 // Where the next transaction is written
+static int tail;                 // Where the oldest transaction not yet checkpointed starts
+static int used;                 // Blocks used since the last checkpoint
+static uint32_t volume_id;
+static uint32_t next_sequence;   // Sequence number of the running transaction
+static uint32_t tail_sequence;   // Sequence number of the transaction at tail
+
+static uint64_t* txn_blocks;     // Volume blocks logged by the running transaction
+static int txn_count;            // Number of blocks logged by the running transaction
+static int max_txn_blocks;       // Most blocks a transaction may log
+static int txn_ops;              // Operations that joined the running transaction
+static __thread int depth;       // Nesting of journal_begin() calls in this thread
+static int active_ops;           // Operations between journal_begin() and journal_end()
+static bool committing;          // A group commit is writing the running transaction
+static char* txn_buffer;         // A whole transaction as it is written to the journal
+static uint64_t* covered_blocks; // Blocks logged since the last checkpoint, replay may write them
+static int covered_count;
+static int covered_capacity;
+static uint64_t* held_blocks;    // Freed blocks kept from the allocator, see journal_hold_block()
+static uint32_t* held_sequence;  // Transaction that freed each held block
+static int held_count;
+static int held_capacity;
+static uint32_t release_sequence; // Blocks freed by earlier transactions can be given back
+static struct journal_stats stats;
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t journal_idle = PTHREAD_COND_INITIALIZER; // Signalled after each commit
+
+// FNV-1a hash of a run of blocks
+static uint32_t checksum(const char* data, int block_count) {
+    uint32_t hash = 2166136261u;
+
+    for (int i = 0; i < block_count * BLOCK_SIZE; i++) {
+        hash ^= (unsigned char) data[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static void set_header(journal_header* header, uint32_t type, uint32_t sequence, uint32_t value) {
+    header->magic = JOURNAL_MAGIC;
+    header->type = type;
+    header->volume_id = volume_id;
+    header->sequence = sequence;
+    header->value = value;
+}
+
+static bool valid_header(journal_header* header, uint32_t type, uint32_t sequence) {
+    return header->magic == JOURNAL_MAGIC && header->type == type &&
+           header->volume_id == volume_id && header->sequence == sequence;
+}
+
+// Record where replay starts
+static int write_superblock() {
+    char block[BLOCK_SIZE];
+
+    memset(block, 0, BLOCK_SIZE);
+    set_header((journal_header*) block, JOURNAL_SUPERBLOCK, tail_sequence, tail);
+
+    if (cache_volume_write(block, 1, journal_start) != 1) {
+        fprintf(stderr, "LBAwrite failed to write the journal superblock.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+// Start using the journal of block_count blocks at start_block
+static int setup(int start_block, int block_count) {
+    struct cache_stats cache;
+    cache_get_stats(&cache);
+
+    journal_start = start_block;
+    journal_blocks = block_count;
+    used = 0;
+    txn_count = 0;
+    txn_ops = 0;
+    active_ops = 0;
+    depth = 0;
+
+    // A quarter of the journal, without its descriptor and commit, and never most of the cache
+    max_txn_blocks = (journal_blocks - 1) / 4 - 2;
+    if (max_txn_blocks > (int) JOURNAL_DESCRIPTOR_SLOTS)
+        max_txn_blocks = JOURNAL_DESCRIPTOR_SLOTS;
+    if (cache.capacity > 0 && max_txn_blocks > (int) cache.capacity / 2)
+        max_txn_blocks = cache.capacity / 2;
+
+    if (max_txn_blocks < 1) {
+        fprintf(stderr, "The journal is too small: %d blocks.\n", block_count);
+        return -1;
+    }
+
+    free(txn_blocks);
+    free(txn_buffer);
+    txn_blocks = malloc(max_txn_blocks * sizeof(uint64_t));
+    // Replay reads transactions of any size a descriptor can describe
+    txn_buffer = malloc((JOURNAL_DESCRIPTOR_SLOTS + 2) * BLOCK_SIZE);
+
+    if (txn_blocks == NULL || txn_buffer == NULL) {
+        fprintf(stderr, "Memory allocation failed for the journal.\n");
+        free(txn_blocks);
+        free(txn_buffer);
+        txn_blocks = NULL;
+        txn_buffer = NULL;
+        return -1;
+    }
+
+    covered_count = 0;
+    held_count = 0;
+    release_sequence = 0;
+
+    memset(&stats, 0, sizeof(stats));
+    return 0;
+}
+
+// Create an empty journal of block_count blocks at start_block, on a volume being formatted
+int journal_format(int start_block, int block_count) {
+    if (setup(start_block, block_count) != 0)
+        return -1;
+
+    volume_id = (uint32_t) time(NULL) ^ ((uint32_t) start_block * 2654435761u);
+    head = 1;
+    tail = 1;
+    next_sequence = 1;
+    tail_sequence = 1;
+
+    // Whatever the blocks held before isn't a transaction of this volume
+    char block[BLOCK_SIZE];
+    memset(block, 0, BLOCK_SIZE);
+    if (LBAwrite(block, 1, journal_start + 1) != 1 || write_superblock() != 0)
+        return -1;
+
+    active = true;
+    return 0;
+}
+
+// Read the transaction at offset into txn_buffer, returns its number of logged blocks
+// Returns -1 if there is no complete transaction numbered sequence there
+static int read_transaction(int offset, uint32_t sequence) {
+    if (offset < 1 || offset + 2 > journal_blocks)
+        return -1;
+
+    if (cache_volume_read(txn_buffer, 1, journal_start + offset) != 1)
+        return -1;
+
+    journal_descriptor* descriptor = (journal_descriptor*) txn_buffer;
+    if (!valid_header(&descriptor->header, JOURNAL_DESCRIPTOR, sequence))
+        return -1;
+
+    int count = descriptor->header.value;
+    if (count < 1 || count > (int) JOURNAL_DESCRIPTOR_SLOTS || offset + count + 2 > journal_blocks)
+        return -1;
+
+    if (cache_volume_read(txn_buffer + BLOCK_SIZE, count + 1, journal_start + offset + 1) !=
+            (uint64_t) count + 1)
+        return -1;
+
+    // The transaction counts only if its commit made it to the volume
+    journal_header* commit = (journal_header*) (txn_buffer + (count + 1) * BLOCK_SIZE);
+    if (!valid_header(commit, JOURNAL_COMMIT, sequence) ||
+        commit->value != checksum(txn_buffer, count + 1))
+        return -1;
+
+    return count;
+}
+
+// Whether block was logged by the running transaction
+static bool logged(uint64_t block) {
+    for (int i = 0; i < txn_count; i++) {
+        if (txn_blocks[i] == block)
+            return true;
+    }
+
+    return false;
+}
+
+// Write the blocks of the committed transactions from the tail on in place, in order
+// With only_logged set, only the blocks the running transaction logged again are written, and
+// the transactions stop before it. Returns the offset after the last transaction and sets
+// *end_sequence to the sequence number following it, -1 on error
+static int write_committed(bool only_logged, uint32_t* end_sequence) {
+    int offset = tail;
+    uint32_t sequence = tail_sequence;
+
+    for (int i = 0; i < journal_blocks && !(only_logged && sequence == next_sequence); i++) {
+        int count = read_transaction(offset, sequence);
+
+        // A transaction that didn't fit before the end of the journal starts over at its start
+        if (count < 0 && offset != 1) {
+            count = read_transaction(1, sequence);
+            if (count >= 0)
+                offset = 1;
+        }
+
+        if (count < 0)
+            break;
+
+        journal_descriptor* descriptor = (journal_descriptor*) txn_buffer;
+        for (int block = 0; block < count; block++) {
+            if (only_logged && !logged(descriptor->blocks[block]))
+                continue;
+
+            if (cache_volume_write(txn_buffer + (block + 1) * BLOCK_SIZE, 1,
+                                   descriptor->blocks[block]) != 1) {
+                fprintf(stderr, "LBAwrite failed to write a journal block in place.\n");
+                return -1;
+            }
+        }
+
+        offset += count + 2;
+        sequence++;
+    }
+
+    *end_sequence = sequence;
+    return offset;
+}
+
+// Write the committed transactions in place, in order, then start an empty journal after them
+static int replay() {
+    uint32_t sequence;
+    int offset = write_committed(false, &sequence);
+    if (offset < 0)
+        return -1;
+
+    stats.replayed += sequence - tail_sequence;
+
+    head = offset;
+    tail = offset;
+    next_sequence = sequence;
+    tail_sequence = sequence;
+    return write_superblock();
+}
+
+// Replay the journal of a volume being mounted, call once its VCB is read
+// Volumes of a format without a journal write their metadata in place, as before
+int journal_mount() {
+    extern long MAGIC_NUMBER;
+    active = false;
+
+    if (fs_vcb->signature != MAGIC_NUMBER ||
+        fs_vcb->format_magic != VCB_FORMAT_MAGIC || fs_vcb->format_version < FS_FORMAT_JOURNAL ||
+        fs_vcb->format_version > FS_FORMAT_CURRENT)
+        return 0;
+
+    journal_header superblock;
+    char block[BLOCK_SIZE];
+    if (LBAread(block, 1, fs_vcb->journal_start) != 1) {
+        fprintf(stderr, "LBAread failed to read the journal superblock.\n");
+        return -1;
+    }
+    memcpy(&superblock, block, sizeof(superblock));
+
+    if (superblock.magic != JOURNAL_MAGIC || superblock.type != JOURNAL_SUPERBLOCK) {
+        fprintf(stderr, "The journal superblock is invalid.\n");
+        return -1;
+    }
+
+    if (setup(fs_vcb->journal_start, fs_vcb->journal_blocks) != 0)
+        return -1;
+
+    volume_id = superblock.volume_id;
+    tail = superblock.value;
+    tail_sequence = superblock.sequence;
+
+    if (replay() != 0)
+        return -1;
+
+    // The VCB may have been one of the blocks replayed
+    if (stats.replayed > 0 && LBAread(fs_vcb, 1, 0) != 1) {
+        fprintf(stderr, "LBAread failed to read the VCB after replaying the journal.\n");
+        return -1;
+    }
+
+    active = true;
+    return 0;
+}
+
+// Offset where a transaction of block_count blocks fits, -1 if it doesn't fit
+static int place(int block_count) {
+    if (head >= tail) {
+        if (head + block_count <= journal_blocks)
+            return head;
+        if (1 + block_count <= tail || (used == 0 && 1 + block_count <= journal_blocks))
+            return 1;
+        return -1;
+    }
+
+    return head + block_count <= tail ? head : -1;
+}
+
+// Write every committed block in place and empty the journal, the journal is locked by the caller
+static int checkpoint() {
+    if (!active)
+        return 0;
+
+    if (cache_flush() != 0)
+        return -1;
+
+    // The cache holds the blocks of the running transaction pinned, with contents that aren't
+    // committed. Those an earlier transaction logged get its contents from the journal
+    uint32_t sequence;
+    if (txn_count > 0 && write_committed(true, &sequence) < 0)
+        return -1;
+
+    tail = head;
+    tail_sequence = next_sequence;
+    used = 0;
+    stats.checkpoints++;
+
+    // Only the running transaction's blocks can still be written in place by a replay
+    memcpy(covered_blocks, txn_blocks, txn_count * sizeof(uint64_t));
+    covered_count = txn_count;
+    release_sequence = next_sequence;
+
+    return write_superblock();
+}
+
+// Add block to the blocks logged since the last checkpoint, the journal is locked by the caller
+static int cover_block(uint64_t block) {
+    for (int i = 0; i < covered_count; i++) {
+        if (covered_blocks[i] == block)
+            return 0;
+    }
+
+    if (covered_count == covered_capacity) {
+        int new_capacity = covered_capacity > 0 ? covered_capacity * 2 : journal_blocks;
+        uint64_t* new_blocks = realloc(covered_blocks, new_capacity * sizeof(uint64_t));
+        if (new_blocks == NULL) {
+            fprintf(stderr, "Memory allocation failed for the journal.\n");
+            return -1;
+        }
+
+        covered_blocks = new_blocks;
+        covered_capacity = new_capacity;
+    }
+
+    covered_blocks[covered_count++] = block;
+    return 0;
+}
+
+// Keep a block being freed from the allocator when a replay could still write it in place
+// Returns whether the journal holds the block, it is given back to the free space map after
+// the first checkpoint following the commit of its free
+bool journal_hold_block(uint64_t block) {
+    pthread_mutex_lock(&journal_lock);
+
+    bool covered = false;
+    for (int i = 0; active && i < covered_count && !covered; i++)
+        covered = covered_blocks[i] == block;
+
+    if (covered && held_count == held_capacity) {
+        int new_capacity = held_capacity > 0 ? held_capacity * 2 : journal_blocks;
+        uint64_t* new_blocks = realloc(held_blocks, new_capacity * sizeof(uint64_t));
+        if (new_blocks != NULL)
+            held_blocks = new_blocks;
+
+        uint32_t* new_sequence = realloc(held_sequence, new_capacity * sizeof(uint32_t));
+        if (new_sequence != NULL)
+            held_sequence = new_sequence;
+
+        if (new_blocks != NULL && new_sequence != NULL)
+            held_capacity = new_capacity;
+    }
+
+    // Without memory the block is freed right away, as on a volume without a journal
+    if (covered && held_count < held_capacity) {
+        held_blocks[held_count] = block;
+        held_sequence[held_count] = next_sequence;
+        held_count++;
+    } else {
+        covered = false;
+    }
+
+    pthread_mutex_unlock(&journal_lock);
+    return covered;
+}
+
+// Give the held blocks that a checkpoint released back to the free space map
+// Called without the journal lock, the free space lock is taken before it
+static void release_held_blocks() {
+    pthread_mutex_lock(&journal_lock);
+
+    int released_count = 0;
+    uint64_t* released = held_count > 0 ? malloc(held_count * sizeof(uint64_t)) : NULL;
+
+    if (released != NULL) {
+        int kept = 0;
+        for (int i = 0; i < held_count; i++) {
+            if (!active || (int32_t) (held_sequence[i] - release_sequence) < 0) {
+                released[released_count++] = held_blocks[i];
+            } else {
+                held_blocks[kept] = held_blocks[i];
+                held_sequence[kept] = held_sequence[i];
+                kept++;
+            }
+        }
+        held_count = kept;
+    }
+
+    pthread_mutex_unlock(&journal_lock);
+
+    for (int i = 0; i < released_count; i++)
+        return_freespace_run(released[i], 1);
+
+    free(released);
+}
+
+// Write the running transaction to the journal, the journal is locked by the caller
+static int commit_transaction() {
+    // The operations waiting for this commit may start
+    txn_ops = 0;
+    pthread_cond_broadcast(&journal_idle);
+
+    if (!active || txn_count == 0)
+        return 0;
+
+    int block_count = txn_count + 2;
+    int offset = place(block_count);
+    if (offset < 0) {
+        if (checkpoint() != 0)
+            return -1;
+        offset = place(block_count);
+    }
+
+    if (offset < 0) {
+        fprintf(stderr, "No room in the journal for a transaction of %d blocks.\n", block_count);
+        return -1;
+    }
+
+    // File data reaches the volume before the metadata pointing at it is committed, so a
+    // replayed file never shows blocks that weren't written. Pinned blocks stay in the cache
+    if (cache_flush() != 0)
+        fprintf(stderr, "Failed to write the file data of a journal transaction.\n");
+
+    journal_descriptor* descriptor = (journal_descriptor*) txn_buffer;
+    memset(descriptor, 0, BLOCK_SIZE);
+    set_header(&descriptor->header, JOURNAL_DESCRIPTOR, next_sequence, txn_count);
+
+    // The pinned blocks are still in the cache, with their latest contents
+    for (int i = 0; i < txn_count; i++) {
+        descriptor->blocks[i] = txn_blocks[i];
+        cache_read(txn_buffer + (i + 1) * BLOCK_SIZE, 1, txn_blocks[i]);
+    }
+
+    char* commit_block = txn_buffer + (txn_count + 1) * BLOCK_SIZE;
+    memset(commit_block, 0, BLOCK_SIZE);
+    set_header((journal_header*) commit_block, JOURNAL_COMMIT, next_sequence,
+               checksum(txn_buffer, txn_count + 1));
+
+    int result = 0;
+    if (cache_volume_write(txn_buffer, block_count, journal_start + offset) != (uint64_t) block_count) {
+        fprintf(stderr, "LBAwrite failed to write a journal transaction.\n");
+        result = -1;
+    }
+
+    // The blocks skipped at the end of the journal stay used until the next checkpoint
+    if (offset < head)
+        used += journal_blocks - head;
+    used += block_count;
+    head = offset + block_count;
+    next_sequence++;
+
+    // The cache may write the blocks in place now
+    for (int i = 0; i < txn_count; i++)
+        cache_unpin(txn_blocks[i]);
+    txn_count = 0;
+
+    stats.commits++;
+    stats.blocks_logged += block_count - 2;
+
+    if (used > (journal_blocks - 1) / 2 && checkpoint() != 0)
+        result = -1;
+
+    return result;
+}
+
+// Write the running transaction to the journal
+int journal_commit() {
+    pthread_mutex_lock(&journal_lock);
+    int result = commit_transaction();
+    pthread_mutex_unlock(&journal_lock);
+
+    release_held_blocks();
+    return result;
+}
+
+// Write metadata blocks, same interface as cache_write
+// The blocks join the running transaction and stay in the cache until it is committed
+uint64_t journal_write(void* buffer, uint64_t lba_count, uint64_t lba_position) {
+    pthread_mutex_lock(&journal_lock);
+
+    if (!active) {
+        pthread_mutex_unlock(&journal_lock);
+        return cache_write(buffer, lba_count, lba_position);
+    }
+
+    char* source = buffer;
+    bool forced_commit = false;
+
+    for (uint64_t i = 0; i < lba_count; i++) {
+        uint64_t block = lba_position + i;
+        bool in_transaction = logged(block);
+
+        // No room left in the transaction, commit what it holds so far
+        if (!in_transaction && txn_count == max_txn_blocks) {
+            stats.forced_commits++;
+            forced_commit = true;
+            if (commit_transaction() != 0) {
+                pthread_mutex_unlock(&journal_lock);
+                return i;
+            }
+        }
+
+        // One block at a time, so none bypasses the cache
+        if (cache_write(source + i * BLOCK_SIZE, 1, block) != 1) {
+            pthread_mutex_unlock(&journal_lock);
+            return i;
+        }
+
+        if (!in_transaction) {
+            cache_pin(block);
+            txn_blocks[txn_count++] = block;
+
+            if (cover_block(block) != 0) {
+                pthread_mutex_unlock(&journal_lock);
+                return i;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&journal_lock);
+
+    // A commit forced by a full transaction may have been followed by a checkpoint
+    if (forced_commit)
+        release_held_blocks();
+    return lba_count;
+}
+
+// Start an operation whose metadata changes must commit together
+// Waits while a full group of operations is being committed
+void journal_begin() {
+    if (depth++ > 0)
+        return;
+
+    pthread_mutex_lock(&journal_lock);
+    while (committing || (active && txn_ops >= JOURNAL_GROUP_OPS))
+        pthread_cond_wait(&journal_idle, &journal_lock);
+    active_ops++;
+    pthread_mutex_unlock(&journal_lock);
+}
+
+// End an operation started with journal_begin()
+// Commits the running transaction once JOURNAL_GROUP_OPS operations joined it and the last of
+// them ended
+void journal_end() {
+    if (depth > 0)
+        depth--;
+
+    if (depth > 0)
+        return;
+
+    pthread_mutex_lock(&journal_lock);
+    if (active_ops > 0)
+        active_ops--;
+
+    if (!active) {
+        pthread_mutex_unlock(&journal_lock);
+        return;
+    }
+
+    stats.operations++;
+    if (++txn_ops < JOURNAL_GROUP_OPS || active_ops > 0 || committing) {
+        pthread_mutex_unlock(&journal_lock);
+        return;
+    }
+
+    committing = true;
+    pthread_mutex_unlock(&journal_lock);
+
+    // Changes still held in memory belong to the operations that joined the transaction
+    dir_cache_flush();
+    flush_freespace();
+
+    pthread_mutex_lock(&journal_lock);
+    commit_transaction();
+    committing = false;
+    pthread_cond_broadcast(&journal_idle);
+    pthread_mutex_unlock(&journal_lock);
+
+    release_held_blocks();
+}
+
+// Write every committed block in place and empty the journal
+int journal_checkpoint() {
+    pthread_mutex_lock(&journal_lock);
+    int result = checkpoint();
+    pthread_mutex_unlock(&journal_lock);
+
+    release_held_blocks();
+    return result;
+}
+
+// Commit and checkpoint everything, call before the volume is closed
+int journal_shutdown() {
+    pthread_mutex_lock(&journal_lock);
+
+    if (!active) {
+        pthread_mutex_unlock(&journal_lock);
+        return 0;
+    }
+
+    int result = 0;
+    if (commit_transaction() != 0 || checkpoint() != 0)
+        result = -1;
+
+    free(txn_blocks);
+    free(txn_buffer);
+    txn_blocks = NULL;
+    txn_buffer = NULL;
+    active = false;
+
+    pthread_mutex_unlock(&journal_lock);
+
+    // Every free is committed and checkpointed, the held blocks are free again
+    release_held_blocks();
+
+    free(covered_blocks);
+    free(held_blocks);
+    free(held_sequence);
+    covered_blocks = NULL;
+    held_blocks = NULL;
+    held_sequence = NULL;
+    covered_capacity = 0;
+    held_capacity = 0;
+    covered_count = 0;
+    held_count = 0;
+
+    return result;
+}
+
+// Copy the current journal counters into out_stats
+void journal_get_stats(struct journal_stats* out_stats) {
+    pthread_mutex_lock(&journal_lock);
+    *out_stats = stats;
+    pthread_mutex_unlock(&journal_lock);
+}
@@ -0,0 +1,144 @@
+/**************************************************************
+* Contains the path lookup cache used by parse_path
+**************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "../include/fsPathCache.h"
+#include "../include/mfs.h"
+
+/*
+ * parse_path looks up one name per path component, and every component in the middle of a
+ * path means loading that directory. The cache remembers each lookup as
+ *
+ *   (start block of the directory, name) -> index, start block, size and type of the entry
+ *
+ * so a path whose components are all cached is resolved without loading the directories in
+ * the middle of it. Names that don't exist are cached too (negative entries), since the shell
+ * checks a path several times before creating it.
+ *
+ * The cache is direct-mapped: each (directory, name) pair has a single slot, and a new lookup
+ * simply replaces whatever held that slot.
+ *
+ * Whoever changes a directory's entries calls path_cache_invalidate() with its start block.
+ * Removing a directory clears the whole cache, since the blocks of the removed directories
+ * (and of everything below them) can be reused by new directories.
+ *
+ * A mutex guards the slots. A lookup is only inserted while its directory is locked, and
+ * writers invalidate before they unlock the directory, so no stale lookup outlives a change.
+ */
+
+typedef struct {
+    bool in_use;
+    int dir_block;                   // Start block of the directory holding the name
+    char name[MAX_NAME_SIZE + 1];    // Name looked up
+    int found;                       // PATH_CACHE_FOUND or PATH_CACHE_NOT_FOUND
+    struct path_cache_result result; // The entry, when found
+} path_cache_slot;
+
+static path_cache_slot slots[PATH_CACHE_SLOTS];
+static struct path_cache_stats stats;
+static pthread_mutex_t path_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Slot of a (directory, name) pair, FNV-1a over the name mixed with the directory
+static int slot_of(int dir_block, const char* name) {
+    unsigned int hash = 2166136261u ^ (unsigned int)dir_block;
+
+    for (const char* c = name; *c != '\0'; c++) {
+        hash ^= (unsigned char)*c;
+        hash *= 16777619u;
+    }
+
+    return hash & (PATH_CACHE_SLOTS - 1);
+}
+
+// Look up a name in a directory
+// Returns PATH_CACHE_FOUND and fills in result, PATH_CACHE_NOT_FOUND, or PATH_CACHE_MISS
+int path_cache_lookup(int dir_block, const char* name, struct path_cache_result* result) {
+    path_cache_slot* slot = &slots[slot_of(dir_block, name)];
+    int found;
+
+    pthread_mutex_lock(&path_cache_lock);
+
+    if (!slot->in_use || slot->dir_block != dir_block || strcmp(slot->name, name) != 0) {
+        stats.misses++;
+        found = PATH_CACHE_MISS;
+    } else if (slot->found == PATH_CACHE_NOT_FOUND) {
+        stats.negative_hits++;
+        found = PATH_CACHE_NOT_FOUND;
+    } else {
+        stats.hits++;
+        *result = slot->result;
+        found = PATH_CACHE_FOUND;
+    }
+
+    pthread_mutex_unlock(&path_cache_lock);
+    return found;
+}
+
+// Remember the result of looking up a name in a directory
+// entry is the entry found at index, or NULL if the name doesn't exist
+void path_cache_insert(int dir_block, const char* name, int index, DirectoryEntry* entry) {
+    // Longer names can't exist, they aren't worth a slot
+    if (strlen(name) > MAX_NAME_SIZE)
+        return;
+
+    path_cache_slot* slot = &slots[slot_of(dir_block, name)];
+
+    pthread_mutex_lock(&path_cache_lock);
+
+    slot->in_use = true;
+    slot->dir_block = dir_block;
+    strcpy(slot->name, name);
+
+    if (entry == NULL) {
+        slot->found = PATH_CACHE_NOT_FOUND;
+    } else {
+        slot->found = PATH_CACHE_FOUND;
+        slot->result.index = index;
+        slot->result.start_block = entry->start_block;
+        slot->result.size = entry->size;
+        slot->result.is_dir = entry->is_dir;
+    }
+
+    pthread_mutex_unlock(&path_cache_lock);
+}
+
+// Forget every lookup in a directory, call whenever its entries change
+void path_cache_invalidate(int dir_block) {
+    pthread_mutex_lock(&path_cache_lock);
+
+    for (int i = 0; i < PATH_CACHE_SLOTS; i++) {
+        if (slots[i].in_use && slots[i].dir_block == dir_block) {
+            slots[i].in_use = false;
+            stats.invalidations++;
+        }
+    }
+
+    pthread_mutex_unlock(&path_cache_lock);
+}
+
+// Forget every lookup
+void path_cache_clear() {
+    pthread_mutex_lock(&path_cache_lock);
+
+    for (int i = 0; i < PATH_CACHE_SLOTS; i++) {
+        if (slots[i].in_use) {
+            slots[i].in_use = false;
+            stats.invalidations++;
+        }
+    }
+
+    pthread_mutex_unlock(&path_cache_lock);
+}
+
+// Copy the current cache counters into out_stats
+void path_cache_get_stats(struct path_cache_stats* out_stats) {
+    pthread_mutex_lock(&path_cache_lock);
+    *out_stats = stats;
+    pthread_mutex_unlock(&path_cache_lock);
+}
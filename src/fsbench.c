@@ -0,0 +1,165 @@
+/**************************************************************
+* Multi-threaded benchmark of the file system, reports the
+* throughput of file operations as threads are added
+**************************************************************/
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "../include/fsLow.h"
+#include "../include/mfs.h"
+#include "../include/b_io.h"
+#include "../include/fsAllocCache.h"
+#include "keyDirFunctions.c"
+
+/*
+ * Each thread works in a directory of its own: it creates a file, writes it, reads it back,
+ * stats it and deletes it, over and over. The threads only share the structures underneath
+ * (the free space map, the root directory, the journal and the block cache), so the numbers
+ * show how much of the work runs in parallel. The run is repeated with 1, 2, 4 and 8 threads,
+ * each thread doing the same number of files, and the files per second are printed, followed
+ * by how many allocations the threads' allocation caches served without the free space lock.
+ */
+
+#define BENCH_FILES_PER_THREAD 200 // Files each thread goes through
+#define BENCH_FILE_SIZE 4096       // Bytes written to and read from each file
+#define BENCH_MAX_THREADS 8
+
+struct bench_thread {
+    pthread_t thread;
+    int id;
+    int errors;
+};
+
+static void* bench_worker(void* arg) {
+    struct bench_thread* worker = arg;
+    char directory[64];
+    char path[96];
+    char data[BENCH_FILE_SIZE];
+    char check[BENCH_FILE_SIZE];
+
+    snprintf(directory, sizeof(directory), "/bench%d", worker->id);
+    if (fs_mkdir(directory, 0777) != 0) {
+        worker->errors++;
+        return NULL;
+    }
+
+    memset(data, 'a' + worker->id, sizeof(data));
+
+    for (int i = 0; i < BENCH_FILES_PER_THREAD; i++) {
+        snprintf(path, sizeof(path), "%s/file%d", directory, i);
+
+        b_io_fd fd = b_open(path, O_WRONLY | O_CREAT | O_TRUNC);
+        if (fd < 0 || b_write(fd, data, sizeof(data)) != sizeof(data)) {
+            worker->errors++;
+            if (fd >= 0)
+                b_close(fd);
+            continue;
+        }
+        b_close(fd);
+
+        fd = b_open(path, O_RDONLY);
+        if (fd < 0 || b_read(fd, check, sizeof(check)) != sizeof(check) ||
+            memcmp(data, check, sizeof(data)) != 0)
+            worker->errors++;
+        if (fd >= 0)
+            b_close(fd);
+
+        struct fs_stat stat_buf;
+        if (fs_stat(path, &stat_buf) != 0 || stat_buf.st_size != sizeof(data))
+            worker->errors++;
+
+        if (fs_delete(path) != 0)
+            worker->errors++;
+    }
+
+    if (fs_rmdir(directory) != 0)
+        worker->errors++;
+
+    return NULL;
+}
+
+// Run the workload with thread_count threads, returns the files per second
+static double bench_run(int thread_count, int* errors) {
+    struct bench_thread workers[BENCH_MAX_THREADS];
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int i = 0; i < thread_count; i++) {
+        workers[i].id = i;
+        workers[i].errors = 0;
+        pthread_create(&workers[i].thread, NULL, bench_worker, &workers[i]);
+    }
+
+    *errors = 0;
+    for (int i = 0; i < thread_count; i++) {
+        pthread_join(workers[i].thread, NULL);
+        *errors += workers[i].errors;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return (double)thread_count * BENCH_FILES_PER_THREAD / seconds;
+}
+
+int main (int argc, char * argv[]) {
+    char * filename;
+    uint64_t volumeSize;
+    uint64_t blockSize;
+    int retVal;
+
+    if (argc > 3) {
+        filename = argv[1];
+        volumeSize = atoll (argv[2]);
+        blockSize = atoll (argv[3]);
+    }
+    else {
+        printf ("Usage: fsbench volumeFileName volumeSize blockSize\n");
+        return -1;
+    }
+
+    retVal = startPartitionSystem (filename, &volumeSize, &blockSize);
+    if (retVal != PART_NOERROR) {
+        printf ("Start Partition Failed:  %d\n", retVal);
+        return (retVal);
+    }
+
+    retVal = initFileSystem (volumeSize / blockSize, blockSize);
+    if (retVal != 0) {
+        printf ("Initialize File System Failed:  %d\n", retVal);
+        closePartitionSystem();
+        return (retVal);
+    }
+
+    printf ("\n%8s %14s %10s %8s\n", "threads", "files/sec", "speedup", "errors");
+
+    double single_thread = 0;
+    for (int thread_count = 1; thread_count <= BENCH_MAX_THREADS; thread_count *= 2) {
+        int errors;
+        double rate = bench_run(thread_count, &errors);
+
+        if (thread_count == 1)
+            single_thread = rate;
+
+        printf ("%8d %14.0f %9.2fx %8d\n", thread_count, rate, rate / single_thread, errors);
+    }
+
+    struct alloc_cache_stats alloc_stats;
+    alloc_cache_get_stats(&alloc_stats);
+    printf ("\nAllocation caches: %lu allocations and %lu frees without the free space lock, "
+            "%lu refills, %lu reclaims\n", (unsigned long)alloc_stats.allocations,
+            (unsigned long)alloc_stats.frees, (unsigned long)alloc_stats.refills,
+            (unsigned long)alloc_stats.reclaims);
+
+    exitFileSystem();
+    closePartitionSystem();
+    return 0;
+}
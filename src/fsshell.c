@@ -6,6 +6,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <stdio.h>
 #include <readline/readline.h>
 #include <readline/history.h>
@@ -21,6 +22,7 @@
 #define SINGLE_QUOTE	0x27
 #define DOUBLE_QUOTE	0x22
 #define BUFFERLEN		200
+#define COPYBUFFER		(64 * 1024)	// File buffer size for the copy destinations
 #define DIRMAX_LEN		4096
 
 #define CMDLS_ON	1
@@ -89,19 +91,19 @@ int displayFiles (fdDir * dirp, int flall, int fllong)
 	struct fs_diriteminfo * di;
 	struct fs_stat statbuf;
 	
-	di = fs_readdir (dirp);
+	// The entries come with their stat data, no path is resolved per entry
+	di = fs_readdirplus (dirp, &statbuf);
 	printf("\n");
 	while (di != NULL) {
 		if ((di->d_name[0] != '.') || (flall)) { // If not all and starts with '.' it is hidden 
 			if (fllong) {
-				fs_stat (di->d_name, &statbuf);
-				printf ("%s    %9ld   %s\n", fs_isDir(di->d_name)?"D":"-", statbuf.st_size, di->d_name);
+				printf ("%s    %9ld   %s\n", (di->fileType == FT_DIRECTORY)?"D":"-", statbuf.st_size, di->d_name);
 			}
 			else {
 				printf ("%s\n", di->d_name);
 			}
 		}
-		di = fs_readdir (dirp);
+		di = fs_readdirplus (dirp, &statbuf);
 	}
 	fs_closedir (dirp);
 #endif
@@ -298,7 +300,13 @@ int cmd_cp (int argcnt, char *argvec[]) {
 	
 	
 	testfs_src_fd = b_open (src, O_RDONLY);
-	testfs_dest_fd = b_open (dest, O_WRONLY | O_CREAT | O_TRUNC);
+	testfs_dest_fd = b_open_buffered (dest, O_WRONLY | O_CREAT | O_TRUNC, COPYBUFFER);
+
+	// The size of the copy is known, allocate its blocks as one run up front
+	struct fs_stat src_stat;
+	if (fs_stat (src, &src_stat) == 0 && src_stat.st_size > 0)
+		b_fallocate (testfs_dest_fd, 0, src_stat.st_size, B_FALLOC_KEEP_SIZE);
+
 	do {
 		readcnt = b_read (testfs_src_fd, buf, BUFFERLEN);
 		b_write (testfs_dest_fd, buf, readcnt);
@@ -442,8 +450,14 @@ int cmd_cp2fs (int argcnt, char *argvec[]) {
 			return (-1);
 	}
 	
-	testfs_fd = b_open (dest, O_WRONLY | O_CREAT | O_TRUNC);
+	testfs_fd = b_open_buffered (dest, O_WRONLY | O_CREAT | O_TRUNC, COPYBUFFER);
 	linux_fd = open (src, O_RDONLY);
+
+	// The size of the copy is known, allocate its blocks as one run up front
+	struct stat src_stat;
+	if (fstat (linux_fd, &src_stat) == 0 && src_stat.st_size > 0)
+		b_fallocate (testfs_fd, 0, src_stat.st_size, B_FALLOC_KEEP_SIZE);
+
 	do {
 		readcnt = read (linux_fd, buf, BUFFERLEN);
 		b_write (testfs_fd, buf, readcnt);
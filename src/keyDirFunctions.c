@@ -13,9 +13,19 @@
 #include "../include/mfs.h"
 #include "../include/fsHelperFuncs.h"
 #include "../include/fsDirectory.h"
+#include "../include/fsExtent.h"
+#include "../include/fsPathCache.h"
+#include "../include/fsDirCache.h"
+#include "../include/fsJournal.h"
 
+// The caller holds the tree lock and the directory holding dir_to_remove locked exclusive
 void remove_attached_dirs(DirectoryEntry *dir_to_remove){
     DirectoryEntry* dir = load_dir(dir_to_remove);
+    if (dir == NULL)
+        return;
+
+    // Whoever got the directory before the tree was locked may still be changing it
+    lock_dir(dir, DIR_LOCK_EXCLUSIVE);
 
     int num_DE = dir[0].size / sizeof(DirectoryEntry);
     
@@ -33,11 +43,15 @@ void remove_attached_dirs(DirectoryEntry *dir_to_remove){
     }
 
     clear_freespace(dir->start_block);
-    free(dir);
+
+    // The directory is gone, it must not be written back or handed out again
+    dir_cache_forget(dir->start_block);
+    unlock_dir(dir);
+    free_directory(dir);
 }
 
 // Make a directory
-int fs_mkdir(const char *pathname, mode_t mode) {
+static int make_directory(const char *pathname, mode_t mode) {
     struct parse_path_return_data parse_path_info;
 
     // Invalid path
@@ -45,20 +59,34 @@ int fs_mkdir(const char *pathname, mode_t mode) {
         fprintf(stderr, "\nINVALID PATH. ERROR: %d\n", -1);
 		return -1; 
 	} 
+    // The parent was removed meanwhile
+    if (lock_parent(&parse_path_info, DIR_LOCK_EXCLUSIVE) != 0) {
+        free_directory(parse_path_info.parent);
+        fprintf(stderr, "\nINVALID PATH. ERROR: %d\n", -1);
+        return -1;
+    }
     // Last element is found, so you can’t make the dir cuz it already exists.
 	if (parse_path_info.last_element_index != -1) {
+        unlock_dir(parse_path_info.parent);
         free_directory(parse_path_info.parent);
         fprintf(stderr, "\nFILE OR DIRECTORY EXISTS. ERROR: %d\n", -2);
         return -2; // File or directory exists
 	}
     //check the size of the name of the directory to be created 
     if(strlen(parse_path_info.last_element_name) > MAX_NAME_SIZE){
+        unlock_dir(parse_path_info.parent);
+        free_directory(parse_path_info.parent);
         fprintf(stderr, "\nNAME SIZE TOO BIG. ERROR\n");
         return -1;
     }
 
     // Create the new directory
     DirectoryEntry* new_dir = create_directory(parse_path_info.parent, MAX_DIR_ENTRIES);
+    if (new_dir == NULL) {
+        unlock_dir(parse_path_info.parent);
+        free_directory(parse_path_info.parent);
+        return -1;
+    }
 
     int index = get_available_DE_index(parse_path_info.parent);
     // Copy the last element of the path to the next available index in the parent
@@ -69,37 +97,63 @@ int fs_mkdir(const char *pathname, mode_t mode) {
     parse_path_info.parent[index].creation_time = new_dir[0].creation_time;
     parse_path_info.parent[index].modification_time = new_dir[0].modification_time;
     parse_path_info.parent[index].access_time = new_dir[0].access_time;
+    clear_inline_extents(&parse_path_info.parent[index]);
 
     // Update access and modifie time for the parent
     time_t actual_time = time(NULL);
     parse_path_info.parent[0].modification_time = actual_time;
     parse_path_info.parent[0].access_time = actual_time;
 
-    // Rewrite the parent to the drive
-	write_dir(parse_path_info.parent);
+    // Rewrite the changed entries of the parent to the drive
+	write_dir_entry(parse_path_info.parent, index);
+	write_dir_entry(parse_path_info.parent, 0);
+    path_cache_invalidate(parse_path_info.parent[0].start_block);
+    unlock_dir(parse_path_info.parent);
     free_directory(parse_path_info.parent);
     free_directory(new_dir);
 
 	return 0;
 }
 
+// Make a directory, as one journal transaction
+int fs_mkdir(const char *pathname, mode_t mode) {
+    // The new directory, its blocks and its entry in the parent commit together
+    // The operation is started before the parent is locked, a group commit may be waited for
+    journal_begin();
+    int result = make_directory(pathname, mode);
+    journal_end();
+
+    return result;
+}
+
 // Remove a directory
-int fs_rmdir(const char *pathname) {
+static int remove_directory(const char *pathname) {
     struct parse_path_return_data parse_path_info;
 
     // Invalid path
 	if (parse_path((char*) pathname, &parse_path_info) != 0) {
 		return -1; 
 	} 
+    // The parent was removed meanwhile
+    if (lock_parent(&parse_path_info, DIR_LOCK_EXCLUSIVE) != 0) {
+        free_directory(parse_path_info.parent);
+        return -1;
+    }
     // Last element doesn't exist, so you can't delete it
 	if (parse_path_info.last_element_index == -1) {
+        unlock_dir(parse_path_info.parent);
         free_directory(parse_path_info.parent);
         return -3; // File or directory exists
 	}
     int index = parse_path_info.last_element_index;
 
     // Free all directories and files attached to the directory to remove
+    // The FAT changes of the whole subtree are written together once it has been released
+    // The mode only holds back this thread's changes, other threads keep flushing theirs
+    int previous_flush_mode = set_freespace_flush_mode(FAT_FLUSH_DEFERRED);
     remove_attached_dirs(&parse_path_info.parent[index]);
+    set_freespace_flush_mode(previous_flush_mode);
+    flush_freespace();
 
     // Update the parent 
     strcpy(parse_path_info.parent[index].name, "");
@@ -107,13 +161,31 @@ int fs_rmdir(const char *pathname) {
     parse_path_info.parent[0].modification_time = actual_time;
     parse_path_info.parent[0].access_time = actual_time;
     
-    // Rewrite the parent to the drive
-	write_dir(parse_path_info.parent);
+    // Rewrite the changed entries of the parent to the drive
+	write_dir_entry(parse_path_info.parent, index);
+	write_dir_entry(parse_path_info.parent, 0);
+
+    // The blocks of the removed directories may be reused, forget every cached lookup
+    path_cache_clear();
+    unlock_dir(parse_path_info.parent);
     free_directory(parse_path_info.parent);
 
 	return 0;
 }
 
+// Remove a directory, as one journal transaction
+int fs_rmdir(const char *pathname) {
+    // Every directory and file removed commits together
+    // No path is resolved through the directories while they are removed
+    journal_begin();
+    lock_tree();
+    int result = remove_directory(pathname);
+    unlock_tree();
+    journal_end();
+
+    return result;
+}
+
 
 
 
@@ -13,9 +13,12 @@
 #include "../include/mfs.h"
 #include "../include/fsHelperFuncs.h"
 #include "../include/fsDirectory.h"
+#include "../include/fsPathCache.h"
+#include "../include/fsDirCache.h"
+#include "../include/fsJournal.h"
 #include <errno.h>
 
-// Initialize a global variable
+// Initialize a global variable, guarded with fs_dir_curr by lock_cwd()
 char cwd_str[1024] = {'.'};
 
 char* simplifyPath(char* path) {
@@ -23,7 +26,7 @@ char* simplifyPath(char* path) {
     int path_len = strlen(path);
     char** stack = malloc(path_len * sizeof(char*));
     int top = -1;
-    char* result = malloc(path_len + 1);
+    char* result = malloc(path_len + 2); // Room for the "/" added after the last name
     char* token;
     // Initialize result
     strcpy(result, "/");
@@ -60,8 +63,11 @@ char* simplifyPath(char* path) {
 
 // Retrieve the current working directory 
 char * fs_getcwd(char *pathname, size_t size) {
+    lock_cwd();
+
     // Check if the current directory pointer is valid
     if (fs_dir_curr == NULL) {
+        unlock_cwd();
         fprintf(stderr, "Error: Current directory pointer is null.\n");
         return NULL;
     }
@@ -71,16 +77,19 @@ char * fs_getcwd(char *pathname, size_t size) {
         // Allocate memory if pathname is not provided
         pathname = malloc(needed_size);
         if (pathname == NULL) {
+            unlock_cwd();
             fprintf(stderr, "Error: Memory allocation failed for current working directory.\n");
             return NULL;
         }
     } else if (size < needed_size) {
         // Check if provided buffer is large enough
+        unlock_cwd();
         fprintf(stderr, "Error: Buffer too small for current working directory.\n");
         return NULL;
     }
     // Copy the directory name to the pathname buffer
     strcpy(pathname, cwd_str);
+    unlock_cwd();
     return pathname;
 }
 
@@ -98,21 +107,42 @@ int fs_setcwd(char *pathname) {
         return -1; // Fail if the path cannot be parsed correctly
     }
 
+    if (lock_parent(&parse_path_info, DIR_LOCK_SHARED) != 0) {
+        free_directory(parse_path_info.parent);
+        fprintf(stderr, "Error: Path parsing failed in fs_setcwd.\n");
+        return -1; // The parent was removed meanwhile
+    }
+
     int index = parse_path_info.last_element_index;
 
     // Validate that the parsed path refers to a directory
     if (index == -1 || 
        (index != -2 && parse_path_info.parent[index].is_dir != FILE_TYPE_DIRECTORY)) {
+        unlock_dir(parse_path_info.parent);
+        free_directory(parse_path_info.parent);
         fprintf(stderr, "Error: Path does not refer to a valid directory.\n");
         return -1; // Fail if the target is not a directory or doesn't exist
     }
 
     // Update the current directory based on parsed path
+    DirectoryEntry* new_dir;
     if(index == -2) {
-        fs_dir_curr = fs_dir_root;
+        new_dir = dir_cache_hold(fs_dir_root);
     } else {
-        fs_dir_curr = load_dir(&parse_path_info.parent[index]);
+        new_dir = load_dir(&parse_path_info.parent[index]);
+    }
+    unlock_dir(parse_path_info.parent);
+    free_directory(parse_path_info.parent);
+
+    if (new_dir == NULL) {
+        fprintf(stderr, "Error: Directory failed to load in fs_setcwd.\n");
+        return -1;
     }
+
+    // fs_dir_curr holds the new directory, the previous one is released
+    lock_cwd();
+    DirectoryEntry* old_dir = fs_dir_curr;
+    fs_dir_curr = new_dir;
     
     // Update the 'cwd_str' to reflect the new directory
     if (pathname[0] == '/') {
@@ -134,6 +164,8 @@ int fs_setcwd(char *pathname) {
     if(!strcmp(cwd_str, "/")) {
         strcpy(cwd_str, ".");
     }
+    unlock_cwd();
+    free_directory(old_dir);
 
     return 0; // Return success
 }
@@ -147,20 +179,22 @@ int fs_isFile(char * filename) {
         return 0;
     }
 
+    if (lock_parent(&parse_path_info, DIR_LOCK_SHARED) != 0) {
+        free_directory(parse_path_info.parent);
+        return 0;
+    }
+
     int index = parse_path_info.last_element_index;
+    int is_file = index >= 0 && parse_path_info.parent[index].is_dir == FILE_TYPE_REGULAR;
+    unlock_dir(parse_path_info.parent);
+    free_directory(parse_path_info.parent);
 
     if (index < 0) {
-        free_directory(parse_path_info.parent);
         fprintf(stderr, "File or directory not found.\n");
         return -2;
     }
 
-    if (parse_path_info.parent[index].is_dir == FILE_TYPE_REGULAR) {
-        free_directory(parse_path_info.parent);
-        return 1;
-    }
-    free_directory(parse_path_info.parent);
-    return 0;
+    return is_file;
 }
 
 // Returns 1 if is directory, 0 otherwise
@@ -171,24 +205,27 @@ int fs_isDir(char * pathname) {
     if (parse_path(pathname, &parse_path_info) != 0) {
         return 0;
     }
+
+    if (lock_parent(&parse_path_info, DIR_LOCK_SHARED) != 0) {
+        free_directory(parse_path_info.parent);
+        return 0;
+    }
+
     int index = parse_path_info.last_element_index;
+    int is_dir = index >= 0 && parse_path_info.parent[index].is_dir == FILE_TYPE_DIRECTORY;
+    unlock_dir(parse_path_info.parent);
+    free_directory(parse_path_info.parent);
 
     if (index < 0) {
-        free_directory(parse_path_info.parent);
         fprintf(stderr, "File or directory not found.\n");
         return -2;
     }
 
-    if (parse_path_info.parent[index].is_dir == FILE_TYPE_DIRECTORY) {
-        free_directory(parse_path_info.parent);
-        return 1;
-    }
-    free_directory(parse_path_info.parent);
-    return 0;
+    return is_dir;
 }
 
 // Removes a file
-int fs_delete(char *filename) {
+static int delete_file(char *filename) {
     if (filename == NULL) {
         fprintf(stderr, "Error: NULL filename provided to fs_delete.\n");
         return -1; // Fail if filename is NULL
@@ -200,8 +237,15 @@ int fs_delete(char *filename) {
         return -1; // Fail if the path cannot be parsed correctly
     }
 
+    if (lock_parent(&parse_path_info, DIR_LOCK_EXCLUSIVE) != 0) {
+        free_directory(parse_path_info.parent);
+        fprintf(stderr, "Error: Path parsing failed in fs_delete.\n");
+        return -1; // The parent was removed meanwhile
+    }
+
     int index = parse_path_info.last_element_index;
     if (index < 0) {
+        unlock_dir(parse_path_info.parent);
         free_directory(parse_path_info.parent);
         fprintf(stderr, "Error: File not found in fs_delete.\n");
         return -1; // Fail if the file doesn't exist
@@ -209,6 +253,7 @@ int fs_delete(char *filename) {
 
     DirectoryEntry target_entry = parse_path_info.parent[index];
     if (target_entry.is_dir == FILE_TYPE_DIRECTORY) {
+        unlock_dir(parse_path_info.parent);
         free_directory(parse_path_info.parent);
         fprintf(stderr, "Error: Attempted to delete a directory with fs_delete.");
         fprintf(stderr, " Use fs_rmdir for directories.\n");
@@ -226,12 +271,25 @@ int fs_delete(char *filename) {
     parse_path_info.parent[0].access_time = actual_time;
 
     // Update changes to disk
-    write_dir(parse_path_info.parent);
+    write_dir_entry(parse_path_info.parent, index);
+    write_dir_entry(parse_path_info.parent, 0);
+    path_cache_invalidate(parse_path_info.parent[0].start_block);
+    unlock_dir(parse_path_info.parent);
     free_directory(parse_path_info.parent);
 
     return 0;
 }
 
+// Removes a file, as one journal transaction
+int fs_delete(char *filename) {
+    // The freed blocks and the cleared entry commit together
+    journal_begin();
+    int result = delete_file(filename);
+    journal_end();
+
+    return result;
+}
+
 // Fill fs_stat buffer with data from the path provided
 int fs_stat(const char *path, struct fs_stat *buf) {
     struct parse_path_return_data parse_path_info;
@@ -241,22 +299,76 @@ int fs_stat(const char *path, struct fs_stat *buf) {
         return -1;
     }
 
+    if (lock_parent(&parse_path_info, DIR_LOCK_SHARED) != 0) {
+        free_directory(parse_path_info.parent);
+        return -1;
+    }
+
     int index = parse_path_info.last_element_index;
 
     if (index < 0) {
+        unlock_dir(parse_path_info.parent);
         free_directory(parse_path_info.parent);
         fprintf(stderr, "File or directory not found.\n");
         return -2;
     }
 
-    buf->st_size = parse_path_info.parent[index].size;
-    buf->st_blksize = fs_vcb->size_of_blocks;
-    buf->st_blocks = retrieve_num_of_blocks(parse_path_info.parent[index].size, BLOCK_SIZE);
-    buf->st_accesstime = parse_path_info.parent[index].access_time;
-    buf->st_modtime = parse_path_info.parent[index].modification_time;
-    buf->st_createtime = parse_path_info.parent[index].creation_time;
+    fill_stat_from_DE(&parse_path_info.parent[index], buf);
 
+    unlock_dir(parse_path_info.parent);
     free_directory(parse_path_info.parent);
 
     return 0;
+}
+
+/*
+ * Fill bufs[i] with the data of names[i] in the directory at dirpath, for count names
+ * The directory is resolved and loaded once for all of them, the names are looked up in it
+ * A name that isn't in the directory gets an st_size of -1
+ * Returns the number of names found, -1 if dirpath isn't a directory
+ */
+int fs_stat_batch(const char *dirpath, char *names[], int count, struct fs_stat *bufs) {
+    struct parse_path_return_data parse_path_info;
+
+    if (parse_path((char*) dirpath, &parse_path_info) != 0)
+        return -1;
+
+    if (lock_parent(&parse_path_info, DIR_LOCK_SHARED) != 0) {
+        free_directory(parse_path_info.parent);
+        return -1;
+    }
+
+    int index = parse_path_info.last_element_index;
+    if (index < 0 || !is_DE_a_directory(&parse_path_info.parent[index])) {
+        unlock_dir(parse_path_info.parent);
+        free_directory(parse_path_info.parent);
+        fprintf(stderr, "Directory not found.\n");
+        return -1;
+    }
+
+    DirectoryEntry* dir = load_dir(&parse_path_info.parent[index]);
+    unlock_dir(parse_path_info.parent);
+    free_directory(parse_path_info.parent);
+    if (dir == NULL)
+        return -1;
+
+    lock_dir(dir, DIR_LOCK_SHARED);
+
+    int found = 0;
+    for (int i = 0; i < count; i++) {
+        int entry = get_DE_index(dir, names[i]);
+
+        if (entry < 0 || strcmp(names[i], "") == 0) {
+            memset(&bufs[i], 0, sizeof(struct fs_stat));
+            bufs[i].st_size = -1;
+            continue;
+        }
+
+        fill_stat_from_DE(&dir[entry], &bufs[i]);
+        found++;
+    }
+
+    unlock_dir(dir);
+    free_directory(dir);
+    return found;
 }
\ No newline at end of file